@@ -12,8 +12,11 @@
  *      INCLUDES
  *********************/
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -23,10 +26,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/eventfd.h>
 #include <sys/utsname.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <string>
 #include <iostream>
 
@@ -34,9 +39,15 @@
 #include <mosquitto.h>
 
 #include "1820tag.h"
+#include "tagtable.h"
 #include "mqtt.h"
-#include "1820bridge.h"
 #include "dev1820.h"
+#include "devpoll.h"
+#include "ttybaud.h"
+#include "scheduler.h"
+#include "pubqueue.h"
+#include "topictrie.h"
+#include "1820bridge.h"
 
 using namespace std;
 using namespace libconfig;
@@ -48,13 +59,28 @@ const int version_minor = 0;
 #define CFG_DEFAULT_FILENAME "1820bridge.cfg"
 #define CFG_DEFAULT_FILEPATH "/etc/"
 
-#define MAIN_LOOP_INTERVAL_MINIMUM 50     // milli seconds
-#define MAIN_LOOP_INTERVAL_MAXIMUM 2000   // milli seconds
-
 #define MQTT_BROKER_DEFAULT "127.0.0.1"
 #define MQTT_CLIENT_ID "1820bridge"
 #define MQTT_RECONNECT_INTERVAL 10			// seconds between reconnect attempts
 
+#define DEV_READ_TIMEOUT 1000				// ms, max wait for device input
+#define DEV_READ_BATCH_SIZE 64				// max samples processed per mutex lock
+
+#define UPDATE_CYCLE_ARRIVAL 0				// update_cycle of tags published on arrival
+#define UPDATE_CYCLE_SLICE_MIN 10			// ms, min time between slices of a spread cycle
+#define NSEC_PER_SEC 1000000000LL
+
+#define HISTORY_TOPIC_DEFAULT "1820bridge/history"
+#define HISTORY_SAMPLE_LEN (TAG_VALUE_LEN + 40)	// max payload bytes per history sample
+
+#define MQTT_STATS_INTERVAL_DEFAULT 60		// seconds between acknowledgement statistics
+
+#define QUEUE_MEMORY_DEFAULT 65536			// bytes
+#define QUEUE_RATE_DEFAULT 50				// messages per second published from the queue
+#define QUEUE_DRAIN_INTERVAL_MIN 10			// ms, min time between batches from the queue
+
+#define SUBSCRIPTION_MATCH_MAX 32			// max mqtt_tags entries matched by one message
+
 static string cpu_temp_topic = "";
 static string cfgFileName;
 static string processName;
@@ -65,18 +91,50 @@ char *info_label_text;
 
 bool mqttDebugEnabled = false;
 time_t mqtt_connect_time = 0;			// time the connection was initiated
-time_t mqtt_next_connect_time = 0;		// time when next connect is scheduled
+volatile bool mqtt_reconnect_request = false;	// main loop to schedule a reconnect
+int mqtt_reconnect_timer = -1;			// scheduler timer for reconnect
 bool mqtt_connection_in_progress = false;
 bool mqtt_retain_default = false;
-
-useconds_t mainloopinterval = 250;	// milli seconds
+bool mqtt_timestamp_default = false;
+int mqtt_message_expiry_default = 0;	// [s] MQTT 5 message expiry interval, 0 = none
+int mqtt_qos_default = 0;
+string mqtt_stats_topic = "";			// acknowledgement statistics, "" = not published
+int mqtt_stats_interval = MQTT_STATS_INTERVAL_DEFAULT;
+int mqtt_stats_timer = -1;				// scheduler timer for the statistics
+std::atomic<bool> mqtt_window_open(false);	// the in-flight window is no longer full
+bool *publishDeferred = NULL;			// per tag, not published because the in-flight window was full
+int publishDeferredCount = 0;
+
+int history_size = 0;					// samples kept per tag, 0 = no history
+string history_topic = HISTORY_TOPIC_DEFAULT;
+string history_get_topic;				// history_topic + "/get/", prefix of the requests
+volatile bool history_ready = false;	// tags are configured, requests can be served
+tag_sample *history_samples = NULL;		// samples of a history request
+char *history_buf = NULL;				// payload of a history response
+int history_buf_size = 0;
+
+bool queue_enabled = false;				// queue samples while the broker is not connected
+int queue_rate = QUEUE_RATE_DEFAULT;	// messages per second published from the queue
+int queue_timer = -1;					// scheduler timer draining the queue
+PubQueue pubQueue;						// samples waiting for the broker
+pubqueue_entry queue_entry;				// message taken from the queue
+
+subscription *subscriptions = NULL;		// mqtt_tags, values received via MQTT
+int subscriptionCount = 0;
+TopicTrie subscriptionTrie;				// topic filter -> index of subscriptions
+volatile bool subscriptions_ready = false;	// tags are configured, received values can be stored
+
+useconds_t min_time = 99999999, max_time = 0;	// cpu time of update cycles [us]
 struct timespec lastAccTime;		// last accumulation run
 double accPwr;						// power readout accumulator (reset)
 double accPwrChg, accPwrDsc;		// power accumulator (no reset)
 
 updatecycle *updateCycles = NULL;	// array of update cycle definitions
-Tag *tags = NULL;					// array of all 1820 tags
-int tagCount = -1;					// number of tags in array
+int *eventTags = NULL;				// tags published on arrival or by exception, -1 = end marker
+std::atomic<bool> *eventPending = NULL;	// per tag, a new value waits to be published
+int *heartbeatTimers = NULL;		// per tag, scheduler timer for the heartbeat, -1 = none
+int *expiryTimers = NULL;			// per tag, scheduler timer for the expiry, -1 = none
+TagTable tagTable;					// all 1820 tags, indexed by channel
 
 #define I2C_DEVICEID_MAX 254		// highest permitted I2C device ID
 #define I2C_DEVICEID_MIN 1			// lowest permitted I2C device ID
@@ -86,16 +144,26 @@ void subscribe_tags(void);
 void mqtt_connection_status(bool status);
 void mqtt_topic_update(const struct mosquitto_message *message);
 void mqtt_subscribe_tags(void);
-void setMainLoopInterval(int newValue);
-bool dev_tags_publish();
-bool mqtt_publish_tag(Tag *tag);
+void mqtt_connect(void);
+bool mqtt_publish_tag(int index, int64_t now);
+bool mqtt_publish_tag_rbe(int index, int64_t now, bool heartbeat);
+bool mqtt_publish_cycle(updatecycle *cycle, int64_t now);
+bool is_rbe_tag(Tag *tag);
+bool event_tags_publish(void);
 void mqtt_clear_tags(bool publish_noread, bool clear_retain);
+void mqtt_history_request(const struct mosquitto_message *message);
+bool mqtt_payload_value(const char *payload, double *value, int64_t *time);
+bool mqtt_defer_tag(int index, Tag *tag);
+void mqtt_window_callback(void);
+bool queue_sample(Tag *tag, const char *value, int64_t updateTime);
 
 MQTT mqtt(MQTT_CLIENT_ID);
 Config cfg;			// config file
-Dev1820 *dev;
+DevPoll devPoll;	// epoll set for all interface devices
+Scheduler scheduler;	// timers of the main loop
+devinterface *devInterfaces = NULL;	// array of interface devices
+int devInterfaceCount = 0;			// number of interface devices
 pthread_t read_thread;
-pthread_mutex_t read_mutex = PTHREAD_MUTEX_INITIALIZER;
 //Hardware hw(false);	// no screen
 
 /**
@@ -133,6 +201,8 @@ void sigHandler(int signum)
 
 	log(LOG_INFO, "Received %s", signame);
 	exitSignal = true;
+	devPoll.wakeup();		// terminate read thread without delay
+	scheduler.wakeup();		// terminate main loop without delay
 }
 
 void timespec_diff(struct timespec *start, struct timespec *stop, struct timespec *result) {
@@ -181,15 +251,6 @@ bool readConfig (void)
 	//log (LOG_INFO, "CFG file read OK");
 	//std::cerr << cfgFileName << " read OK" <<endl;
 
-	try {
-		setMainLoopInterval(cfg.lookup("mainloopinterval"));
-	} catch (const SettingNotFoundException &excp) {
-	;
-	} catch (const SettingTypeException &excp) {
-		std::cerr << "Error in config file <" << excp.getPath() << "> is not an integer" << std::endl;
-		return false;
-	}
-
 	// Read MQTT broker from config
 	try {
 		mqtt.setBroker(cfg.lookup("mqtt.broker"));
@@ -199,6 +260,11 @@ bool readConfig (void)
 		std::cerr << "Error in config file <" << excp.getPath() << "> is not a string" << std::endl;
 		return false;
 	}
+
+	// optional sample history, needed before the broker connection
+	cfg.lookupValue("history.size", history_size);
+	cfg.lookupValue("history.topic", history_topic);
+	history_get_topic = history_topic + "/get/";
 	return true;
 }
 
@@ -226,53 +292,152 @@ bool cfg_get_str(const std::string &path, std::string &value) {
 
 #pragma mark -- Processing
 
-/**
- * Process all variables
- * @return true if at least one variable was processed
- * Note: the return value from this function is used
- * to measure processing time
- */
-bool process() {
-	bool retval = false;
-	if (mqtt.isConnected()) {
-		if (dev_tags_publish()) retval = true;
-	}
-	retval = true;
-	return retval;
-}
-
 #pragma mark MQTT
 
 /**
- * Initialise the tag database (tagstore)
+ * Initialise the subscriptions (mqtt_tags) and build the topic trie
+ * Needed before the broker connection, the tags are configured later
  * @return false on failure
  */
 bool mqtt_init_tags(void) {
-	std::string strValue;
+	int result;
 
 	if (!cfg.exists("mqtt_tags")) {	// optional
 		log(LOG_NOTICE,"configuration - parameter \"mqtt_tags\" does not exist");
-		return false;
+		return true;
+		}
+	try {
+		Setting& tagSettings = cfg.lookup("mqtt_tags");
+		subscriptionCount = tagSettings.getLength();
+		subscriptions = new subscription[subscriptionCount];
+		for (int idx = 0; idx < subscriptionCount; idx++) {
+			if (!tagSettings[idx].lookupValue("topic", subscriptions[idx].topic)) {
+				log(LOG_ERR, "Config error - mqtt_tags entry %d has no \"topic\"", idx);
+				return false;
+			}
+			if (!tagSettings[idx].lookupValue("channel", subscriptions[idx].channel)) {
+				log(LOG_ERR, "Config error - mqtt_tags <%s> has no \"channel\"", subscriptions[idx].topic.c_str());
+				return false;
+			}
+			tagSettings[idx].lookupValue("ignoreretained", subscriptions[idx].ignoreRetained);
+			result = subscriptionTrie.add(subscriptions[idx].topic.c_str(), idx);
+			if (result < 0) {
+				log(LOG_ERR, "Config error - mqtt_tags invalid topic filter <%s>", subscriptions[idx].topic.c_str());
+				return false;
+			}
+			// several entries may share a filter, it is subscribed once
+			subscriptions[idx].subscribe = (result > 0);
 		}
+	} catch (const SettingTypeException &excp) {
+		log(LOG_ERR, "Error in config file <%s> is wrong type", excp.getPath());
+		return false;
+	}
 	return true;
 }
 
+/**
+ * Check the subscriptions once the tags are configured and enable them
+ * A value is only stored if its channel has a tag. A tag which publishes
+ * on a topic subscribed for its own channel would receive its own values.
+ */
+void mqtt_check_subscriptions(void) {
+	int matches[SUBSCRIPTION_MATCH_MAX], count;
+	Tag *tag;
+
+	for (int i = 0; i < subscriptionCount; i++) {
+		if (tagTable.find(subscriptions[i].channel) < 0)
+			log(LOG_WARNING, "mqtt_tags <%s> channel %d has no tag", subscriptions[i].topic.c_str(), subscriptions[i].channel);
+	}
+	for (int index = 0; (subscriptionCount > 0) && (index < tagTable.count()); index++) {
+		tag = tagTable.config(index);
+		if (strlen(tag->getTopic()) == 0) continue;
+		count = subscriptionTrie.match(tag->getTopic(), matches, SUBSCRIPTION_MATCH_MAX);
+		for (int i = 0; i < count; i++) {
+			if (subscriptions[matches[i]].channel == tag->getChannel())
+				log(LOG_WARNING, "tag <%s> receives its own values via mqtt_tags <%s>", tag->getTopic(), subscriptions[matches[i]].topic.c_str());
+		}
+	}
+	subscriptions_ready = true;
+}
+
 void mqtt_connect(void) {
 	if (mqttDebugEnabled)
 		printf("%s - attempting to connect to mqtt broker %s.\n", __func__, mqtt.broker());
 	mqtt.connect();
 	mqtt_connection_in_progress = true;
 	mqtt_connect_time = time(NULL);
-	mqtt_next_connect_time = 0;
 	//printf("%s - Done\n", __func__);
 }
 
+/**
+ * Configure the broker list and how the brokers are used
+ * "brokers" replaces "broker", an entry is "host" or "host:port", the
+ * first entry is the primary broker
+ * @return false on failure
+ */
+bool mqtt_brokers_config(void) {
+	std::string strValue, host;
+	unsigned long port;
+	size_t colon;
+	char *end;
+	int count;
+
+	if (cfg.lookupValue("mqtt.broker_mode", strValue)) {
+		if (strValue == "failover") mqtt.setBrokerMode(MQTT_BROKERS_FAILOVER);
+		else if (strValue == "fanout") mqtt.setBrokerMode(MQTT_BROKERS_FANOUT);
+		else {
+			log(LOG_ERR, "Config error - mqtt unknown \"broker_mode\" <%s> [failover|fanout]", strValue.c_str());
+			return false;
+		}
+	}
+	if (!cfg.exists("mqtt.brokers")) return true;
+	Setting &brokers = cfg.lookup("mqtt.brokers");
+	count = brokers.getLength();
+	if ((count < 1) || (count > MQTT_BROKERS_MAX)) {
+		log(LOG_ERR, "Config error - mqtt \"brokers\" must have 1 to %d entries", MQTT_BROKERS_MAX);
+		return false;
+	}
+	for (int i = 0; i < count; i++) {
+		try {
+			strValue = (const char *)brokers[i];
+		} catch (const SettingTypeException &excp) {
+			log(LOG_ERR, "Config error - mqtt \"brokers\" entry %d is not a string", i);
+			return false;
+		}
+		host = strValue;
+		port = 0;
+		colon = strValue.rfind(':');
+		if (colon != std::string::npos) {
+			host = strValue.substr(0, colon);
+			port = strtoul(strValue.c_str() + colon + 1, &end, 10);
+			if ((*end != 0) || (port == 0) || (port > 65535)) {
+				log(LOG_ERR, "Config error - mqtt \"brokers\" invalid port <%s>", strValue.c_str());
+				return false;
+			}
+		}
+		if (host.empty()) {
+			log(LOG_ERR, "Config error - mqtt \"brokers\" entry %d has no host", i);
+			return false;
+		}
+		if (i == 0) {
+			mqtt.setBroker(host.c_str(), port);
+		} else if (mqtt.addBroker(host.c_str(), port) < 0) {
+			log(LOG_ERR, "Config error - mqtt \"brokers\" can't add <%s>", strValue.c_str());
+			return false;
+		}
+	}
+	if (count > 1)
+		log(LOG_INFO, "MQTT %d brokers, %s", count, (mqtt.brokerMode() == MQTT_BROKERS_FANOUT) ? "fanout" : "failover");
+	return true;
+}
+
 /**
  * Initialise the MQTT broker and register callbacks
  */
 bool mqtt_init(void) {
 	//if (!runningAsDaemon) printf("%s\n", __FUNCTION__);
 	bool bValue;
+	int iValue;
 	if (!runningAsDaemon) {
 		if (cfg.lookupValue("mqtt.debug", bValue)) {
 			mqttDebugEnabled = bValue;
@@ -282,6 +447,36 @@ bool mqtt_init(void) {
 	}
 	if (cfg.lookupValue("mqtt.retain_default", bValue))
 		mqtt_retain_default = bValue;
+	if (cfg.lookupValue("mqtt.timestamp_default", bValue))
+		mqtt_timestamp_default = bValue;
+	if (cfg.lookupValue("mqtt.message_expiry_default", iValue) && (iValue > 0))
+		mqtt_message_expiry_default = iValue;
+	if (cfg.lookupValue("mqtt.qos_default", iValue)) {
+		if ((iValue < 0) || (iValue > 2)) {
+			log(LOG_ERR, "Config error - mqtt unsupported \"qos_default\" %d [0|1|2]", iValue);
+			return false;
+		}
+		mqtt_qos_default = iValue;
+	}
+	if (cfg.lookupValue("mqtt.inflight_max", iValue) && (mqtt.setInflightMax(iValue) < 0)) {
+		log(LOG_ERR, "Config error - mqtt \"inflight_max\" must be > 0");
+		return false;
+	}
+	cfg.lookupValue("mqtt.stats_topic", mqtt_stats_topic);
+	cfg.lookupValue("mqtt.stats_interval", mqtt_stats_interval);
+	if (mqtt_stats_interval <= 0) mqtt_stats_interval = MQTT_STATS_INTERVAL_DEFAULT;
+	mqtt.registerWindowCallback(mqtt_window_callback);
+	if (!mqtt_brokers_config()) return false;
+	if (cfg.lookupValue("mqtt.keepalive", iValue) && (mqtt.setKeepalive(iValue) < 0)) {
+		log(LOG_ERR, "Config error - mqtt \"keepalive\" must be >= 5");
+		return false;
+	}
+	if (cfg.lookupValue("mqtt.version", iValue) && (mqtt.setProtocolVersion(iValue) < 0)) {
+		log(LOG_ERR, "Config error - mqtt unsupported \"version\" %d [4|5]", iValue);
+		return false;
+	}
+	if (!mqtt_init_tags()) return false;
+	mqtt_subscribe_tags();
 	mqtt.registerConnectionCallback(mqtt_connection_status);
 	mqtt.registerTopicUpdateCallback(mqtt_topic_update);
 	mqtt_connect();
@@ -290,22 +485,17 @@ bool mqtt_init(void) {
 
 /**
  * Subscribe tags to MQTT broker
- * Iterate over tag store and process every "subscribe" tag
+ * Subscribes the history requests and the topic filters of mqtt_tags
+ * Called once, the MQTT class subscribes them again on every connect
  */
 void mqtt_subscribe_tags(void) {
-	//mqtt.unsubscribe("vk2ray/pwr/pl20/batv");
-
-	//printf("%s %s - Start\n", __FILE__, __func__);
-/*	Tag* tp = ts.getFirstTag();
-	while (tp != NULL) {
-		if (tp->isSubscribe()) {
-			//printf("%s %s: %s\n", __FILE__, __func__, tp->getTopic());
-			mqtt.subscribe(tp->getTopic());
-		}
-		tp = ts.getNextTag();
+	// history requests for all tags
+	if (history_size > 0) {
+		mqtt.subscribe((history_get_topic + "#").c_str());
+	}
+	for (int i = 0; i < subscriptionCount; i++) {
+		if (subscriptions[i].subscribe) mqtt.subscribe(subscriptions[i].topic.c_str());
 	}
-	//printf("%s - Done\n", __func__);
-*/
 }
 
 /**
@@ -315,13 +505,16 @@ void mqtt_subscribe_tags(void) {
  */
 void mqtt_connection_status(bool status) {
 	//printf("%s %s - %d\n", __FILE__, __func__, status);
-	// subscribe tags when connection is online
+	// the subscriptions are restored by the MQTT class
 	if (status) {
 		log(LOG_INFO, "Connected to MQTT broker [%s]", mqtt.broker());
-		mqtt_next_connect_time = 0;
+		if (mqtt.protocolVersion() == 5)
+			log(LOG_INFO, "MQTT 5, %d topic aliases granted", mqtt.topicAliasMax());
 		mqtt_connection_in_progress = false;
 		mqtt.setRetain(mqtt_retain_default);
-		mqtt_subscribe_tags();
+		// the main loop starts draining the queue and publishes deferred tags
+		mqtt_window_open.store(true, memory_order_release);
+		scheduler.wakeup();
 	} else {
 		if (mqtt_connection_in_progress) {
 			mqtt.disconnect();
@@ -334,7 +527,9 @@ void mqtt_connection_status(bool status) {
 		}
 		// trigger reconnect unless we are exiting
 		if (!exitSignal) {
-			mqtt_next_connect_time = time(NULL) + MQTT_RECONNECT_INTERVAL;	// current time
+			// the reconnect timer is started by the main loop
+			mqtt_reconnect_request = true;
+			scheduler.wakeup();
 			log(LOG_INFO, "mqtt reconnect scheduled in %d seconds", MQTT_RECONNECT_INTERVAL);
 		}
 	}
@@ -344,46 +539,167 @@ void mqtt_connection_status(bool status) {
 /**
  * callback function for MQTT
  * MQTT notifies when a subscribed topic has received an update
- * this function will udate the corresponding tag
+ * the value is stored in the tags of the channels of all matching
+ * mqtt_tags entries, called from the mosquitto thread
  * @param message: mqtt message
  */
 void mqtt_topic_update(const struct mosquitto_message *message) {
-//	if(mqttDebugEnabled) {
-//		printf("%s %s - %s %s\n", __FILE__, __func__, message->topic, (const char*)message->payload );
-//	};
-/*	Tag *tp = ts.getTag(message->topic);
-	if (tp == NULL) {
-		fprintf(stderr, "%s: <%s> not  in ts\n", __func__, message->topic);
+	int matches[SUBSCRIPTION_MATCH_MAX];
+	int count, tag;
+	double value;
+	int64_t time = 0;
+	struct timespec monoTime, realTime;
+	subscription *sub;
+
+	if ((history_size > 0) && (strncmp(message->topic, history_get_topic.c_str(), history_get_topic.length()) == 0)) {
+		mqtt_history_request(message);
+		return;
+	}
+	if (!subscriptions_ready) return;
+	count = subscriptionTrie.match(message->topic, matches, SUBSCRIPTION_MATCH_MAX);
+	if (count == 0) return;
+	// an empty payload clears a retained message, it isn't a value
+	if ((message->payloadlen == 0) || !mqtt_payload_value((const char*)message->payload, &value, &time)) {
+		if (mqttDebugEnabled) printf("%s: <%s> payload is not a value\n", __func__, message->topic);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &monoTime);
+	if (time > 0) {
+		// keep the time of the sample
+		realTime.tv_sec = time / NSEC_PER_SEC;
+		realTime.tv_nsec = time % NSEC_PER_SEC;
 	} else {
-		tp->setValueIsRetained(message->retain);
-		if (message->payload != NULL) {
-			tp->setValue((const char*)message->payload);	// This will trigger a callback to modbus_write_request
+		clock_gettime(CLOCK_REALTIME, &realTime);
+	}
+	for (int i = 0; i < count; i++) {
+		sub = &subscriptions[matches[i]];
+		if (message->retain && sub->ignoreRetained) continue;
+		// the tags of the channel process the value like a sample of the device
+		for (tag = tagTable.find(sub->channel); tag >= 0; tag = tagTable.next(tag)) {
+			tagTable.setValue(tag, value, &monoTime, &realTime);
 		}
-	}*/
+	}
 }
 
 /**
- * Publish tag to MQTT
- * @param tag: I2C tag to publish
- *
+ * Get the value of a received payload
+ * accepts a number or {"value":<number>,"ts":<ns since epoch>} as published
+ * with timestamp
+ * @param payload: null terminated payload
+ * @param value: receives the value
+ * @param time: receives "ts" of the payload, unchanged if there is none
+ * @return false if the payload is not a number
  */
-bool mqtt_publish_tag(Tag *tag) {
-	if(mqttDebugEnabled) {
-		printf("%s %s: - %s %.1f\n", __FILE__, __func__, tag->getTopic(), tag->getScaledValue());
+bool mqtt_payload_value(const char *payload, double *value, int64_t *time) {
+	const char *p;
+	char *end;
+	long long ts;
+
+	while (isspace(*payload)) payload++;
+	if (*payload != '{') {
+		*value = strtod(payload, &end);
+		if (end == payload) return false;
+		while (isspace(*end)) end++;
+		return (*end == 0) && isfinite(*value);
+	}
+	p = strstr(payload, "\"value\":");
+	if (p == NULL) return false;
+	p += 8;
+	*value = strtod(p, &end);
+	if ((end == p) || !isfinite(*value)) return false;
+	p = strstr(payload, "\"ts\":");
+	if (p != NULL) {
+		ts = strtoll(p + 5, &end, 10);
+		if ((end != p + 5) && (ts > 0)) *time = ts;
 	}
-	if (!mqtt.isConnected()) return false;
+	return true;
+}
+
+/**
+ * Serve a history request
+ * A request on <history topic>/get/<tag topic> with the number of samples as
+ * payload (empty = all) is answered on <history topic>/<tag topic> with
+ * [{"value":<value>,"ts":<timestamp>},...], oldest sample first
+ * Called from the mosquitto thread
+ * @param message: mqtt message
+ */
+void mqtt_history_request(const struct mosquitto_message *message) {
+	const char *tagTopic;
+	int index, count, num, len;
+	char value[TAG_VALUE_LEN];
+	Tag *tag;
+
+	if (!history_ready) return;
+	// the topic starts with history_get_topic (see mqtt_topic_update)
+	if (strlen(message->topic) <= history_get_topic.length()) return;
+	tagTopic = &message->topic[history_get_topic.length()];
+	index = tagTable.findTopic(tagTopic);
+	if (index < 0) {
+		if (mqttDebugEnabled) printf("%s: <%s> unknown tag\n", __func__, tagTopic);
+		return;
+	}
+	tag = tagTable.config(index);
+	count = tagTable.historySize();
+	// mosquitto terminates the payload
+	if (message->payloadlen > 0) {
+		num = atoi((const char*)message->payload);
+		if ((num > 0) && (num < count)) count = num;
+	}
+	num = tagTable.getHistory(index, history_samples, count);
+
+	len = snprintf(history_buf, history_buf_size, "[");
+	for (int i = 0; i < num; i++) {
+		if (history_buf_size - len < HISTORY_SAMPLE_LEN) break;
+		// the tag's cached formatted value belongs to the publishing thread
+		if (tag->formatValue(value, sizeof(value), tag->scaleValue(history_samples[i].value)) < 0) continue;
+		len += snprintf(&history_buf[len], history_buf_size - len, "%s{\"value\":%s,\"ts\":%lld}",
+			(len > 1) ? "," : "", value, (long long)history_samples[i].time);
+	}
+	len += snprintf(&history_buf[len], history_buf_size - len, "]");
+	if (len >= history_buf_size) {
+		fprintf(stderr, "%s: payload too long [%s]\n", __func__, tagTopic);
+		return;
+	}
+	mqtt.publishPayload((history_topic + "/" + tagTopic).c_str(), history_buf, len, false);
+}
+
+/**
+ * Publish tag to MQTT
+ * @param index: tag table index of the tag to publish
+ * @param now: current time [ns] (CLOCK_MONOTONIC) for the expiry check
+ */
+bool mqtt_publish_tag(int index, int64_t now) {
+	Tag *tag = tagTable.config(index);
+	tag_value snapshot;
+	const char *value;
+	bool connected = mqtt.isConnected();
+	if (!connected && !queue_enabled) return false;
 
 	// Publish value if it hasn't expired
-	if (!tag->isExpired()) {
-		// mutex lock prevents this thread from reading while read 
-		// thread is writing a new value
-		pthread_mutex_lock(&read_mutex);
-		mqtt.publish(tag->getTopic(), tag->getFormat(), tag->getScaledValue(), tag->getPublishRetain());
-		pthread_mutex_unlock(&read_mutex);
+	if (!tagTable.isExpired(index, now)) {
+		// the snapshot is consistent even if the read thread
+		// writes a new value meanwhile
+		tagTable.getValue(index, &snapshot);
+		if(mqttDebugEnabled) {
+			printf("%s %s: - %s %.1f\n", __FILE__, __func__, tag->getTopic(), tag->scaleValue(snapshot.value));
+		}
+		value = tag->getFormattedValue(tag->scaleValue(snapshot.value));
+		if (value == NULL) {
+			fprintf(stderr, "%s: formatted value too long [%s]\n", __func__, tag->getTopic());
+			return false;
+		}
+		if (!connected) return queue_sample(tag, value, snapshot.updateTime);
+		if (mqtt_defer_tag(index, tag)) return false;
+		if (tag->getPublishTimestamp())
+			mqtt.publish(tag->getTopic(), value, snapshot.updateTime, tag->getPublishRetain(), tag->getMessageExpiry(), tag->getQos());
+		else
+			mqtt.publish(tag->getTopic(), value, tag->getPublishRetain(), tag->getMessageExpiry(), tag->getQos());
 		//printf("%s %s - %s \n", __FILE__, __FUNCTION__, tag->getTopic());
 		return true;
 	}
 	//printf("%s - NoRead: %s \n", __FUNCTION__, tag->getTopic());
+	// there is no sample to queue
+	if (!connected) return false;
 	// Handle Noread
 	// noreadignore is exceeded, need to take action
 	switch (tag->getNoreadAction()) {
@@ -391,7 +707,9 @@ bool mqtt_publish_tag(Tag *tag) {
 		mqtt.clear_retained_message(tag->getTopic());
 		break;
 	case 1:	// publish noread value
-		mqtt.publish(tag->getTopic(), tag->getFormat(), tag->getNoreadValue(), tag->getPublishRetain());
+		value = tag->getFormattedValue(tag->getNoreadValue());
+		if (value != NULL)
+			mqtt.publish(tag->getTopic(), value, tag->getPublishRetain(), tag->getMessageExpiry(), tag->getQos());
 		break;
 	default:
 		// do nothing (default, -1)
@@ -400,6 +718,287 @@ bool mqtt_publish_tag(Tag *tag) {
 	return true;
 }
 
+/**
+ * Publish tag to MQTT by exception
+ * The tag is published when its scaled value has moved beyond the deadband
+ * and the formatted value differs from the last published one, or when its
+ * heartbeat interval (publishInterval) has expired
+ * The noread action of an expired tag is executed by its expiry timer
+ * @param index: tag table index of the tag to publish
+ * @param now: current time [ns] (CLOCK_MONOTONIC)
+ * @param heartbeat: publish even if the value has not changed
+ * @return true if the tag was published
+ */
+bool mqtt_publish_tag_rbe(int index, int64_t now, bool heartbeat) {
+	Tag *tag = tagTable.config(index);
+	tag_value snapshot;
+	const char *payload;
+	float value;
+	bool connected = mqtt.isConnected();
+
+	if (!connected && !queue_enabled) return false;
+	if (tagTable.isExpired(index, now)) return false;
+	tagTable.getValue(index, &snapshot);
+	// nothing to report before the first sample
+	if (snapshot.updateMonoTime == 0) return false;
+	value = tag->scaleValue(snapshot.value);
+	if (!heartbeat && !tag->isOutsideDeadband(value)) return false;
+	payload = tag->getFormattedValue(value);
+	if (payload == NULL) {
+		fprintf(stderr, "%s: formatted value too long [%s]\n", __func__, tag->getTopic());
+		return false;
+	}
+	// suppress duplicates of the last payload
+	if (!heartbeat && tag->isLastPayload(payload)) return false;
+	if(mqttDebugEnabled) {
+		printf("%s %s: - %s %s%s\n", __FILE__, __func__, tag->getTopic(), payload, heartbeat ? " (heartbeat)" : "");
+	}
+	if (!connected) {
+		if (!queue_sample(tag, payload, snapshot.updateTime)) return false;
+	} else if (mqtt_defer_tag(index, tag)) {
+		return false;
+	} else if (tag->getPublishTimestamp()) {
+		mqtt.publish(tag->getTopic(), payload, snapshot.updateTime, tag->getPublishRetain(), tag->getMessageExpiry(), tag->getQos());
+	} else {
+		mqtt.publish(tag->getTopic(), payload, tag->getPublishRetain(), tag->getMessageExpiry(), tag->getQos());
+	}
+	tag->setPublished(value, payload);
+	// the next heartbeat is due one interval after the last publish
+	if (heartbeatTimers[index] >= 0)
+		scheduler.start(heartbeatTimers[index], now + (tag->publishInterval * NSEC_PER_SEC), tag->publishInterval * NSEC_PER_SEC);
+	return true;
+}
+
+/**
+ * Publish all tags of an update cycle as one message (bulk mode)
+ * Each tag is keyed by the last level of its topic or by its channel,
+ * expired tags are published as null (noreadaction 0), with their noread
+ * value (noreadaction 1) or left out
+ * @param cycle: the update cycle
+ * @param now: current time [ns] (CLOCK_MONOTONIC) for the expiry check
+ */
+bool mqtt_publish_cycle(updatecycle *cycle, int64_t now) {
+	Tag *tag;
+	tag_value snapshot;
+	const char *key, *value;
+	bool json = (cycle->bulkFormat == BULK_FORMAT_JSON);
+	int index;
+	struct timespec ts;
+
+	if (!mqtt.isConnected() && !queue_enabled) return false;
+	cycle->payload.clear();
+	if (json) cycle->payload += '{';
+	for (int i = 0; (index = cycle->tagArray[i]) >= 0; i++) {
+		tag = tagTable.config(index);
+		if (!tagTable.isExpired(index, now)) {
+			tagTable.getValue(index, &snapshot);
+			value = tag->getFormattedValue(tag->scaleValue(snapshot.value));
+		} else if (tag->getNoreadAction() == 0) {
+			value = json ? "null" : "";
+		} else if (tag->getNoreadAction() == 1) {
+			value = tag->getFormattedValue(tag->getNoreadValue());
+		} else {
+			continue;
+		}
+		if (value == NULL) continue;
+		if (!cycle->bulkChannelKey && ((key = strrchr(tag->getTopic(), '/')) != NULL))
+			key++;
+		else if (!cycle->bulkChannelKey && (tag->getTopic()[0] != 0))
+			key = tag->getTopic();
+		else
+			key = NULL;
+		if (json) {
+			if (cycle->payload.length() > 1) cycle->payload += ',';
+			cycle->payload += '"';
+		}
+		if (key != NULL)
+			cycle->payload += key;
+		else
+			cycle->payload += to_string(tag->getChannel());
+		cycle->payload += json ? "\":" : ",";
+		cycle->payload += value;
+		if (!json) cycle->payload += '\n';
+	}
+	if (json) cycle->payload += '}';
+	if(mqttDebugEnabled) {
+		printf("%s %s: - %s %s\n", __FILE__, __func__, cycle->topic.c_str(), cycle->payload.c_str());
+	}
+	if (!mqtt.isConnected()) {
+		// the payload has no timestamps, queue it with the time of the cycle
+		clock_gettime(CLOCK_REALTIME, &ts);
+		return pubQueue.push(cycle->topic.c_str(), cycle->payload.data(), cycle->payload.length(), (ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec, true, cycle->qos);
+	}
+	// the next cycle publishes the current values if the window is full
+	if (mqtt.publishPayload(cycle->topic.c_str(), cycle->payload.data(), cycle->payload.length(), cycle->retain, cycle->qos) == MQTT_ERR_WINDOW_FULL) {
+		if (mqttDebugEnabled) printf("%s: in-flight window full, cycle %d skipped\n", __func__, cycle->ident);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Defer publishing a QoS 1/2 tag while the in-flight window is full
+ * A deferred tag is published with its value at the time the window
+ * opens again, updates meanwhile are coalesced
+ * @return true if the tag was deferred
+ */
+bool mqtt_defer_tag(int index, Tag *tag) {
+	if ((tag->getQos() <= 0) || !mqtt.isWindowFull()) return false;
+	if (!publishDeferred[index]) {
+		publishDeferred[index] = true;
+		publishDeferredCount++;
+	}
+	return true;
+}
+
+/**
+ * callback function for MQTT
+ * MQTT notifies that the in-flight window is no longer full
+ * Called from the mosquitto thread, hands over to the main loop
+ */
+void mqtt_window_callback(void) {
+	mqtt_window_open.store(true, memory_order_release);
+	scheduler.wakeup();
+}
+
+/**
+ * Publish tags deferred while the in-flight window was full
+ * @return false if the window is full again before all tags are published
+ */
+bool mqtt_publish_deferred(void) {
+	int64_t now = Scheduler::now();
+	for (int index = 0; (index < tagTable.count()) && (publishDeferredCount > 0); index++) {
+		if (!publishDeferred[index]) continue;
+		if (mqtt.isWindowFull()) return false;
+		publishDeferred[index] = false;
+		publishDeferredCount--;
+		if (is_rbe_tag(tagTable.config(index)))
+			mqtt_publish_tag_rbe(index, now, false);
+		else
+			mqtt_publish_tag(index, now);
+	}
+	return true;
+}
+
+/**
+ * Timer callback publishing the acknowledgement statistics of QoS 1/2 messages
+ * {"published":..,"acked":..,"lost":..,"rejected":..,"inflight":..,
+ * "latency_min":..,"latency_avg":..,"latency_max":..} with latencies in ms
+ * for the last interval
+ */
+void mqtt_stats_due(int arg, int64_t now) {
+	mqtt_ack_stats stats;
+	char payload[256];
+	int len;
+
+	if (!mqtt.isConnected()) return;
+	mqtt.getAckStats(&stats, true);
+	len = snprintf(payload, sizeof(payload),
+		"{\"published\":%llu,\"acked\":%llu,\"lost\":%llu,\"rejected\":%llu,\"inflight\":%d,"
+		"\"latency_min\":%.3f,\"latency_avg\":%.3f,\"latency_max\":%.3f}",
+		(unsigned long long)stats.published, (unsigned long long)stats.acked,
+		(unsigned long long)stats.lost, (unsigned long long)stats.rejected, stats.inflight,
+		stats.latencyMin / 1e6, (stats.acked > 0) ? (stats.latencySum / 1e6) / stats.acked : 0.0,
+		stats.latencyMax / 1e6);
+	mqtt.publishPayload(mqtt_stats_topic.c_str(), payload, len, false);
+}
+
+/**
+ * Queue a sample of a tag while the broker is not connected
+ * A sample is only queued once, even if it is published again (e.g. by
+ * every update cycle or heartbeat) before a new sample arrives
+ * @param tag: the tag
+ * @param value: the formatted value
+ * @param updateTime: [ns] CLOCK_REALTIME of the sample
+ * @return true if the sample was queued
+ */
+bool queue_sample(Tag *tag, const char *value, int64_t updateTime) {
+	if ((updateTime == 0) || (updateTime == tag->queuedTime)) return false;
+	if (!pubQueue.push(tag->getTopic(), value, strlen(value), updateTime, false, tag->getQos())) return false;
+	tag->queuedTime = updateTime;
+	return true;
+}
+
+/**
+ * Timer callback publishing a batch of queued messages after a reconnect
+ * Queued values are always published with the time of their sample,
+ * never retained, so the retained value stays the live one
+ * @param batch: max number of messages to publish
+ * @param now: current time [ns] (CLOCK_MONOTONIC)
+ */
+void queue_drain(int batch, int64_t now) {
+	while ((batch-- > 0) && mqtt.isConnected()) {
+		// keep the messages queued while the in-flight window is full, the QoS of the next one isn't known before it is taken
+		if (mqtt.isWindowFull()) break;
+		if (!pubQueue.pop(&queue_entry)) break;
+		if (queue_entry.raw)
+			mqtt.publishPayload(queue_entry.topic.c_str(), queue_entry.payload.data(), queue_entry.payload.length(), false, queue_entry.qos);
+		else
+			mqtt.publish(queue_entry.topic.c_str(), queue_entry.payload.c_str(), queue_entry.time, false, 0, queue_entry.qos);
+	}
+	if (!mqtt.isConnected() || (pubQueue.count() == 0)) {
+		scheduler.stop(queue_timer);
+		if (pubQueue.count() == 0) log(LOG_INFO, "publish queue empty, %llu messages dropped", (unsigned long long)pubQueue.dropped());
+	}
+}
+
+/**
+ * Create the queue for samples taken while the broker is not connected
+ * @return false on failure
+ */
+bool queue_init(void) {
+	std::string strValue, journal;
+	int policy = PUBQUEUE_OLDEST, memory = QUEUE_MEMORY_DEFAULT, journalSize = 0;
+
+	if (!cfg.exists("queue")) return true;		// optional
+	if (cfg.lookupValue("queue.policy", strValue)) {
+		if (strValue == "oldest") policy = PUBQUEUE_OLDEST;
+		else if (strValue == "latest") policy = PUBQUEUE_LATEST;
+		else {
+			log(LOG_ERR, "Config error - queue unknown \"policy\" <%s> [oldest|latest]", strValue.c_str());
+			return false;
+		}
+	}
+	cfg.lookupValue("queue.memory", memory);
+	cfg.lookupValue("queue.rate", queue_rate);
+	cfg.lookupValue("queue.journal", journal);
+	cfg.lookupValue("queue.journal_size", journalSize);
+	if ((memory <= 0) || (queue_rate <= 0)) {
+		log(LOG_ERR, "Config error - queue \"memory\" and \"rate\" must be > 0");
+		return false;
+	}
+	if (!journal.empty() && (policy == PUBQUEUE_LATEST)) {
+		log(LOG_WARNING, "queue \"journal\" is not used with policy \"latest\"");
+		journal.clear();
+	}
+	if (pubQueue.create(policy, memory, journal.c_str(), journalSize) < 0) {
+		log(LOG_ERR, "queue journal <%s> failed: %s", journal.c_str(), strerror(errno));
+		return false;
+	}
+	if (pubQueue.count() > 0)
+		log(LOG_INFO, "queue journal <%s> holds %d messages", journal.c_str(), pubQueue.count());
+	queue_enabled = true;
+	return true;
+}
+
+/**
+ * Start draining the queue at the configured rate
+ * Messages are published in batches at least QUEUE_DRAIN_INTERVAL_MIN apart,
+ * live values are published between the batches
+ */
+void queue_start_drain(void) {
+	int64_t interval = NSEC_PER_SEC / queue_rate;
+	int batch = 1;
+	if (interval < QUEUE_DRAIN_INTERVAL_MIN * 1000000LL) {
+		// round the batch up and derive the interval from it, so the rate is kept
+		batch = (queue_rate * QUEUE_DRAIN_INTERVAL_MIN + 999) / 1000;
+		interval = (batch * NSEC_PER_SEC) / queue_rate;
+	}
+	if (queue_timer < 0) queue_timer = scheduler.addTimer(queue_drain, batch);
+	log(LOG_INFO, "publishing %d queued messages", pubQueue.count());
+	scheduler.start(queue_timer, Scheduler::now(), interval);
+}
+
 /**
  * Publish noread value to all tags (normally done on program exit)
  * @param publish_noread: publish the "noread" value of the tag
@@ -409,7 +1008,7 @@ void mqtt_clear_tags(bool publish_noread = true, bool clear_retain = true) {
 
 	int index = 0, tagIndex = 0;
 	int *tagArray;
-	Tag tag;
+	Tag *tag;
 	//printf("%s %s", __FILE__, __func__);
 
 	return;
@@ -425,11 +1024,11 @@ void mqtt_clear_tags(bool publish_noread = true, bool clear_retain = true) {
 		// read each tag in the array
 		tagIndex = 0;
 		while (tagArray[tagIndex] >= 0) {
-			tag = tags[tagArray[tagIndex]];
-			if (publish_noread) {}
-				mqtt.publish(tag.getTopic(), tag.getFormat(), tag.getNoreadValue(), tag.getPublishRetain());
+			tag = tagTable.config(tagArray[tagIndex]);
+			if (publish_noread && (tag->getFormattedValue(tag->getNoreadValue()) != NULL))
+				mqtt.publish(tag->getTopic(), tag->getFormattedValue(tag->getNoreadValue()), tag->getPublishRetain());
 			if (clear_retain) {}
-				mqtt.clear_retained_message(tag.getTopic());	// clear retained status
+				mqtt.clear_retained_message(tag->getTopic());	// clear retained status
 			tagIndex++;
 		}
 		index++;
@@ -441,23 +1040,33 @@ void mqtt_clear_tags(bool publish_noread = true, bool clear_retain = true) {
 /**
  * Reading from device thread
  * This function is to be called by pthread_create()
- * It will continually read temperature output and update
- * the matching tag with the received temperature value
+ * It will wait for input from all interface devices and update
+ * the matching tag with every received temperature value
  */
 void *device_read (void *arg) {
-	int channel;
-	float value;
+	int channel, count, index, readyCount, tag;
+	int ready[DEVPOLL_MAX_DEVICES];
+	dev1820_sample samples[DEV_READ_BATCH_SIZE];
 
 	do {
-		if ( dev->readSingle(&channel, &value) < 0 ) {
-			//goto exit_fail;
-		} else {
-			//printf("Ch%d: %.1f\n", channel, value);
-			if(channel < tagCount) {
-				pthread_mutex_lock(&read_mutex); 	//lock mutex during write process
-				//printf("[%d]%s: %.1f\n", channel, tags[channel].getTopic(), value);
-				tags[channel].setValue(value);
-				pthread_mutex_unlock(&read_mutex);
+		readyCount = devPoll.wait(ready, DEVPOLL_MAX_DEVICES, DEV_READ_TIMEOUT);
+		for (int i = 0; i < readyCount; i++) {
+			index = ready[i];
+			// read all samples waiting on this device
+			while ((count = devInterfaces[index].dev->readBatch(samples, DEV_READ_BATCH_SIZE)) != 0) {
+				if (count < 0) {
+					devPoll.closeDevice(index);
+					break;
+				}
+				for (int s = 0; s < count; s++) {
+					// map device channel into tag channel namespace
+					channel = samples[s].channel + devInterfaces[index].channelOffset;
+					//printf("Ch%d: %.1f\n", channel, samples[s].value);
+					// a channel may be published by several tags
+					for (tag = tagTable.find(channel); tag >= 0; tag = tagTable.next(tag)) {
+						tagTable.setValue(tag, samples[s].value, &samples[s].rxTime, &samples[s].rxRealTime);
+					}
+				}
 			}
 		}
 	} while (!exitSignal);
@@ -467,44 +1076,224 @@ void *device_read (void *arg) {
 }
 
 /**
- * publish device tags if dues
- * @return false if there was nothing to process, otherwise true
+ * Timer callback of an update cycle, publish the tags of the cycle
+ * A spread cycle publishes one slice of its tags per call, the slices
+ * are evenly spaced over the interval
+ * @param index: index of the update cycle
+ * @param now: current time [ns] (CLOCK_MONOTONIC) for expired reads
  */
-bool dev_tags_publish() {
-	int index = 0;
-	int tagIndex = 0;
-	int *tagArray;
-	bool retval = false;
-	time_t now = time(NULL);
-	time_t refTime;
-	while (updateCycles[index].ident >= 0) {
-		// ignore if cycle has no tags to process
-		if (updateCycles[index].tagArray == NULL) {
-			index++; continue;
-		}
-		// new reference time for each read cycle
-		refTime = time(NULL);		// used for expired reads
-		if (now >= updateCycles[index].nextUpdateTime) {
-			// set next update cycle time
-			updateCycles[index].nextUpdateTime = now + updateCycles[index].interval;
-			// get array for tags
-			tagArray = updateCycles[index].tagArray;
-			// read each tag in the array
-			tagIndex = 0;
-			while (tagArray[tagIndex] >= 0) {
-				mqtt_publish_tag(&tags[tagArray[tagIndex]]);
-				//printf("%s: %s\n", __func__, tags[tagArray[tagIndex]].getTopic());
-				tagIndex++;
-			}
-			retval = true;
-			//cout << now << " Update Cycle: " << updateCycles[index].ident << " - " << updateCycles[index].tagArraySize << " tags" << endl;
+void update_cycle_due(int index, int64_t now) {
+	updatecycle *cycle = &updateCycles[index];
+	int64_t interval = cycle->interval * NSEC_PER_SEC;
+	int tagIndex = (cycle->slice * cycle->tagArraySize) / cycle->slices;
+	int tagEnd = ((cycle->slice + 1) * cycle->tagArraySize) / cycle->slices;
+	useconds_t processing_time;
+
+	if (cycle->slices > 1) {
+		// next slice, deadlines are relative to the start of the period and don't drift
+		if (++cycle->slice >= cycle->slices) {
+			cycle->slice = 0;
+			cycle->start += interval;
 		}
-		index++;
+		scheduler.start(cycle->timer, cycle->start + ((interval * cycle->slice) / cycle->slices), 0);
+	}
+	if (!mqtt.isConnected() && !queue_enabled) return;
+	if (!cycle->topic.empty()) {
+		// bulk mode, a single message for all tags
+		mqtt_publish_cycle(cycle, now);
+		tagIndex = tagEnd;
 	}
+	// read each tag in the slice
+	while (tagIndex < tagEnd) {
+		mqtt_publish_tag(cycle->tagArray[tagIndex], now);
+		//printf("%s: %s\n", __func__, tagTable.config(cycle->tagArray[tagIndex])->getTopic());
+		tagIndex++;
+	}
+	//cout << now << " Update Cycle: " << updateCycles[index].ident << " - " << updateCycles[index].tagArraySize << " tags" << endl;
+	// calculate cpu time used [us]
+	processing_time = (Scheduler::now() - now) / 1000;
+	if (debugEnabled)
+		printf("%s - cycle %d took %dus\n", __func__, updateCycles[index].ident, processing_time);
+	if (processing_time > max_time) max_time = processing_time;
+	if (processing_time < min_time) min_time = processing_time;
+}
 
+/**
+ * Timer callback for the heartbeat of a tag published by exception
+ * @param index: tag table index
+ * @param now: current time [ns] (CLOCK_MONOTONIC)
+ */
+void tag_heartbeat(int index, int64_t now) {
+	mqtt_publish_tag_rbe(index, now, true);
+}
+
+/**
+ * Timer callback for the expiry of a tag published on arrival or by exception
+ * The noread action is executed as soon as the tag expires and repeated
+ * at the expiry interval until a new value arrives
+ * @param index: tag table index
+ * @param now: current time [ns] (CLOCK_MONOTONIC)
+ */
+void tag_expiry(int index, int64_t now) {
+	tag_value snapshot;
+	int64_t expiry = tagTable.getExpiryTime(index) * NSEC_PER_SEC;
+
+	tagTable.getValue(index, &snapshot);
+	// a value has arrived since the timer was started
+	if ((snapshot.updateMonoTime + expiry) > now) {
+		scheduler.start(expiryTimers[index], snapshot.updateMonoTime + expiry, 0);
+		return;
+	}
+	if (mqtt.isConnected()) mqtt_publish_tag(index, now);
+	tagTable.config(index)->resetPublished();
+	scheduler.start(expiryTimers[index], now + expiry, 0);
+}
+
+/**
+ * Timer callback for a reconnect to the MQTT broker
+ */
+void mqtt_reconnect_due(int arg, int64_t now) {
+	mqtt_connect();
+}
+
+/**
+ * Value update callback of tags published on arrival or by exception
+ * Called from the read thread or the mosquitto thread (mqtt_tags), hands
+ * the tag over to the main loop
+ * @param index: tag table index (callback ID)
+ * @param tag: the tag configuration
+ */
+void tag_update(int index, Tag *tag) {
+	// the main loop is already woken if the tag is pending
+	if (eventPending[index].exchange(true, memory_order_release)) return;
+	scheduler.wakeup();
+}
+
+/**
+ * publish tags with a new value which are published on arrival or by exception
+ * @return false if there was nothing to publish, otherwise true
+ */
+bool event_tags_publish(void) {
+	int tagIndex, index;
+	bool retval = false;
+	int64_t now;
+	if (eventTags == NULL) return false;
+	now = Scheduler::now();
+	for (tagIndex = 0; eventTags[tagIndex] >= 0; tagIndex++) {
+		index = eventTags[tagIndex];
+		if (!eventPending[index].exchange(false, memory_order_acquire)) continue;
+		// deadband and heartbeat also apply to tags published on arrival
+		if (is_rbe_tag(tagTable.config(index)))
+			mqtt_publish_tag_rbe(index, now, false);
+		else
+			mqtt_publish_tag(index, now);
+		retval = true;
+	}
 	return retval;
 }
 
+/**
+ * @returns true if the tag is published by exception instead of in its update cycle
+ */
+bool is_rbe_tag(Tag *tag) {
+	return (tag->getDeadband() > 0) || (tag->getDeadbandPercent() > 0) || (tag->publishInterval > 0);
+}
+
+/**
+ * collect the tags which are published on arrival (update_cycle 0) or by
+ * exception, register the callback which wakes the main loop and start
+ * their heartbeat and expiry timers
+ * the interval of the update cycle is the default heartbeat
+ */
+bool assign_event_tags() {
+	int tagIdx, cycleIdx, count = 0;
+	int64_t now = Scheduler::now();
+	Tag *tag;
+
+	for (tagIdx = 0; tagIdx < tagTable.count(); tagIdx++) {
+		tag = tagTable.config(tagIdx);
+		if ((tag->getUpdateCycleId() == UPDATE_CYCLE_ARRIVAL) || is_rbe_tag(tag)) count++;
+	}
+	if (count == 0) return true;
+
+	eventPending = new std::atomic<bool>[tagTable.count()];
+	heartbeatTimers = new int[tagTable.count()];
+	expiryTimers = new int[tagTable.count()];
+	eventTags = new int[count+1];			// +1 to allow for end marker
+	count = 0;
+	for (tagIdx = 0; tagIdx < tagTable.count(); tagIdx++) {
+		tag = tagTable.config(tagIdx);
+		eventPending[tagIdx].store(false, memory_order_relaxed);
+		heartbeatTimers[tagIdx] = -1;
+		expiryTimers[tagIdx] = -1;
+		if ((tag->getUpdateCycleId() != UPDATE_CYCLE_ARRIVAL) && !is_rbe_tag(tag)) continue;
+		if (is_rbe_tag(tag) && (tag->publishInterval <= 0)) {
+			for (cycleIdx = 0; updateCycles[cycleIdx].ident >= 0; cycleIdx++) {
+				if (updateCycles[cycleIdx].ident == tag->getUpdateCycleId()) {
+					tag->publishInterval = updateCycles[cycleIdx].interval;
+					break;
+				}
+			}
+		}
+		if (tag->publishInterval > 0) {
+			heartbeatTimers[tagIdx] = scheduler.addTimer(tag_heartbeat, tagIdx);
+			scheduler.start(heartbeatTimers[tagIdx], now + (tag->publishInterval * NSEC_PER_SEC), tag->publishInterval * NSEC_PER_SEC);
+		}
+		if (tagTable.getExpiryTime(tagIdx) > 0) {
+			expiryTimers[tagIdx] = scheduler.addTimer(tag_expiry, tagIdx);
+			scheduler.start(expiryTimers[tagIdx], now + (tagTable.getExpiryTime(tagIdx) * NSEC_PER_SEC), 0);
+		}
+		tag->registerCallback(tag_update, tagIdx);
+		tagTable.setNotify(tagIdx, true);
+		eventTags[count++] = tagIdx;
+	}
+	eventTags[count] = -1;
+	log(LOG_INFO, "%d tags published on arrival or by exception", count);
+	return true;
+}
+
+/**
+ * start the timers of all update cycles which have tags
+ * an aligned cycle starts at the next multiple of its interval since the
+ * epoch (plus offset), e.g. on the minute for a 60s cycle
+ */
+bool assign_cycle_timers() {
+	int index;
+	int64_t now = Scheduler::now(), realNow, interval, phase;
+	struct timespec realTime;
+	updatecycle *cycle;
+
+	clock_gettime(CLOCK_REALTIME, &realTime);
+	realNow = (realTime.tv_sec * NSEC_PER_SEC) + realTime.tv_nsec;
+	for (index = 0; updateCycles[index].ident >= 0; index++) {
+		cycle = &updateCycles[index];
+		// ignore if cycle has no tags to process
+		if (cycle->tagArray == NULL) continue;
+		interval = cycle->interval * NSEC_PER_SEC;
+		if (cycle->align) {
+			// time since the last aligned deadline
+			phase = (realNow - (cycle->offset * NSEC_PER_SEC)) % interval;
+			if (phase < 0) phase += interval;
+			cycle->start = now + interval - phase;
+		} else {
+			cycle->start = now + interval + (cycle->offset * NSEC_PER_SEC);
+		}
+		cycle->slices = 1;
+		// a bulk cycle is published as a whole
+		if (cycle->spread && cycle->topic.empty()) {
+			cycle->slices = (cycle->interval * 1000) / UPDATE_CYCLE_SLICE_MIN;
+			if (cycle->slices > cycle->tagArraySize) cycle->slices = cycle->tagArraySize;
+			if (cycle->slices < 1) cycle->slices = 1;
+		}
+		cycle->slice = 0;
+		cycle->timer = scheduler.addTimer(update_cycle_due, index);
+		// a periodic timer is drift free, slices are restarted by the callback
+		scheduler.start(cycle->timer, cycle->start, (cycle->slices > 1) ? 0 : interval);
+		if (debugEnabled)
+			printf("%s - cycle %d: %d tags every %ds in %d slices, first in %lldms\n", __func__, cycle->ident, cycle->tagArraySize, cycle->interval, cycle->slices, (long long)((cycle->start - now) / 1000000));
+	}
+	return true;
+}
 
 /**
  * assign tags to update cycles
@@ -537,12 +1326,12 @@ bool assign_updatecycles () {
 		do {
 			//printf("%s: %d\n", __func__, tagIdx);
 			// count tags with cycle id match
-			if (tags[tagIdx].getUpdateCycleId() == cycleIdent) {
+			if ((tagTable.config(tagIdx)->getUpdateCycleId() == cycleIdent) && !is_rbe_tag(tagTable.config(tagIdx))) {
 				matchCount++;
-				//cout << "cycIdent: " << cycleIdent <<" Channel:" << tags[tagIdx].getChannel() << endl;
+				//cout << "cycIdent: " << cycleIdent <<" Channel:" << tagTable.config(tagIdx)->getChannel() << endl;
 			}
 			tagIdx++;
-		} while (tagIdx < tagCount);
+		} while (tagIdx < tagTable.count());
 
 		// skip to next cycle update if we have no matching tags
 		if (matchCount < 1) {
@@ -557,12 +1346,12 @@ bool assign_updatecycles () {
 		arIndex = 0;
 		do {
 			// count tags with cycle id match
-			if (tags[tagIdx].getUpdateCycleId() == cycleIdent) {
+			if ((tagTable.config(tagIdx)->getUpdateCycleId() == cycleIdent) && !is_rbe_tag(tagTable.config(tagIdx))) {
 				intArray[arIndex] = tagIdx;
 				arIndex++;
 			}
 			tagIdx++;
-		} while (tagIdx < tagCount);
+		} while (tagIdx < tagTable.count());
 		// mark end of array
 		intArray[arIndex] = -1;
 		// add the array to the update cycles
@@ -579,7 +1368,8 @@ bool assign_updatecycles () {
  * read all configured tags from config file
  */
 bool tag_config(Setting& tagSettings) {
-	int numTags, idx, tagIndex, tagUpdateCycle,  maxChannel = 0;
+	int numTags, idx, tagIndex, tagUpdateCycle, channelCount = 0;
+	Tag *tag;
 	string strValue;
 	bool bValue;
 	float fValue;
@@ -592,62 +1382,92 @@ bool tag_config(Setting& tagSettings) {
 		return false;
 	}
 
-	// determine the highest channel number in the tag list
+	// count the tags with a channel number
 	for (idx = 0; idx < numTags; idx++) {
-		if (tagSettings[idx].exists("channel")) {
-			if (tagSettings[idx].lookupValue("channel", intValue)) {
-				if (intValue > maxChannel) maxChannel = intValue;
-			}
+		if (tagSettings[idx].lookupValue("channel", intValue)) {
+			channelCount++;
 		}
 		//printf("%s: tag item %d\n", __func__, idx);
 	}
 
-	if (maxChannel == 0) {
+	if (channelCount == 0) {
 		log(LOG_ERR, "%s: Channel number error", __func__);
 		return false;
 	}
 
-	//printf("%s: maxChannel: %d\n", __func__, maxChannel);
-
-	// +1 -> channel=array index
-	tagCount = maxChannel+1;
-	tags = new Tag[tagCount];
+	// several tags may share a channel
+	if (tagTable.create(channelCount, history_size) < 0) {
+		log(LOG_ERR, "%s: tag table already exists", __func__);
+		return false;
+	}
 
 
 	for (idx = 0; idx < numTags; idx++) {
 		if (tagSettings[idx].lookupValue("channel", intValue)) {
-			tagIndex = intValue;
-			tags[tagIndex].setChannel(intValue);
+			tagIndex = tagTable.addTag(intValue);
+			tag = tagTable.config(tagIndex);
 		} else {
 			log(LOG_WARNING, "Error in config file, tag channel missing");
 			continue;		// skip to next tag
 		}
 		if (tagSettings[idx].lookupValue("update_cycle", tagUpdateCycle)) {
-			tags[tagIndex].setUpdateCycleId(tagUpdateCycle);
+			tag->setUpdateCycleId(tagUpdateCycle);
 		}
 		// is topic present? -> read mqtt related parametrs
 		if (tagSettings[idx].lookupValue("topic", strValue)) {
-			tags[tagIndex].setTopic(strValue.c_str());
-			tags[tagIndex].setPublishRetain(mqtt_retain_default);		// set to default
+			tagTable.setTopic(tagIndex, strValue.c_str());
+			tag->setPublishRetain(mqtt_retain_default);		// set to default
 			if (tagSettings[idx].lookupValue("retain", bValue))		// override default if required
-				tags[tagIndex].setPublishRetain(bValue);
-			if (tagSettings[idx].lookupValue("format", strValue))
-				tags[tagIndex].setFormat(strValue.c_str());
+				tag->setPublishRetain(bValue);
+			tag->setPublishTimestamp(mqtt_timestamp_default);
+			if (tagSettings[idx].lookupValue("timestamp", bValue))
+				tag->setPublishTimestamp(bValue);
+			tag->setQos(mqtt_qos_default);
+			if (tagSettings[idx].lookupValue("qos", intValue)) {
+				if ((intValue < 0) || (intValue > 2)) {
+					log(LOG_ERR, "Config error - tag <%s> unsupported \"qos\" %d [0|1|2]", tag->getTopic(), intValue);
+					return false;
+				}
+				tag->setQos(intValue);
+			}
+			tag->setMessageExpiry(mqtt_message_expiry_default);
+			if (tagSettings[idx].lookupValue("message_expiry", intValue))
+				tag->setMessageExpiry((intValue > 0) ? intValue : 0);
+			if (tagSettings[idx].lookupValue("format", strValue)) {
+				if (!tag->setFormat(strValue.c_str())) {
+					log(LOG_ERR, "Config error - tag <%s> unsupported \"format\" <%s>", tag->getTopic(), strValue.c_str());
+					return false;
+				}
+			}
 			if (tagSettings[idx].lookupValue("multiplier", fValue))
-				tags[tagIndex].setMultiplier(fValue);
+				tag->setMultiplier(fValue);
 			if (tagSettings[idx].lookupValue("offset", fValue))
-				tags[tagIndex].setOffset(fValue);
+				tag->setOffset(fValue);
 			if (tagSettings[idx].lookupValue("noreadvalue", fValue))
-				tags[tagIndex].setNoreadValue(fValue);
+				tag->setNoreadValue(fValue);
 			if (tagSettings[idx].lookupValue("noreadaction", intValue))
-				tags[tagIndex].setNoreadAction(intValue);
+				tag->setNoreadAction(intValue);
 			if (tagSettings[idx].lookupValue("expiry", intValue))
-				tags[tagIndex].setExpiryTime(intValue);
+				tagTable.setExpiryTime(tagIndex, intValue);
+			if (tagSettings[idx].lookupValue("deadband", fValue))
+				tag->setDeadband(fValue);
+			if (tagSettings[idx].lookupValue("deadband_percent", fValue))
+				tag->setDeadbandPercent(fValue);
+			if (tagSettings[idx].lookupValue("heartbeat", intValue))
+				tag->publishInterval = intValue;
 		}
 		//cout << "Tag " << idx;
-		//cout << " channel: " << tags[tagIndex].getChannel();
+		//cout << " channel: " << tag->getChannel();
 		//cout << " cycle: " << tagUpdateCycle;
-		//cout << " Topic: " << tags[tagIndex].getTopic() << endl;
+		//cout << " Topic: " << tag->getTopic() << endl;
+	}
+	publishDeferred = new bool[tagTable.count()];
+	for (idx = 0; idx < tagTable.count(); idx++) publishDeferred[idx] = false;
+	if (tagTable.historySize() > 0) {
+		history_samples = new tag_sample[tagTable.historySize()];
+		history_buf_size = (tagTable.historySize() * HISTORY_SAMPLE_LEN) + 2;
+		history_buf = new char[history_buf_size];
+		log(LOG_INFO, "Keeping %d samples per tag, history requests on %s/get/<topic>", tagTable.historySize(), history_topic.c_str());
 	}
 	//printf("%s Done\n", __func__);
 	return true;
@@ -658,6 +1478,7 @@ bool tag_config(Setting& tagSettings) {
  */
 bool updatecycles_config(Setting& updateCyclesSettings) {
 	int idValue, interval, index;
+	string strValue;
 	int numUpdateCycles = updateCyclesSettings.getLength();
 
 	if (numUpdateCycles < 1) {
@@ -679,10 +1500,49 @@ bool updatecycles_config(Setting& updateCyclesSettings) {
 			log(LOG_ERR, "Config error - cycleupdate interval missing in entry %d", index+1);
 			return false;
 		}
+		if (interval < 1) {
+			log(LOG_ERR, "Config error - cycleupdate interval must be at least 1s in entry %d", index+1);
+			return false;
+		}
+		if (idValue == UPDATE_CYCLE_ARRIVAL) {
+			log(LOG_ERR, "Config error - cycleupdate ID %d is reserved for publish on arrival", UPDATE_CYCLE_ARRIVAL);
+			return false;
+		}
 		updateCycles[index].ident = idValue;
 		updateCycles[index].interval = interval;
-		updateCycles[index].nextUpdateTime = time(0) + interval;
-		//cout << "Update " << index << " ID " << idValue << " Interval: " << interval << " t:" << updateCycles[index].nextUpdateTime << endl;
+		updateCyclesSettings[index].lookupValue("align", updateCycles[index].align);
+		updateCyclesSettings[index].lookupValue("offset", updateCycles[index].offset);
+		updateCyclesSettings[index].lookupValue("spread", updateCycles[index].spread);
+		// optional bulk mode
+		if (updateCyclesSettings[index].lookupValue("topic", updateCycles[index].topic)) {
+			updateCycles[index].retain = mqtt_retain_default;
+			updateCyclesSettings[index].lookupValue("retain", updateCycles[index].retain);
+			updateCycles[index].qos = mqtt_qos_default;
+			updateCyclesSettings[index].lookupValue("qos", updateCycles[index].qos);
+			if ((updateCycles[index].qos < 0) || (updateCycles[index].qos > 2)) {
+				log(LOG_ERR, "Config error - cycleupdate unsupported \"qos\" %d [0|1|2] in entry %d", updateCycles[index].qos, index+1);
+				return false;
+			}
+			if (updateCyclesSettings[index].lookupValue("bulk_format", strValue)) {
+				if (strValue == "json") {
+					updateCycles[index].bulkFormat = BULK_FORMAT_JSON;
+				} else if (strValue == "csv") {
+					updateCycles[index].bulkFormat = BULK_FORMAT_CSV;
+				} else {
+					log(LOG_ERR, "Config error - cycleupdate unknown \"bulk_format\" <%s> [json|csv] in entry %d", strValue.c_str(), index+1);
+					return false;
+				}
+			}
+			if (updateCyclesSettings[index].lookupValue("bulk_key", strValue)) {
+				if (strValue == "channel") {
+					updateCycles[index].bulkChannelKey = true;
+				} else if (strValue != "topic") {
+					log(LOG_ERR, "Config error - cycleupdate unknown \"bulk_key\" <%s> [topic|channel] in entry %d", strValue.c_str(), index+1);
+					return false;
+				}
+			}
+		}
+		//cout << "Update " << index << " ID " << idValue << " Interval: " << interval << endl;
 	}
 	// mark end of data
 	updateCycles[index].ident = -1;
@@ -737,82 +1597,116 @@ bool dev_config() {
 }
 
 /**
- * get a valid baudrate for PLxx controller
- * @returns budrate constant from termios.h
- */
-int dev_baudrate(int baud) {
-	switch (baud) {
-		case 300: return B300;
-			break;
-		case 1200: return B1200;
-			break;
-		case 2400: return B2400;
-			break;
-		case 4800: return B4800;
-			break;
-		case 9600: return B9600;
-			break;
-		case 19200: return B19200;
-			break;
-		default: return B9600;
-	}
-}
-
-/**
- * initialize 1820 interface devices
+ * initialize one 1820 interface device
+ * @param ifSettings: the interface configuration
+ * @param devIf: the interface device to initialize
  * @returns false for configuration error, otherwise true
  */
-bool dev_init() {
-	string device;
-	string strValue;
+bool dev_interface_init(Setting& ifSettings, devinterface *devIf) {
+	string device, decoder;
 	int baud = 9600;
-
+	int vmin = 1, vtime = 0;
+	double replaySpeed = 1.0;
+	bool replay = false, replayLoop = false;
+
+	// a capture file can be replayed in place of the device
+	if (ifSettings.lookupValue("replay", device)) {
+		replay = true;
+		ifSettings.lookupValue("replay_speed", replaySpeed);
+		ifSettings.lookupValue("replay_loop", replayLoop);
 	// check if device interface is configured
-	if (!cfg_get_str("interface.device", device)) {
+	} else if (!ifSettings.lookupValue("device", device)) {
 		log(LOG_ERR, "interface missing \"device\" parameter");
 		return false;
 	}
 	// get configuration serial device
-	if (!cfg_get_int("interface.baudrate", baud)) {
-			log(LOG_ERR, "interface missing \"baudrate\" parameter for <%s>", device.c_str());
+	if (!ifSettings.lookupValue("baudrate", baud) && !replay) {
+		log(LOG_ERR, "interface missing \"baudrate\" parameter for <%s>", device.c_str());
+		return false;
+	}
+	if ((baud < TTY_BAUD_MIN) || (baud > TTY_BAUD_MAX)) {
+		log(LOG_ERR, "interface <%s> unsupported \"baudrate\" %d [%d..%d]", device.c_str(), baud, TTY_BAUD_MIN, TTY_BAUD_MAX);
 		return false;
 	}
+	// optional channel namespace
+	devIf->channelOffset = 0;
+	ifSettings.lookupValue("channel_offset", devIf->channelOffset);
 
 	// Create device object
-	dev = new Dev1820(device.c_str(), dev_baudrate(baud));
+	devIf->dev = new Dev1820(device.c_str(), baud);
 
-	if (dev == NULL) {
-		log(LOG_ERR, "Can't initialize device on %s\n", device.c_str());
+	if (replay) {
+		devIf->dev->setReplay(replaySpeed, replayLoop);
+		log(LOG_INFO, "Replaying capture file %s at speed %.1f%s", device.c_str(), replaySpeed, replayLoop ? " in a loop" : "");
+	}
+
+	// optional decoder for the received data
+	if (ifSettings.lookupValue("decoder", decoder)) {
+		if (devIf->dev->setDecoder(decoder.c_str()) < 0) {
+			log(LOG_ERR, "interface <%s> unknown \"decoder\" <%s> [text|binary]", device.c_str(), decoder.c_str());
+			return false;
+		}
+	}
+
+	// optional termios read timing
+	ifSettings.lookupValue("vmin", vmin);
+	ifSettings.lookupValue("vtime", vtime);
+	if (devIf->dev->setReadTiming(vmin, vtime) < 0) {
+		log(LOG_ERR, "interface <%s> invalid \"vmin\" or \"vtime\" [0..255]", device.c_str());
 		return false;
 	}
 
-	log(LOG_INFO, "Device cofigured on port %s at %d baud", device.c_str(), baud);
+	if (devPoll.addDevice(devIf->dev) < 0) {
+		log(LOG_ERR, "Can't add device on %s, maximum is %d devices", device.c_str(), DEVPOLL_MAX_DEVICES);
+		return false;
+	}
 
-	if (!dev_config()) return false;
-	if (!assign_updatecycles()) return false;
+	log(LOG_INFO, "Device configured on port %s at %d baud, %s decoder, channel offset %d", device.c_str(), baud, devIf->dev->decoderName(), devIf->channelOffset);
 	return true;
 }
 
-#pragma mark Loops
-
 /**
- * set main loop interval to a valid setting
- * @param newValue the new main loop interval in ms
+ * initialize 1820 interface devices
+ * The "interfaces" list supersedes the single "interface" group
+ * @returns false for configuration error, otherwise true
  */
-void setMainLoopInterval(int newValue)
-{
-	int val = newValue;
-	if (newValue < MAIN_LOOP_INTERVAL_MINIMUM) {
-		val = MAIN_LOOP_INTERVAL_MINIMUM;
-	}
-	if (newValue > MAIN_LOOP_INTERVAL_MAXIMUM) {
-		val = MAIN_LOOP_INTERVAL_MAXIMUM;
+bool dev_init() {
+	int index;
+
+	try {
+		if (cfg.exists("interfaces")) {
+			Setting& ifSettings = cfg.lookup("interfaces");
+			devInterfaceCount = ifSettings.getLength();
+			if (devInterfaceCount < 1) {
+				log(LOG_ERR, "Error in config file, \"interfaces\" is empty");
+				return false;
+			}
+			devInterfaces = new devinterface[devInterfaceCount];
+			for (index = 0; index < devInterfaceCount; index++) {
+				if (!dev_interface_init(ifSettings[index], &devInterfaces[index])) return false;
+			}
+		} else if (cfg.exists("interface")) {
+			devInterfaceCount = 1;
+			devInterfaces = new devinterface[devInterfaceCount];
+			if (!dev_interface_init(cfg.lookup("interface"), &devInterfaces[0])) return false;
+		} else {
+			log(LOG_ERR, "Error in config file, \"interfaces\" missing");
+			return false;
+		}
+	} catch (const SettingTypeException &excp) {
+		log(LOG_ERR, "Error in config file <%s> is wrong type", excp.getPath());
+		return false;
 	}
-	mainloopinterval = val;
 
-	log(LOG_INFO, "Main Loop interval is %dms", mainloopinterval);
+	if (!dev_config()) return false;
+	if (!assign_updatecycles()) return false;
+	if (!assign_event_tags()) return false;
+	if (!assign_cycle_timers()) return false;
+	return true;
 }
 
+#pragma mark Loops
+
 /**
  * called on program exit
  */
@@ -829,6 +1723,13 @@ void exit_loop(void)
 		noreadonexit = bValue;
 	if (noreadonexit || clearonexit)
 		mqtt_clear_tags(noreadonexit, clearonexit);
+	// the mosquitto threads serve history requests and store received
+	// values using the arrays below
+	history_ready = false;
+	subscriptions_ready = false;
+	mqtt.stop();
+	// wait for read thread to complete, tag_update() uses the arrays below
+	pthread_join(read_thread, NULL);
 	// free allocated memory
 	// arrays of tags in cycleupdates
 	int *ar, idx=0;
@@ -839,24 +1740,31 @@ void exit_loop(void)
 	}
 
 	delete [] updateCycles;
-	// wait for read thread to complete
-	pthread_join(read_thread, NULL);
-	delete dev;
+	delete [] eventTags;
+	delete [] eventPending;
+	delete [] heartbeatTimers;
+	delete [] expiryTimers;
+	delete [] publishDeferred;
+	delete [] history_samples;
+	delete [] history_buf;
+	delete [] subscriptions;
+	for (idx = 0; idx < devInterfaceCount; idx++) {
+		delete devInterfaces[idx].dev;
+	}
+	delete [] devInterfaces;
 }
 
 /**
  * Main program loop
+ * Sleeps until the next timer is due or another thread hands over work
  */
 void main_loop()
 {
-	bool processing_success = false;
-	//clock_t start, end;
-	struct timespec starttime, endtime, difftime;
-	useconds_t sleep_usec;
-	//double delta_time;
-	useconds_t processing_time;
-	useconds_t min_time = 99999999, max_time = 0;
-	useconds_t interval = mainloopinterval * 1000;	// convert ms to us
+	mqtt_reconnect_timer = scheduler.addTimer(mqtt_reconnect_due, 0);
+	if (!mqtt_stats_topic.empty()) {
+		mqtt_stats_timer = scheduler.addTimer(mqtt_stats_due, 0);
+		scheduler.start(mqtt_stats_timer, Scheduler::now() + (mqtt_stats_interval * NSEC_PER_SEC), mqtt_stats_interval * NSEC_PER_SEC);
+	}
 
 	// intiate accumulator timing
 	clock_gettime(CLOCK_MONOTONIC, &lastAccTime);
@@ -864,46 +1772,31 @@ void main_loop()
 	accPwr = 0;
 	accPwrChg = 0; accPwrDsc = 0;
 
-	// first call takes a long time (10ms)
 	while (!exitSignal) {
-	// run processing and record start/stop time
-		clock_gettime(CLOCK_MONOTONIC, &starttime);
-		processing_success = process();
-		clock_gettime(CLOCK_MONOTONIC, &endtime);
-		// calculate cpu time used [us]
-		timespec_diff(&starttime, &endtime, &difftime);
-		processing_time = (difftime.tv_nsec / 1000) + (difftime.tv_sec * 1000000);
-
-		// store min/max times if any processing was done
-		if (processing_success) {
-			// calculate cpu time used [us]
-			if (debugEnabled)
-				printf("%s - process() took %dus\n", __func__, processing_time);
-			if (processing_time > max_time) {
-				max_time = processing_time;
-			}
-			if (processing_time < min_time) {
-				min_time = processing_time;
-			}
-			//printf("%s - success (%dus)\n", __func__, processing_time);
-		}
-		// enter loop delay if needed
-		// if cpu_time_used exceeds the mainLoopInterval
-		// then bypass the loop delay
-		if (interval > processing_time) {
-			sleep_usec = interval - processing_time;  // sleep time in us
-			//printf("%s - sleeping for %dus (%dus)\n", __func__, sleep_usec, processing_time);
-			usleep(sleep_usec);
+		// run the callbacks of all due timers
+		if (scheduler.wait() < 0) {
+			log(LOG_ERR, "%s: scheduler failed", __func__);
+			break;
 		}
-
-		if (mqtt_next_connect_time > 0) {
-			if (time(NULL) >= mqtt_next_connect_time) {
-				mqtt_connect();
-			}
+		if (mqtt_reconnect_request) {
+			mqtt_reconnect_request = false;
+			scheduler.start(mqtt_reconnect_timer, Scheduler::now() + (MQTT_RECONNECT_INTERVAL * NSEC_PER_SEC), 0);
 		}
+		if (mqtt_window_open.exchange(false, memory_order_acquire) && (publishDeferredCount > 0))
+			mqtt_publish_deferred();
+		if (mqtt.isConnected() || queue_enabled) event_tags_publish();
+		if (queue_enabled && mqtt.isConnected() && (pubQueue.count() > 0) && !scheduler.isActive(queue_timer))
+			queue_start_drain();
 	}
-	if (!runningAsDaemon)
+	if (!runningAsDaemon) {
+		mqtt_ack_stats stats;
 		printf("CPU time for variable processing: %dus - %dus\n", min_time, max_time);
+		mqtt.getAckStats(&stats, false);
+		if (stats.published > 0)
+			printf("QoS 1/2 messages: %llu acknowledged, %llu lost, %llu rejected, latency %.1fms - %.1fms\n",
+				(unsigned long long)stats.acked, (unsigned long long)stats.lost, (unsigned long long)stats.rejected,
+				stats.latencyMin / 1e6, stats.latencyMax / 1e6);
+	}
 }
 
 /** Display program usage instructions.
@@ -993,8 +1886,11 @@ int main (int argc, char *argv[]) {
 		goto exit_fail;
 	}
 
+	if (!queue_init()) goto exit_fail;
 	if (!mqtt_init()) goto exit_fail;
 	if (!dev_init()) goto exit_fail;
+	history_ready = true;
+	mqtt_check_subscriptions();
 
 	result = pthread_create(&read_thread, NULL, &device_read, NULL);
 	if (result != 0) {
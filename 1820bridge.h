@@ -8,12 +8,42 @@
 
 //#include <time.h>
 
+#include <string>
+
+#define BULK_FORMAT_JSON 0		// {"<key>":<value>,...}
+#define BULK_FORMAT_CSV 1		// <key>,<value> per line
+
 struct updatecycle {
 	int	ident;
 	int interval;	// seconds
 	int *tagArray = NULL;
 	int tagArraySize = 0;
-	time_t nextUpdateTime;			// next update time 
+	int timer = -1;					// scheduler timer of the cycle
+	bool align = true;				// align to a multiple of interval since the epoch
+	int offset = 0;					// seconds, phase relative to the aligned time
+	bool spread = false;			// spread tags over the interval
+	int slices = 1;					// the tags are published in this many slices
+	int slice = 0;					// next slice to publish
+	int64_t start = 0;				// [ns] CLOCK_MONOTONIC, start of the current period
+	std::string topic;				// bulk mode: publish all tags as one payload on this topic
+	int bulkFormat = BULK_FORMAT_JSON;
+	bool bulkChannelKey = false;	// key is the channel instead of the last topic level
+	bool retain = false;
+	int qos = 0;
+	std::string payload;			// bulk payload, kept to reuse its allocation
+};
+
+// values received via MQTT (mqtt_tags)
+struct subscription {
+	std::string topic;				// topic filter, may contain + and #
+	int channel = 0;				// the value is stored in the tags of this channel
+	bool ignoreRetained = false;	// a retained message is not stored
+	bool subscribe = false;			// first entry with this topic filter
+};
+
+struct devinterface {
+	Dev1820 *dev = NULL;
+	int channelOffset = 0;		// added to the device channel to form the tag channel
 };
 
 
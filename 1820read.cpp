@@ -24,6 +24,7 @@
 #include <syslog.h>
 #include <sys/utsname.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -31,6 +32,7 @@
 #include <string>
 
 #include "dev1820.h"
+#include "ttybaud.h"
 
 using namespace std;
 //using namespace libconfig;
@@ -39,10 +41,16 @@ bool exitSignal = false;
 std::string processName;
 static string execName;
 static string ttyDeviceStr = "/dev/ttyNANOTEMP";// default device
-static int ttyBaudrate;							// default baudrate is 9600
+static int ttyBaudrate = 9600;					// default baudrate is 9600
 int readCount = 10;			// default number of reads
+static string captureFileName;		// record received data to this file
+static string replayFileName;		// replay this capture file instead of device
+static double replaySpeed = 1.0;	// replay speed, 0 = as fast as possible
+static string decoderName = "text";	// decoder for the received data
+static int benchTime = 0;			// benchmark duration in seconds, 0 = no benchmark
 
-Dev1820 *dev;
+Dev1820 *dev = NULL;
+CaptureWriter capture;
 
 /* Handle OS signals
 */
@@ -68,24 +76,17 @@ void sigHandler(int signum)
 	exitSignal = true;
 }
 
-int getBaudrate(int baud) {
-	switch (baud) {
-		case 300: return B300;
-			break;
-		case 1200: return B1200;
-			break;
-		case 2400: return B2400;
-			break;
-		default: return B9600;
-	}
-}
-
 static void showUsage(void) {
 	cout << "usage:" << endl;
-	cout << execName << " -n10 -pSerialDevice -bBaudrate -h" << endl;
+	cout << execName << " -n10 -sSerialDevice -bBaudrate -wCaptureFile -rCaptureFile -x1 -ftext -B10 -h" << endl;
 	cout << "n = Number of results to read (default is 10, -1 is endless)" << endl;
 	cout << "s = Serial device (e.g. /dev/ttyUSB0)" << endl;
-	cout << "b = Baudrate (e.g. 9600) [300|1200|2400|9600]" << endl;
+	cout << "b = Baudrate (e.g. 9600 or 1000000) [" << TTY_BAUD_MIN << ".." << TTY_BAUD_MAX << "]" << endl;
+	cout << "w = Write received data with timestamps to capture file" << endl;
+	cout << "r = Replay capture file instead of reading the serial device" << endl;
+	cout << "x = Replay speed (default 1 is real time, 0 is as fast as possible)" << endl;
+	cout << "f = Decoder for the received data [text|binary] (default text)" << endl;
+	cout << "B = Benchmark for the given number of seconds, reports lines/s and bytes/s" << endl;
 	cout << "h = Display help" << endl;
 	cout << "default device is " << ttyDeviceStr << endl;
 	cout << "default baudrate is 9600" << endl;
@@ -93,7 +94,7 @@ static void showUsage(void) {
 }
 
 bool parseArguments(int argc, char *argv[]) {
-	char buffer[64];
+	char buffer[256];
 	int i, buflen;
 	int retval = true;
 	string str;
@@ -101,7 +102,8 @@ bool parseArguments(int argc, char *argv[]) {
 
 	if (argc > 1) {
 		for (i = 1; i < argc; i++) {
-			strcpy(buffer, argv[i]);
+			strncpy(buffer, argv[i], sizeof(buffer) - 1);
+			buffer[sizeof(buffer) - 1] = 0;
 			buflen = strlen(buffer);
 			if ((buffer[0] == '-') && (buflen >=2)) {
 				switch (buffer[1]) {
@@ -116,6 +118,23 @@ bool parseArguments(int argc, char *argv[]) {
 					str = std::string(&buffer[2]);
 					ttyBaudrate = std::stoi( str );
 					break;
+				case 'w':
+					captureFileName = std::string(&buffer[2]);
+					break;
+				case 'r':
+					replayFileName = std::string(&buffer[2]);
+					break;
+				case 'x':
+					str = std::string(&buffer[2]);
+					replaySpeed = std::stod( str );
+					break;
+				case 'f':
+					decoderName = std::string(&buffer[2]);
+					break;
+				case 'B':
+					str = std::string(&buffer[2]);
+					benchTime = std::stoi( str );
+					break;
 				case 'h':
 					showUsage();
 					retval = false;
@@ -132,9 +151,84 @@ bool parseArguments(int argc, char *argv[]) {
 	}  // if (argc >1)
 	// add config file extension
 
+	if ((ttyBaudrate < TTY_BAUD_MIN) || (ttyBaudrate > TTY_BAUD_MAX)) {
+		fprintf(stderr, "unsupported baudrate %d [%d..%d]\n", ttyBaudrate, TTY_BAUD_MIN, TTY_BAUD_MAX);
+		retval = false;
+	}
 	return retval;
 }
 
+/**
+ * milliseconds elapsed since start
+ */
+static double elapsed_ms(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - start->tv_sec) * 1000.0) + ((now.tv_nsec - start->tv_nsec) / 1e6);
+}
+
+/**
+ * print throughput for an interval
+ * link capacity is baud/10 bytes/s (8N1 framing)
+ */
+static void bench_report(const char *label, dev1820_stats *stats, dev1820_stats *last, double ms) {
+	double sec = ms / 1000.0;
+	double bytesPerSec = (stats->bytes - last->bytes) / sec;
+	printf("%-5s %8.0f lines/s %9.0f bytes/s %6.1f%% of link, %llu invalid\n", label,
+		(stats->lines - last->lines) / sec, bytesPerSec,
+		bytesPerSec * 1000.0 / ttyBaudrate, stats->invalid - last->invalid);
+}
+
+/**
+ * read as fast as the device delivers and report sustained throughput
+ * @returns 0 on success, -1 on failure
+ */
+int benchmark(void) {
+	dev1820_sample samples[256];
+	dev1820_stats stats, last, first;
+	struct timespec start, tick;
+	struct pollfd pfd;
+	double ms;
+	int count;
+
+	if (dev->openDevice() < 0) {
+		fprintf(stderr, "failed to open %s\n", dev->device());
+		return -1;
+	}
+	printf("benchmark %s at %d baud for %ds\n", dev->device(), ttyBaudrate, benchTime);
+	dev->getStats(&first);
+	last = first;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tick = start;
+	while (!exitSignal) {
+		pfd.fd = dev->fd();
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if ((poll(&pfd, 1, 100) < 0) && (errno != EINTR)) {
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			return -1;
+		}
+		if (pfd.revents) {
+			do {
+				count = dev->readBatch(samples, sizeof(samples) / sizeof(samples[0]));
+			} while (count == (int)(sizeof(samples) / sizeof(samples[0])));
+			// device lost or end of capture file
+			if (count < 0) break;
+		}
+		ms = elapsed_ms(&tick);
+		if (ms >= 1000.0) {
+			dev->getStats(&stats);
+			bench_report("", &stats, &last, ms);
+			last = stats;
+			clock_gettime(CLOCK_MONOTONIC, &tick);
+		}
+		if (elapsed_ms(&start) >= (benchTime * 1000.0)) break;
+	}
+	dev->getStats(&stats);
+	bench_report("total", &stats, &first, elapsed_ms(&start));
+	return 0;
+}
+
 int main (int argc, char *argv[])
 {
 	int channel;
@@ -146,19 +240,43 @@ int main (int argc, char *argv[])
 	//signal (SIGHUP, sigHandler);
 	signal (SIGINT, sigHandler);
 
-	dev = new Dev1820(ttyDeviceStr.c_str(), getBaudrate(ttyBaudrate));
+	if (replayFileName.length() > 0) {
+		dev = new Dev1820(replayFileName.c_str(), ttyBaudrate);
+		dev->setReplay(replaySpeed);
+	} else {
+		dev = new Dev1820(ttyDeviceStr.c_str(), ttyBaudrate);
+	}
+	if (dev->setDecoder(decoderName.c_str()) < 0) {
+		fprintf(stderr, "unknown decoder %s\n", decoderName.c_str());
+		goto exit_fail;
+	}
+	if (captureFileName.length() > 0) {
+		if (capture.open(captureFileName.c_str(), ttyBaudrate) < 0) goto exit_fail;
+		dev->setCapture(&capture);
+	}
 
-	do {
+	if (benchTime > 0) {
+		if (benchmark() < 0) goto exit_fail;
+		readCount = 0;
+	}
+
+	while ((readCount != 0) && (!exitSignal)) {
 		if ( dev->readSingle(&channel, &value) < 0 ) {
+			// end of capture file
+			if (replayFileName.length() > 0) break;
 			//goto exit_fail;
 		} else {
 			printf("CH%02d: %.1f\n", channel, value);
 		}
 		// endless run for negative values
-		if (readCount < 0) readCount = -1;
-	} while ( (--readCount != 0) && (!exitSignal) );
+		if (readCount > 0) readCount--;
+	}
 
 	delete(dev);
+	if (captureFileName.length() > 0) {
+		printf("%lu records written to %s\n", capture.records(), captureFileName.c_str());
+		capture.close();
+	}
 	//printf("Exit Success\n");
 	exit(EXIT_SUCCESS);
 
@@ -0,0 +1,455 @@
+/**
+ * @file 1820sim.cpp
+ *
+ * https://github.com/helioz2000/1820bridge
+ *
+ * Author: Erwin Bejsta
+ * August 2020
+ *
+ * Simulates one or more DS18B20 Arduino readers on pseudo terminals.
+ * Point "device" of an interface in the 1820bridge config file (or the
+ * -s option of 1820read) at the pty slave printed on startup.
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <iostream>
+#include <string>
+#include <stdexcept>
+
+#include "decoder.h"
+
+using namespace std;
+
+/*********************
+ *      DEFINES
+ *********************/
+#define SIM_MAX_DEVICES 32
+#define SIM_LINE_MAX 64
+#define SIM_WRITE_TIMEOUT 1000		// ms to wait for the reader to take the rest of a line
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+struct simdevice {
+	int masterFd = -1;
+	int slaveFd = -1;				// kept open to prevent hangup between readers
+	string slaveName;
+	string linkName;
+	double *temperature = NULL;		// current temperature of each channel
+	unsigned long lines = 0;
+	unsigned long bytes = 0;
+	unsigned long overruns = 0;		// lines dropped because the reader is too slow
+};
+
+bool exitSignal = false;
+static string execName;
+static int deviceCount = 1;			// number of simulated devices
+static int channelCount = 10;		// channels per device
+static double scanRate = 1.0;		// scans per second
+static double noise = 0.1;			// noise amplitude in degC
+static double dropoutPercent = 0;	// probability of a missing reading
+static double malformedPercent = 0;	// probability of a malformed line
+static int runTime = -1;			// seconds, -1 is endless
+static long seed = -1;				// random seed, -1 = time based
+static string linkName;				// symlink to first pty slave
+static bool binaryFormat = false;	// send binary frames instead of text lines
+
+simdevice devices[SIM_MAX_DEVICES];
+
+/* Handle OS signals
+*/
+void sigHandler(int signum)
+{
+	exitSignal = true;
+}
+
+static void showUsage(void) {
+	cout << "usage:" << endl;
+	cout << execName << " -d1 -c10 -r1 -x0.1 -o0 -m0 -t-1 -sSeed -lLinkName -ftext -h" << endl;
+	cout << "d = Number of simulated devices (default 1)" << endl;
+	cout << "c = Channels per device (default 10)" << endl;
+	cout << "r = Scans per second, every scan sends all channels (default 1)" << endl;
+	cout << "x = Noise amplitude in degC (default 0.1)" << endl;
+	cout << "o = Dropout probability per reading in percent (default 0)" << endl;
+	cout << "m = Malformed line probability in percent (default 0)" << endl;
+	cout << "t = Run time in seconds (default -1 is endless)" << endl;
+	cout << "s = Random seed (default is time based)" << endl;
+	cout << "l = Create symlink to the pty slave, devices >1 are numbered (e.g. /tmp/ttyNANOTEMP)" << endl;
+	cout << "f = Data format [text|binary] (default text)" << endl;
+	cout << "h = Display help" << endl;
+}
+
+bool parseArguments(int argc, char *argv[]) {
+	char buffer[256];
+	int i, buflen;
+	int retval = true;
+	string str;
+	execName = std::string(basename(argv[0]));
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i++) {
+			strncpy(buffer, argv[i], sizeof(buffer) - 1);
+			buffer[sizeof(buffer) - 1] = 0;
+			buflen = strlen(buffer);
+			if ((buffer[0] == '-') && (buflen >=2)) {
+				str = std::string(&buffer[2]);
+				try {
+					switch (buffer[1]) {
+					case 'd':
+						deviceCount = std::stoi(str);
+						break;
+					case 'c':
+						channelCount = std::stoi(str);
+						break;
+					case 'r':
+						scanRate = std::stod(str);
+						break;
+					case 'x':
+						noise = std::stod(str);
+						break;
+					case 'o':
+						dropoutPercent = std::stod(str);
+						break;
+					case 'm':
+						malformedPercent = std::stod(str);
+						break;
+					case 't':
+						runTime = std::stoi(str);
+						break;
+					case 's':
+						seed = std::stol(str);
+						break;
+					case 'l':
+						linkName = str;
+						break;
+					case 'f':
+						if (str == "binary") binaryFormat = true;
+						else if (str != "text") throw invalid_argument(str);
+						break;
+					case 'h':
+					default:
+						showUsage();
+						retval = false;
+						break;
+					} // switch
+				} catch (...) {
+					fprintf(stderr, "invalid parameter: %s\n", argv[i]);
+					retval = false;
+				}
+			} // if
+		}  // for (i)
+	}  // if (argc >1)
+
+	if ((deviceCount < 1) || (deviceCount > SIM_MAX_DEVICES)) {
+		fprintf(stderr, "number of devices must be 1..%d\n", SIM_MAX_DEVICES);
+		retval = false;
+	}
+	if ((channelCount < 1) || (scanRate <= 0)) {
+		fprintf(stderr, "channels and scan rate must be greater than 0\n");
+		retval = false;
+	}
+	return retval;
+}
+
+/**
+ * random number [0..1)
+ */
+static double sim_random(void) {
+	return drand48();
+}
+
+/**
+ * create a pseudo terminal for a simulated device
+ * @returns 0 on success, -1 on failure
+ */
+int sim_open(simdevice *dev, int index) {
+	char *name;
+	struct termios tty;
+	int pkt = 1;
+
+	dev->masterFd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (dev->masterFd < 0) {
+		fprintf(stderr, "%s: posix_openpt failed: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	if ((grantpt(dev->masterFd) != 0) || (unlockpt(dev->masterFd) != 0)) {
+		fprintf(stderr, "%s: failed to unlock pty: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	name = ptsname(dev->masterFd);
+	if (name == NULL) {
+		fprintf(stderr, "%s: ptsname failed: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	// packet mode reports the flush of the reader's open (see sim_reader_opened)
+	if (ioctl(dev->masterFd, TIOCPKT, &pkt) != 0) {
+		fprintf(stderr, "%s: failed to set packet mode: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	dev->slaveName = name;
+	dev->slaveFd = open(name, O_RDWR | O_NOCTTY);
+	if (dev->slaveFd < 0) {
+		fprintf(stderr, "%s: error opening %s: %s\n", __func__, name, strerror(errno));
+		return -1;
+	}
+	// raw mode until the reader sets its own attributes
+	if (tcgetattr(dev->slaveFd, &tty) == 0) {
+		cfmakeraw(&tty);
+		tcsetattr(dev->slaveFd, TCSANOW, &tty);
+	}
+	if (linkName.length() > 0) {
+		dev->linkName = linkName;
+		if (index > 0) dev->linkName += std::to_string(index);
+		unlink(dev->linkName.c_str());
+		if (symlink(name, dev->linkName.c_str()) != 0) {
+			fprintf(stderr, "%s: symlink %s failed: %s\n", __func__, dev->linkName.c_str(), strerror(errno));
+			dev->linkName = "";
+		}
+	}
+	dev->temperature = new double[channelCount];
+	for (int ch = 0; ch < channelCount; ch++) {
+		dev->temperature[ch] = 15.0 + (sim_random() * 20.0);
+	}
+	return 0;
+}
+
+void sim_close(simdevice *dev) {
+	if (dev->linkName.length() > 0) unlink(dev->linkName.c_str());
+	if (dev->slaveFd >= 0) close(dev->slaveFd);
+	if (dev->masterFd >= 0) close(dev->masterFd);
+	delete [] dev->temperature;
+	dev->temperature = NULL;
+}
+
+/**
+ * send one line to the reader
+ */
+void sim_send(simdevice *dev, const char *line, int len) {
+	struct pollfd pfd = { dev->masterFd, POLLOUT, 0 };
+	int wrlen, done = 0;
+	while (done < len) {
+		wrlen = write(dev->masterFd, &line[done], len - done);
+		if (wrlen > 0) {
+			done += wrlen;
+			continue;
+		}
+		if ((wrlen < 0) && (errno == EINTR)) continue;
+		// a line which doesn't fit is dropped, once started it is completed
+		if ((done == 0) || (wrlen == 0) || (errno != EAGAIN)) break;
+		if (poll(&pfd, 1, SIM_WRITE_TIMEOUT) <= 0) break;
+	}
+	if (done == len) {
+		dev->lines++;
+		dev->bytes += len;
+	} else {
+		dev->overruns++;
+	}
+}
+
+/**
+ * send a malformed line, one of several defects seen in the field
+ */
+void sim_send_malformed(simdevice *dev, int channel, double value) {
+	char line[SIM_LINE_MAX];
+	int len;
+	switch ((int)(sim_random() * 4)) {
+	case 0:		// truncated line
+		len = snprintf(line, sizeof(line), "T%d %.2f", channel, value);
+		len = 1 + (int)(sim_random() * (len - 1));
+		line[len++] = '\n';
+		break;
+	case 1:		// missing value
+		len = snprintf(line, sizeof(line), "T%d \r\n", channel);
+		break;
+	case 2:		// garbled characters
+		len = snprintf(line, sizeof(line), "T%d %.2f\r\n", channel, value);
+		line[1 + (int)(sim_random() * (len - 3))] = '#';
+		break;
+	default:	// line noise
+		len = 1 + (int)(sim_random() * 16);
+		for (int i = 0; i < len; i++) line[i] = (char)(sim_random() * 256);
+		line[len++] = '\n';
+		break;
+	}
+	sim_send(dev, line, len);
+}
+
+/**
+ * send one reading of every channel of a device
+ */
+void sim_scan(simdevice *dev) {
+	char line[SIM_LINE_MAX];
+	int len;
+	double value;
+	for (int ch = 0; ch < channelCount; ch++) {
+		// slow random walk plus measurement noise
+		dev->temperature[ch] += (sim_random() - 0.5) * 0.05;
+		value = dev->temperature[ch] + ((sim_random() - 0.5) * 2.0 * noise);
+		if ((dropoutPercent > 0) && ((sim_random() * 100.0) < dropoutPercent))
+			continue;
+		if ((malformedPercent > 0) && ((sim_random() * 100.0) < malformedPercent)) {
+			sim_send_malformed(dev, ch + 1, value);
+			continue;
+		}
+		len = snprintf(line, sizeof(line), "T%d %.2f\r\n", ch + 1, value);
+		sim_send(dev, line, len);
+	}
+}
+
+/**
+ * send the readings collected in a binary frame
+ * @param frame: the frame, readings start at offset 2
+ * @param len: payload length
+ * @param malformed: corrupt one byte of the frame
+ */
+void sim_send_frame(simdevice *dev, uint8_t *frame, int len, bool malformed) {
+	frame[0] = DECODER_BIN_SYNC;
+	frame[1] = (uint8_t)len;
+	frame[len + 2] = decoder_crc8(0, &frame[1], len + 1);
+	if (malformed) frame[1 + (int)(sim_random() * (len + 2))] ^= 0x10;
+	sim_send(dev, (const char*)frame, len + 3);
+}
+
+/**
+ * send one reading of every channel of a device as binary frames
+ */
+void sim_scan_binary(simdevice *dev) {
+	uint8_t frame[DECODER_BIN_PAYLOAD_MAX + 3];
+	int len = 0;
+	int16_t raw;
+	double value;
+	bool malformed = false;
+	for (int ch = 0; ch < channelCount; ch++) {
+		dev->temperature[ch] += (sim_random() - 0.5) * 0.05;
+		value = dev->temperature[ch] + ((sim_random() - 0.5) * 2.0 * noise);
+		if ((dropoutPercent > 0) && ((sim_random() * 100.0) < dropoutPercent))
+			continue;
+		if ((malformedPercent > 0) && ((sim_random() * 100.0) < malformedPercent))
+			malformed = true;
+		raw = (int16_t)lround(value * 16.0);
+		frame[len + 2] = (ch + 1) & 0xFF;
+		frame[len + 3] = (ch + 1) >> 8;
+		frame[len + 4] = raw & 0xFF;
+		frame[len + 5] = (raw >> 8) & 0xFF;
+		len += DECODER_BIN_READING;
+		if (len == DECODER_BIN_PAYLOAD_MAX) {
+			sim_send_frame(dev, frame, len, malformed);
+			len = 0;
+			malformed = false;
+		}
+	}
+	if (len > 0) sim_send_frame(dev, frame, len, malformed);
+}
+
+/**
+ * send the startup banner of the reader
+ */
+void sim_banner(simdevice *dev) {
+	char line[SIM_LINE_MAX];
+	int len = snprintf(line, sizeof(line), "DS18B20 temperature reader\r\n");
+	sim_send(dev, line, len);
+	len = snprintf(line, sizeof(line), "Found %d sensors\r\n", channelCount);
+	sim_send(dev, line, len);
+}
+
+/**
+ * check if a reader has opened the device
+ * The reader flushes its input after opening the tty, in packet mode the
+ * master gets TIOCPKT_FLUSHREAD then. Anything written before would be lost.
+ * @returns true if the device has been opened since the last call
+ */
+bool sim_reader_opened(simdevice *dev) {
+	char buf[SIM_LINE_MAX];
+	bool opened = false;
+	int rdlen;
+	while ((rdlen = read(dev->masterFd, buf, sizeof(buf))) > 0) {
+		if ((buf[0] != TIOCPKT_DATA) && (buf[0] & TIOCPKT_FLUSHREAD)) opened = true;
+	}
+	return opened;
+}
+
+/**
+ * add nanoseconds to a timespec
+ */
+void timespec_add(struct timespec *ts, long long nsec) {
+	nsec += ts->tv_nsec;
+	ts->tv_sec += nsec / 1000000000LL;
+	ts->tv_nsec = nsec % 1000000000LL;
+}
+
+int main (int argc, char *argv[])
+{
+	struct timespec next, start, now;
+	long long interval;
+	unsigned long lines = 0, bytes = 0, overruns = 0;
+	double elapsed;
+	int index;
+
+	if (! parseArguments(argc, argv) ) exit(EXIT_FAILURE);
+
+	signal (SIGINT, sigHandler);
+	signal (SIGTERM, sigHandler);
+
+	srand48((seed < 0) ? time(NULL) : seed);
+
+	for (index = 0; index < deviceCount; index++) {
+		if (sim_open(&devices[index], index) < 0) goto exit_fail;
+		printf("device %d: %s", index, devices[index].slaveName.c_str());
+		if (devices[index].linkName.length() > 0) printf(" (%s)", devices[index].linkName.c_str());
+		printf("\n");
+	}
+	fflush(stdout);
+
+	interval = (long long)(1000000000.0 / scanRate);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = start;
+	while (!exitSignal) {
+		timespec_add(&next, interval);
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0) continue;
+		for (index = 0; index < deviceCount; index++) {
+			// the Nano prints its banner after the reset on each open
+			if (sim_reader_opened(&devices[index])) sim_banner(&devices[index]);
+			if (binaryFormat) sim_scan_binary(&devices[index]);
+			else sim_scan(&devices[index]);
+		}
+		if ((runTime >= 0) && (((next.tv_sec - start.tv_sec) * 1000000000LL + (next.tv_nsec - start.tv_nsec)) >= (runTime * 1000000000LL))) break;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - start.tv_sec) + ((now.tv_nsec - start.tv_nsec) / 1e9);
+	for (index = 0; index < deviceCount; index++) {
+		lines += devices[index].lines;
+		bytes += devices[index].bytes;
+		overruns += devices[index].overruns;
+		sim_close(&devices[index]);
+	}
+	fprintf(stderr, "%lu lines, %lu bytes, %lu overruns in %.1fs (%.0f lines/s)\n",
+		lines, bytes, overruns, elapsed, (elapsed > 0) ? lines / elapsed : 0);
+	exit(EXIT_SUCCESS);
+
+exit_fail:
+	for (index = 0; index < deviceCount; index++) {
+		sim_close(&devices[index]);
+	}
+	exit(EXIT_FAILURE);
+}
@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
 #include <unistd.h>
 #include "1820tag.h"
@@ -89,6 +90,19 @@ static uint16_t gen_crc16(const char *data, uint16_t size)
     return crc;
 }
 
+/**
+ * FNV-1a hash of a topic
+ */
+uint32_t topic_hash(std::string_view topic)
+{
+    uint32_t hash = 2166136261U;
+    for (char c : topic) {
+        hash ^= (uint8_t)c;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
 /*********************
  * MEMBER FUNCTIONS
  *********************/
@@ -99,20 +113,32 @@ static uint16_t gen_crc16(const char *data, uint16_t size)
 
 Tag::Tag() {
 	this->_topic = "";
+	this->_channel = -1;
+	this->_updatecycleID = -1;	// not assigned to an update cycle
 	this->_valueUpdate = NULL;
 	this->_valueUpdateID = -1;
 	this->_publish = false;        // subscribe tag
 	this->_publishRetain = false;
 	this->_valueIsRetained = false;
-	this->_topicDoubleValue = 0.0;
 	this->_multiplier = 1.0;
 	this->_offset = 0.0;
 	this->_noreadvalue = 0.0;
 	this->_noreadaction = -1;	// do nothing
-	this->_expiryTime = 0;		// no expiry
-}
-
-Tag::Tag(const char *topicStr) {
+	this->_publishTimestamp = false;
+	this->_messageExpiry = 0;
+	this->_qos = 0;
+	this->_deadband = 0.0;
+	this->_deadbandPercent = 0.0;
+	this->_published = false;
+	this->_publishedValue = 0.0;
+	this->_formattedValue = 0.0;
+	this->_formattedValid = false;
+	this->publishInterval = 0;
+	this->nextPublishTime = 0;
+	this->queuedTime = 0;
+}
+
+Tag::Tag(const char *topicStr) : Tag() {
     if (topicStr == NULL) {
         throw invalid_argument("Class Tag - topic is NULL");
     }
@@ -153,64 +179,18 @@ int Tag::valueUpdateID(void) {
     return _valueUpdateID;
 }
 */
-void Tag::testCallback() {
+void Tag::notifyUpdate(void) {
     if (_valueUpdate != NULL) {
         (*_valueUpdate) (_valueUpdateID, this);
     }
 }
 
-void Tag::setValue(double doubleValue) {
-    _topicDoubleValue = doubleValue;
-    _lastUpdateTime = time(NULL);
-    // call valueUpdate callback if it exists
+void Tag::testCallback() {
     if (_valueUpdate != NULL) {
         (*_valueUpdate) (_valueUpdateID, this);
     }
 }
 
-void Tag::setValue(float floatValue) {
-    setValue( (double) floatValue );
-}
-
-void Tag::setValue(int intValue) {
-    setValue( (double) intValue );
-}
-
-bool Tag::setValue(const char* strValue) {
-    float newValue;
-    int result = 0;
-    char firstChar = strValue[0];
-
-    // check for numeric data
-    if ( (firstChar >= '0') && (firstChar <='9') ) {
-        result = sscanf(strValue, "%f", &newValue);
-    } else {    // non-numeric, assume its "true" or "false"
-        if ( (firstChar == 'f') || (firstChar == 'F') ) {
-            newValue = 0; result = 1; }
-        if ( (firstChar == 't') || (firstChar == 'T') ) {
-            newValue = 1; result = 1; }
-    }
-    // report conversion failure
-    if (result != 1) {
-        fprintf(stderr, "%s[%d] %s - failed to convert <%s> for topic %s\n", __FILE__,__LINE__,__func__, strValue, _topic.c_str());
-        return false;
-    }
-    setValue(newValue);
-    return true;
-}
-
-double Tag::doubleValue(void) {
-    return _topicDoubleValue;
-}
-
-float Tag::floatValue(void) {
-    return (float) _topicDoubleValue;
-}
-
-int Tag::intValue(void) {
-    return (int) _topicDoubleValue;
-}
-
 bool Tag::isPublish() {
     return _publish;
 }
@@ -255,10 +235,27 @@ const char* Tag::getFormat(void) {
 	return _format.c_str();
 }
 
-void Tag::setFormat(const char* newFormat) {
-	if (newFormat != NULL) {
-		_format = newFormat;
+bool Tag::setFormat(const char* newFormat) {
+	if (newFormat == NULL) return true;
+	if (_valueFormat.compile(newFormat) < 0) return false;
+	_format = newFormat;
+	_formattedValid = false;
+	return true;
+}
+
+int Tag::formatValue(char *buf, int size, float value) {
+	return _valueFormat.format(buf, size, value);
+}
+
+const char* Tag::getFormattedValue(float value) {
+	if (_formattedValid && (value == _formattedValue)) return _formatted;
+	if (_valueFormat.format(_formatted, sizeof(_formatted), value) < 0) {
+		_formattedValid = false;
+		return NULL;
 	}
+	_formattedValue = value;
+	_formattedValid = true;
+	return _formatted;
 }
 
 void Tag::setOffset(float newOffset) {
@@ -273,10 +270,9 @@ float Tag::getMultiplier(void) {
 	return _multiplier;
 }
 
-float Tag::getScaledValue(void) {
-	double dValue = this->_topicDoubleValue;
-	dValue *= this->_multiplier;
-	return dValue + this->_offset;
+float Tag::scaleValue(double value) {
+	value *= this->_multiplier;
+	return value + this->_offset;
 }
 
 void Tag::setChannel(int newChannel) {
@@ -287,16 +283,28 @@ int Tag::getChannel(void) {
 	return this->_channel;
 }
 
-void Tag::setExpiryTime(int newValue) {
-	_expiryTime = newValue;
+void Tag::setPublishTimestamp(bool newValue) {
+	_publishTimestamp = newValue;
+}
+
+bool Tag::getPublishTimestamp(void) {
+	return _publishTimestamp;
+}
+
+void Tag::setQos(int newValue) {
+	_qos = newValue;
+}
+
+int Tag::getQos(void) {
+	return _qos;
+}
+
+void Tag::setMessageExpiry(uint32_t newValue) {
+	_messageExpiry = newValue;
 }
 
-bool Tag::isExpired() {
-	// expiry time 0 = no expiry
-	if (_expiryTime <= 0) return false;
-	time_t expiry = _lastUpdateTime + _expiryTime;
-	if (expiry >= time(NULL)) return true;
-	return false;
+uint32_t Tag::getMessageExpiry(void) {
+	return _messageExpiry;
 }
 
 void Tag::setNoreadValue(float newValue) {
@@ -315,90 +323,41 @@ int Tag::getNoreadAction(void) {
 	return this->_noreadaction;
 }
 
+void Tag::setDeadband(float newValue) {
+	this->_deadband = fabsf(newValue);
+}
 
-
-//
-// Class TagStore
-//
-
-TagStore::TagStore() {
-    // mark tag list entries as empty
-    for (int i = 0; i < MAX_TAG_NUM; i++) {
-        _tagList[i] = NULL;
-    }
-    _iterateIndex = -1;
+float Tag::getDeadband(void) {
+	return this->_deadband;
 }
 
-TagStore::~TagStore() {
-    deleteAll();
+void Tag::setDeadbandPercent(float newValue) {
+	this->_deadbandPercent = fabsf(newValue);
 }
 
-void TagStore::deleteAll(void) {
-    // delete every tag
-    for (int i = 0; i < MAX_TAG_NUM; i++) {
-        delete(_tagList[i]);
-        _tagList[i] = NULL;
-    }
+float Tag::getDeadbandPercent(void) {
+	return this->_deadbandPercent;
 }
 
-Tag *TagStore::getTag(const char* tagTopic) {
+bool Tag::isOutsideDeadband(float value) {
+	float delta;
+	if (!_published) return true;
+	delta = fabsf(value - _publishedValue);
+	if ((_deadband > 0) && (delta <= _deadband)) return false;
+	if ((_deadbandPercent > 0) && (delta <= (fabsf(_publishedValue) * _deadbandPercent / 100.0))) return false;
+	return true;
+}
 
-    string topic (tagTopic);
-    uint16_t tagCrc = gen_crc16(topic.data(), topic.length());
-    Tag *retTag =  NULL;
+bool Tag::isLastPayload(const char* payload) {
+	return _published && (_publishedPayload == payload);
+}
 
-    for (int index = 0; index < MAX_TAG_NUM; index++) {
-        if (_tagList[index] == NULL) continue;
-        if (tagCrc == _tagList[index]->getTopicCrc()) {
-            retTag = _tagList[index];
-            break;
-        }
-    }
-    return retTag;
+void Tag::setPublished(float value, const char* payload) {
+	_published = true;
+	_publishedValue = value;
+	_publishedPayload = payload;
 }
 
-Tag* TagStore::getFirstTag(void) {
-    int index;
-    // find first free entry in tag list
-    for (index = 0; index < MAX_TAG_NUM; index++) {
-        if (_tagList[index] != NULL) {
-            _iterateIndex = index;
-            return _tagList[index];
-        }
-    }
-    return NULL;    // no tags found
-}
-
-Tag* TagStore::getNextTag(void) {
-    int index;
-    // check if getFirstTag has been called
-    if (_iterateIndex < 0) return NULL;
-    // find first free entry in tag list
-    for (index = _iterateIndex+1; index < MAX_TAG_NUM; index++) {
-        if (_tagList[index] != NULL) {
-            _iterateIndex = index;
-            return _tagList[index];
-        }
-    }
-    // No more tags found
-    _iterateIndex = -1; // reset iterateIndex
-    return NULL;
-}
-
-Tag* TagStore::addTag(const char* tagTopic) {
-    int index, freeIndex = -1;
-    // find first free entry in tag list
-    for (index = 0; index < MAX_TAG_NUM; index++) {
-        if (_tagList[index] == NULL) {
-            freeIndex = index;
-            break;
-        }
-    }
-    // abort if tagList is full
-    if (freeIndex < 0) return NULL;
-    // create new tag and store in list
-    Tag *tPtr = new Tag(tagTopic);
-    _tagList[index] = tPtr;
-    //printf("%s - [%d] - %s\n", __func__, index, tPtr->getTopic());
-    return tPtr;
+void Tag::resetPublished(void) {
+	_published = false;
 }
@@ -1,17 +1,18 @@
 /**
  * @file 1820tag.h
 -----------------------------------------------------------------------------
- Two classes provide encapsulation for typical use of a data tag in an
+ Class "Tag" provides encapsulation for typical use of a data tag in an
  automation oriented user interface.
  This implementation is targeted data which is based on the MQTT protocol
  and stores the data access information as a topic path (see MQTT details)
- Class "Tag" encapsulates a single data unit
- Class "TagList" provides a facility to manage a list of tags
+ Class "Tag" encapsulates a single data unit, the tags are kept and found
+ by their topic in TagTable (see tagtable.h)
  The Tag class provides for a callback interface which is intended to update
  a user interface element (e.g. display value) only when data changes
  The "publish" member defines if a tag's value is published (written)
  to an mqtt broker or if it is subscribed (read from MQTT broker).
  This information is used outside this class.
+ The value and its update times are held by TagTable (see tagtable.h).
 -----------------------------------------------------------------------------
 */
 
@@ -22,19 +23,39 @@
  *      INCLUDES
  *********************/
 #include <stdint.h>
+#include <time.h>
 
 #include <iostream>
 #include <string>
+#include <string_view>
+
+#include "valueformat.h"
 
 /*********************
  *      DEFINES
  *********************/
-#define MAX_TAG_NUM 100         // The mximum number of tags which can be stored in TagList
+#define TAG_VALUE_LEN 64			// max length of a formatted value
 
 /**********************
  *      TYPEDEFS
  **********************/
 
+// consistent snapshot of a tag value and the time of its update
+struct tag_value {
+	double value;
+	int64_t updateTime;			// [ns] CLOCK_REALTIME
+	int64_t updateMonoTime;		// [ns] CLOCK_MONOTONIC
+};
+
+/**********************
+ * GLOBAL PROTOTYPES
+ **********************/
+
+/**
+ * Hash of a topic string as used by the topic indexes
+ */
+uint32_t topic_hash(std::string_view topic);
+
 class Tag {
 public:
     /**
@@ -91,47 +112,10 @@ public:
     void testCallback();
 
     /**
-     * Set the value
-     * @param doubleValue: the new value
+     * Call the value update callback, if one is registered
+     * the value itself is held by TagTable
      */
-    void setValue(double doubleValue);
-
-    /**
-     * Set the value
-     * @param floatValue: the new value
-     */
-    void setValue(float floatValue);
-
-    /**
-     * Set the value
-     * @param intValue: the new value
-     */
-    void setValue(int intValue);
-
-    /**
-     * Set the value
-     * @param strValue: new value as a string
-     * @returns true on success
-     */
-    bool setValue(const char* strValue);
-
-    /**
-     * Get value
-     * @return value as double
-     */
-    double doubleValue(void);
-
-    /**
-     * Get value
-     * @return value as float
-     */
-    float floatValue(void);
-
-    /**
-     * Get value
-     * @return value as int
-     */
-    int intValue(void);
+    void notifyUpdate(void);
 
     /**
      * is tag "publish"
@@ -172,10 +156,10 @@ public:
 	int getChannel(void);
 
 	/**
-	* Get scaled value
+	* Apply multiplier and offset to a value (e.g. from TagTable::getValue())
 	* @return scaled value as float
 	*/
-	float getScaledValue(void);
+	float scaleValue(double value);
 
 	/**
 	 * set/get value is retained
@@ -191,9 +175,27 @@ public:
 
 	/**
 	 * Set/Get format
+	 * The format is parsed when it is set (see ValueFormat)
+	 * @return setFormat: false if the format is not supported
 	 */
 	const char* getFormat(void);
-	void setFormat(const char* newFormat);
+	bool setFormat(const char* newFormat);
+
+	/**
+	 * Format a value with the tag's format
+	 * @param buf: receives the formatted value
+	 * @param size: size of buf
+	 * @return length of the formatted value, -1 if it doesn't fit into buf
+	 */
+	int formatValue(char *buf, int size, float value);
+
+	/**
+	 * Get a value formatted with the tag's format
+	 * The result is kept and only formatted again when the value changes
+	 * Note: only to be used by the publishing thread
+	 * @return the formatted value, NULL if it is longer than TAG_VALUE_LEN
+	 */
+	const char* getFormattedValue(float value);
 
 	/**
 	* Set/Get multiplier
@@ -207,14 +209,22 @@ public:
 	void setOffset(float newOffset);
 
 	/**
-	 * Set expiry time
+	 * Set/Get publish the update time with the value
+	 */
+	void setPublishTimestamp(bool newValue);
+	bool getPublishTimestamp(void);
+
+	/**
+	 * Set/Get MQTT quality of service [0..2]
 	 */
-	void setExpiryTime(int newTime);
+	void setQos(int newValue);
+	int getQos(void);
 
 	/**
-	 * Get value expired
+	 * Set/Get MQTT message expiry interval [s], 0 = none (MQTT 5 only)
 	 */
-	bool isExpired(void);
+	void setMessageExpiry(uint32_t newValue);
+	uint32_t getMessageExpiry(void);
 
 	/**
 	* Set/Get noread value
@@ -228,10 +238,41 @@ public:
 	void setNoreadAction(int);
 	int getNoreadAction(void);
 
+	/**
+	 * Set/Get deadband for report by exception, 0 = none
+	 * deadband is absolute, deadband percent is relative to the last published value
+	 */
+	void setDeadband(float newValue);
+	float getDeadband(void);
+	void setDeadbandPercent(float newValue);
+	float getDeadbandPercent(void);
+
+	/**
+	 * Check if a scaled value has moved beyond the deadband
+	 * @return true if the value has never been published or it has moved beyond the deadband
+	 */
+	bool isOutsideDeadband(float value);
+
+	/**
+	 * Check if a payload is the same as the last published payload
+	 */
+	bool isLastPayload(const char* payload);
+
+	/**
+	 * Record the scaled value and payload which has been published
+	 */
+	void setPublished(float value, const char* payload);
+
+	/**
+	 * Forget the last published value, the next value is published regardless of the deadband
+	 */
+	void resetPublished(void);
+
 
     // public members used to store data which is not used inside this class
     int publishInterval;                // seconds between publish
     time_t nextPublishTime;             // next publish time
+    int64_t queuedTime;                 // update time of the last sample queued while disconnected
 
 private:
 	// All properties of this class are private
@@ -241,8 +282,9 @@ private:
 	int _channel;
 	int _updatecycleID;
 	uint16_t _topicCRC;					// CRC on topic path
-	double _topicDoubleValue;			// storage numeric value
-	time_t _lastUpdateTime;				// last update time (change of value)
+	bool _publishTimestamp;				// publish update time with the value
+	uint32_t _messageExpiry;			// mqtt message expiry interval [s]
+	int _qos;							// mqtt quality of service
 	void (*_valueUpdate) (int,Tag*);	// callback for value update
 	int _valueUpdateID;					// ID for value update
 	bool _publish;						// true = we publish, false = we subscribe
@@ -252,50 +294,15 @@ private:
 	float _offset;						// offset for scaled value
 	float _noreadvalue;					// value to publish for noread
 	int _noreadaction;					// action to take on noread
-	int _expiryTime;					// max seconds between updates before value expires
-};
-
-class TagStore {
-public:
-	TagStore();
-	~TagStore();
-
-    /**
-     * Add a tag
-     * @param tagTopic: the topic as a string
-     * @return reference to new tag or NULL on failure
-     */
-    Tag* addTag(const char* tagTopic);
-
-    /**
-     * Delete all tags from tag list
-     */
-    void deleteAll(void);
-
-    /**
-     * Find tag in the list and return reference
-     * @param tagTopic: the topic as a string
-     * @return reference to tag or NULL is if not found
-     */
-    Tag* getTag(const char* tagTopic);
-
-    /**
-     * Get first tag from store
-     * use in conjunction with getNextTag to iterate over all tags
-     * @return reference to first tag or NULL if tagList is empty
-     */
-    Tag* getFirstTag(void);
-
-    /**
-     * Get next tag from store
-     * use in conjunction with getFirstTag to iterate over all tags
-     * @return reference to next tag or NULL if end of tagList
-     */
-     Tag* getNextTag(void);
-
-private:
-    Tag *_tagList[MAX_TAG_NUM];     // An array references to Tags
-    int _iterateIndex;              // to interate over all tags in store
+	float _deadband;					// absolute deadband, 0 = none
+	float _deadbandPercent;				// deadband in % of last published value, 0 = none
+	bool _published;					// a value has been published
+	float _publishedValue;				// last published scaled value
+	std::string _publishedPayload;		// last published payload
+	ValueFormat _valueFormat;			// parsed _format
+	char _formatted[TAG_VALUE_LEN];		// last formatted value
+	float _formattedValue;				// value of _formatted
+	bool _formattedValid;				// _formatted is valid
 };
 
 #endif /* _1820TAG_H_ */
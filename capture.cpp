@@ -0,0 +1,185 @@
+/**
+ * @file capture.cpp
+ *
+ * https://github.com/helioz2000/1820bridge
+ *
+ * Author: Erwin Bejsta
+ * August 2020
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include "capture.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define CAPTURE_MAGIC "1820CAP1"
+#define CAPTURE_MAGIC_LEN 8
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+struct capture_header {
+	char magic[CAPTURE_MAGIC_LEN];
+	uint32_t version;
+	uint32_t baudrate;
+	int64_t startTime;		// CLOCK_REALTIME [ns]
+};
+
+struct capture_record_header {
+	uint32_t delta;			// us since previous record
+	uint16_t len;
+} __attribute__((packed));
+
+/*********************
+ * MEMBER FUNCTIONS
+ *********************/
+
+//
+// Class CaptureWriter
+//
+
+CaptureWriter::CaptureWriter() {
+	_file = NULL;
+	_records = 0;
+}
+
+CaptureWriter::~CaptureWriter() {
+	close();
+}
+
+int CaptureWriter::open(const char *fileName, int baudrate) {
+	struct capture_header header;
+	struct timespec now;
+
+	close();
+	_file = fopen(fileName, "wb");
+	if (_file == NULL) {
+		fprintf(stderr, "%s: Error creating %s: %s\n", __func__, fileName, strerror(errno));
+		return -1;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+	header.version = CAPTURE_VERSION;
+	header.baudrate = baudrate;
+	clock_gettime(CLOCK_REALTIME, &now);
+	header.startTime = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+	if (fwrite(&header, sizeof(header), 1, _file) != 1) {
+		fprintf(stderr, "%s: Error writing %s: %s\n", __func__, fileName, strerror(errno));
+		close();
+		return -1;
+	}
+	_lastTime.tv_sec = 0;
+	_lastTime.tv_nsec = 0;
+	_records = 0;
+	return 0;
+}
+
+void CaptureWriter::close(void) {
+	if (_file == NULL) return;
+	fclose(_file);
+	_file = NULL;
+}
+
+int CaptureWriter::write(const struct timespec *rxTime, const void *data, unsigned int len) {
+	struct capture_record_header rh;
+	int64_t delta;
+
+	if (_file == NULL) return -1;
+	if (len > CAPTURE_DATA_MAX) len = CAPTURE_DATA_MAX;
+	if (_records == 0) {
+		delta = 0;
+	} else {
+		delta = ((int64_t)(rxTime->tv_sec - _lastTime.tv_sec) * 1000000LL) + ((rxTime->tv_nsec - _lastTime.tv_nsec) / 1000);
+		if (delta < 0) delta = 0;
+		if (delta > UINT32_MAX) delta = UINT32_MAX;
+	}
+	// advance by the recorded delta to avoid accumulating rounding errors
+	if (_records == 0) {
+		_lastTime = *rxTime;
+	} else {
+		_lastTime.tv_nsec += (delta % 1000000LL) * 1000;
+		_lastTime.tv_sec += (delta / 1000000LL) + (_lastTime.tv_nsec / 1000000000L);
+		_lastTime.tv_nsec %= 1000000000L;
+	}
+	rh.delta = (uint32_t)delta;
+	rh.len = len;
+	if ((fwrite(&rh, sizeof(rh), 1, _file) != 1) || (fwrite(data, 1, len, _file) != len)) {
+		fprintf(stderr, "%s: Error writing capture file: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	_records++;
+	return 0;
+}
+
+unsigned long CaptureWriter::records(void) {
+	return _records;
+}
+
+//
+// Class CaptureReader
+//
+
+CaptureReader::CaptureReader() {
+	_file = NULL;
+	_time = 0;
+	_baudrate = 0;
+}
+
+CaptureReader::~CaptureReader() {
+	close();
+}
+
+int CaptureReader::open(const char *fileName) {
+	struct capture_header header;
+
+	close();
+	_file = fopen(fileName, "rb");
+	if (_file == NULL) {
+		fprintf(stderr, "%s: Error opening %s: %s\n", __func__, fileName, strerror(errno));
+		return -1;
+	}
+	if ((fread(&header, sizeof(header), 1, _file) != 1) ||
+		(memcmp(header.magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) ||
+		(header.version != CAPTURE_VERSION)) {
+		fprintf(stderr, "%s: %s is not a capture file\n", __func__, fileName);
+		close();
+		return -1;
+	}
+	_baudrate = header.baudrate;
+	_time = 0;
+	return 0;
+}
+
+void CaptureReader::close(void) {
+	if (_file == NULL) return;
+	fclose(_file);
+	_file = NULL;
+}
+
+int CaptureReader::next(capture_record *record) {
+	struct capture_record_header rh;
+
+	if (_file == NULL) return -1;
+	if (fread(&rh, sizeof(rh), 1, _file) != 1) return -1;
+	if ((rh.len > CAPTURE_DATA_MAX) || (fread(record->data, 1, rh.len, _file) != rh.len)) {
+		fprintf(stderr, "%s: truncated capture file\n", __func__);
+		return -1;
+	}
+	_time += rh.delta;
+	record->time = _time;
+	record->len = rh.len;
+	return 0;
+}
+
+int CaptureReader::baudrate(void) {
+	return _baudrate;
+}
@@ -0,0 +1,120 @@
+/**
+ * @file capture.h
+-----------------------------------------------------------------------------
+ Capture files record the raw data received from a 1820 device, one
+ record per line (or frame) with a monotonic receive timestamp.
+ CaptureWriter writes a capture file, CaptureReader reads it back for
+ replay.
+
+ File format (host byte order):
+   header: char magic[8] "1820CAP1", uint32_t version, uint32_t baudrate,
+           int64_t start time (CLOCK_REALTIME, ns)
+   record: uint32_t time since previous record [us], uint16_t length,
+           uint8_t data[length]
+-----------------------------------------------------------------------------
+*/
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define CAPTURE_VERSION 1
+#define CAPTURE_DATA_MAX 4096		// maximum data length of one record
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+struct capture_record {
+	uint64_t time;					// us since first record
+	uint16_t len;
+	uint8_t data[CAPTURE_DATA_MAX];
+};
+
+/**********************
+ *      CLASS
+ **********************/
+
+class CaptureWriter {
+public:
+	CaptureWriter();
+	~CaptureWriter();
+
+	/**
+	 * Create capture file
+	 * @param fileName: name of the capture file
+	 * @param baudrate: baudrate of the captured device (information only)
+	 * @returns 0 on success, -1 on failure
+	 */
+	int open(const char *fileName, int baudrate);
+
+	/**
+	 * Close capture file
+	 */
+	void close(void);
+
+	/**
+	 * Write one record
+	 * @param rxTime: monotonic receive time
+	 * @param data: received data
+	 * @param len: length of data, longer records are truncated
+	 * @returns 0 on success, -1 on failure
+	 */
+	int write(const struct timespec *rxTime, const void *data, unsigned int len);
+
+	/**
+	 * @returns number of records written
+	 */
+	unsigned long records(void);
+
+private:
+	FILE *_file;
+	struct timespec _lastTime;
+	unsigned long _records;
+};
+
+class CaptureReader {
+public:
+	CaptureReader();
+	~CaptureReader();
+
+	/**
+	 * Open capture file
+	 * @param fileName: name of the capture file
+	 * @returns 0 on success, -1 on failure
+	 */
+	int open(const char *fileName);
+
+	/**
+	 * Close capture file
+	 */
+	void close(void);
+
+	/**
+	 * Read next record
+	 * @param record: storage for the record
+	 * @returns 0 on success, -1 on end of file or failure
+	 */
+	int next(capture_record *record);
+
+	/**
+	 * @returns baudrate of the captured device
+	 */
+	int baudrate(void);
+
+private:
+	FILE *_file;
+	uint64_t _time;
+	int _baudrate;
+};
+
+#endif /* _CAPTURE_H_ */
@@ -0,0 +1,163 @@
+/**
+ * @file decoder.cpp
+ *
+ * https://github.com/helioz2000/1820bridge
+ *
+ * Author: Erwin Bejsta
+ * August 2020
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include "decoder.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*********************
+ * GLOBAL FUNCTIONS
+ *********************/
+
+/**
+ * parse one line of temperature data ("T<channel> <value>")
+ * This parser does not allocate memory and does not depend on the locale
+ * @param line: the line without LF termination
+ * @param len: length of the line
+ * @param channel: pointer to the channel number
+ * @param value: pointer to the value
+ * @returns: DEV1820_OK, DEV1820_NOTEMP or DEV1820_INVALID
+ */
+static int parse_temp_line(const char *line, int len, int *channel, float *value) {
+	const char *p = line, *end = line + len;
+	int ch = 0, digits = 0;
+	bool negative = false;
+	int32_t mantissa = 0;
+	int32_t divisor = 1;
+
+	// ignore trailing CR and white space
+	while ((end > p) && ((end[-1] == '\r') || (end[-1] == ' ') || (end[-1] == '\t')))
+		end--;
+	// temp data always starts with T
+	if ((p >= end) || (*p != 'T')) return DEV1820_NOTEMP;
+	p++;
+	// channel number
+	while ((p < end) && (*p >= '0') && (*p <= '9')) {
+		if (++digits > 6) return DEV1820_INVALID;
+		ch = (ch * 10) + (*p++ - '0');
+	}
+	if (digits == 0) return DEV1820_INVALID;
+	// separator
+	if ((p >= end) || ((*p != ' ') && (*p != '\t'))) return DEV1820_INVALID;
+	while ((p < end) && ((*p == ' ') || (*p == '\t'))) p++;
+	// value: [sign]digits[.digits]
+	if ((p < end) && ((*p == '-') || (*p == '+'))) {
+		negative = (*p == '-');
+		p++;
+	}
+	digits = 0;
+	while ((p < end) && (*p >= '0') && (*p <= '9')) {
+		if (++digits > 8) return DEV1820_INVALID;
+		mantissa = (mantissa * 10) + (*p++ - '0');
+	}
+	if ((p < end) && (*p == '.')) {
+		p++;
+		while ((p < end) && (*p >= '0') && (*p <= '9')) {
+			if (++digits > 8) return DEV1820_INVALID;
+			mantissa = (mantissa * 10) + (*p++ - '0');
+			divisor *= 10;
+		}
+	}
+	if ((digits == 0) || (p != end)) return DEV1820_INVALID;
+	*channel = ch;
+	*value = (float)mantissa / (float)divisor;
+	if (negative) *value = -*value;
+	return DEV1820_OK;
+}
+
+Decoder1820* decoder_create(const char *name) {
+	if (strcmp(name, "text") == 0) return new DecoderText();
+	if (strcmp(name, "binary") == 0) return new DecoderBinary();
+	return NULL;
+}
+
+uint8_t decoder_crc8(uint8_t crc, const uint8_t *data, unsigned int len) {
+	static uint8_t table[256];
+	static bool tableValid = false;
+	unsigned int i, bit;
+	uint8_t c;
+
+	if (!tableValid) {
+		for (i = 0; i < 256; i++) {
+			c = (uint8_t)i;
+			for (bit = 0; bit < 8; bit++)
+				c = (c & 0x01) ? ((c >> 1) ^ 0x8C) : (c >> 1);	// 0x31 reflected
+			table[i] = c;
+		}
+		tableValid = true;
+	}
+	for (i = 0; i < len; i++)
+		crc = table[crc ^ data[i]];
+	return crc;
+}
+
+/*********************
+ * MEMBER FUNCTIONS
+ *********************/
+
+#pragma mark DecoderText
+
+int DecoderText::decode(RingBuffer *buf, dev1820_sample *samples, int *count, unsigned int *frameLen) {
+	char line[DEV1820_LINE_MAX];
+	int result, len = buf->find(0x0A);
+
+	*count = 0;
+	if (len < 0) {
+		*frameLen = 0;
+		return DEV1820_NODATA;
+	}
+	*frameLen = len + 1;		// including LF
+	if (len >= DEV1820_LINE_MAX) return DEV1820_INVALID;
+	buf->copy(line, len);
+	result = parse_temp_line(line, len, &samples[0].channel, &samples[0].value);
+	if (result == DEV1820_OK) *count = 1;
+	return result;
+}
+
+#pragma mark DecoderBinary
+
+int DecoderBinary::decode(RingBuffer *buf, dev1820_sample *samples, int *count, unsigned int *frameLen) {
+	uint8_t frame[DECODER_BIN_PAYLOAD_MAX + 3];
+	unsigned int len, i;
+	int sync;
+
+	*count = 0;
+	*frameLen = 0;
+	if (buf->used() == 0) return DEV1820_NODATA;
+	// skip anything up to the next sync byte
+	if (buf->peek(0) != DECODER_BIN_SYNC) {
+		sync = buf->find(DECODER_BIN_SYNC);
+		*frameLen = (sync < 0) ? buf->used() : sync;
+		return DEV1820_NOTEMP;
+	}
+	if (buf->used() < 2) return DEV1820_NODATA;
+	len = buf->peek(1);
+	if ((len == 0) || (len > DECODER_BIN_PAYLOAD_MAX) || ((len % DECODER_BIN_READING) != 0)) {
+		*frameLen = 1;		// not a frame, resync after this sync byte
+		return DEV1820_INVALID;
+	}
+	if (buf->used() < (len + 3)) return DEV1820_NODATA;
+	buf->copy(frame, len + 3);
+	if (decoder_crc8(0, &frame[1], len + 1) != frame[len + 2]) {
+		*frameLen = 1;
+		return DEV1820_INVALID;
+	}
+	for (i = 0; i < len; i += DECODER_BIN_READING) {
+		samples[*count].channel = frame[i + 2] | (frame[i + 3] << 8);
+		samples[*count].value = (float)(int16_t)(frame[i + 4] | (frame[i + 5] << 8)) / 16.0f;
+		(*count)++;
+	}
+	*frameLen = len + 3;
+	return DEV1820_OK;
+}
@@ -0,0 +1,94 @@
+/**
+ * @file decoder.h
+-----------------------------------------------------------------------------
+ Decoders extract temperature samples from the data received from a 1820
+ device. The decoder is selected per interface, all decoders work on the
+ receive ring buffer and handle frames split across any number of reads.
+
+ "text": one line per sample, "T<channel> <value>" terminated by LF,
+ anything else (e.g. the startup banner) is reported as non temperature
+ data.
+
+ "binary": frames of the form
+   uint8_t  sync 0xA5
+   uint8_t  length of the payload [4..252], a multiple of 4
+   payload: 1..63 readings of
+     uint16_t channel (little endian)
+     int16_t  raw temperature in 1/16 degC (little endian, DS18B20 format)
+   uint8_t  CRC8 (Dallas/Maxim, polynomial 0x31) over length and payload
+ Bytes outside of a frame (e.g. a text startup banner) are skipped.
+-----------------------------------------------------------------------------
+*/
+
+#ifndef _DECODER_H_
+#define _DECODER_H_
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+
+#include "ringbuf.h"
+#include "dev1820.h"
+
+/*********************
+ *      DEFINES
+ *********************/
+#define DECODER_BIN_SYNC 0xA5
+#define DECODER_BIN_READING 4		// bytes per reading in a binary frame
+#define DECODER_BIN_PAYLOAD_MAX 252	// maximum payload length of a binary frame
+
+/**********************
+ *      CLASS
+ **********************/
+
+class Decoder1820 {
+public:
+	virtual ~Decoder1820() {}
+
+	/**
+	 * Decode the frame at the start of the receive buffer
+	 * The buffer is not modified, the caller removes frameLen bytes
+	 * @param buf: the receive buffer
+	 * @param samples: receives channel and value of each sample in the frame
+	 * (at least DEV1820_FRAME_SAMPLES entries)
+	 * @param count: receives the number of samples
+	 * @param frameLen: receives the number of bytes to remove from the buffer,
+	 * 0 for DEV1820_NODATA
+	 * @returns DEV1820_OK, DEV1820_NOTEMP, DEV1820_INVALID or DEV1820_NODATA
+	 * if the buffer doesn't hold a complete frame
+	 */
+	virtual int decode(RingBuffer *buf, dev1820_sample *samples, int *count, unsigned int *frameLen) = 0;
+
+	/**
+	 * @returns the name of the decoder as used in the configuration
+	 */
+	virtual const char* name() = 0;
+};
+
+class DecoderText : public Decoder1820 {
+public:
+	int decode(RingBuffer *buf, dev1820_sample *samples, int *count, unsigned int *frameLen);
+	const char* name() { return "text"; }
+};
+
+class DecoderBinary : public Decoder1820 {
+public:
+	int decode(RingBuffer *buf, dev1820_sample *samples, int *count, unsigned int *frameLen);
+	const char* name() { return "binary"; }
+};
+
+/**
+ * Create a decoder
+ * @param name: "text" or "binary"
+ * @returns the new decoder or NULL if the name is unknown
+ */
+Decoder1820* decoder_create(const char *name);
+
+/**
+ * Dallas/Maxim CRC8 as used by the binary frame
+ * @param crc: initial value, 0 for a new frame
+ */
+uint8_t decoder_crc8(uint8_t crc, const uint8_t *data, unsigned int len);
+
+#endif /* _DECODER_H_ */
@@ -12,6 +12,8 @@
  *********************/
 
 #include "dev1820.h"
+#include "ttybaud.h"
+#include "decoder.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -25,6 +27,7 @@
 #include <sys/file.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include <string>
@@ -47,18 +50,43 @@ Dev1820::Dev1820() {
 	throw runtime_error("Class Dev1820 - forbidden constructor");
 }
 
-Dev1820::Dev1820(const char* ttyDeviceStr, int baud) {
+/**
+ * Constructor
+ * @param ttyDeviceStr: serial device
+ * @param baud: baudrate in bits per second
+ */
+Dev1820::Dev1820(const char* ttyDeviceStr, int baud) : _rxBuf(DEV1820_RXBUF_SIZE) {
 	if (ttyDeviceStr == NULL) {
 		throw invalid_argument("Class Dev1820 - ttyDeviceStr is NULL");
 	}
 	this->_ttyDevice = ttyDeviceStr;
 	this->_ttyBaud = baud;
 	this->_ttyFd = -1;
+	this->_ttyVmin = 1;
+	this->_ttyVtime = 0;
+	this->_rxDrained = false;
+	this->_decoder = new DecoderText();
+	this->_frameCount = 0;
+	this->_frameIndex = 0;
+	this->_rxTime.tv_sec = 0;
+	this->_rxTime.tv_nsec = 0;
+	this->_rxRealTime = this->_rxTime;
+	this->_capture = NULL;
+	this->_replay = false;
+	this->_replaySpeed = 1.0;
+	this->_replayLoop = false;
+	this->_replayComplete = false;
+	this->_replayReader = NULL;
+	this->_replayRecord = NULL;
+	this->_replayPending = false;
+	this->_replayOffset = 0;
+	memset(&this->_stats, 0, sizeof(this->_stats));
 }
 
 Dev1820::~Dev1820() {
 	//fprintf(stderr, "%s\n", __func__);
 	_tty_close();
+	delete this->_decoder;
 }
 
 /**
@@ -77,18 +105,178 @@ int Dev1820::readSingle(int *channel, float *value) {
 			return -1;			// failed to open
 	}
 
-tryAgain:
-	result = _tty_read(channel, value);
-	if (result == 0) return 0;
-	if (result == -2) goto tryAgain;
+	do {
+		result = _rx_frame(channel, value);
+		if (result == DEV1820_OK) return 0;
+		// wait for more data if no complete line is buffered
+		if (result == DEV1820_NODATA) {
+			if (_tty_read() < 0) break;
+		}
+	} while (true);
 
-	// should never get here
 	_tty_close();
 	return -1;
 }
 
+/**
+ * read one temperature value which is already waiting in the input queue
+ * To be used when the caller waits for input (e.g. via epoll) on fd()
+ * All available bytes are read into the receive buffer with one read
+ * call, subsequent calls return the buffered lines until the buffer and
+ * the input queue are empty.
+ * @param value: pointer to read value
+ * @param channel: pointer to the channel number
+ * @returns: DEV1820_OK, DEV1820_NOTEMP, DEV1820_INVALID, DEV1820_NODATA
+ * or DEV1820_ERROR
+ */
+int Dev1820::readPending(int *channel, float *value) {
+	int result;
+	if (this->_ttyFd < 0) return DEV1820_ERROR;
+	do {
+		result = _rx_frame(channel, value);
+		if (result != DEV1820_NODATA) return result;
+		// don't read again if the input queue was emptied by the last read
+		if (_rxDrained) {
+			_rxDrained = false;
+			return DEV1820_NODATA;
+		}
+		result = _rx_fill();
+	} while (result == DEV1820_OK);
+	return result;
+}
+
+/**
+ * read all temperature values which are waiting in the input queue
+ * To be used when the caller waits for input (e.g. via epoll) on fd()
+ * Non temperature and malformed lines are skipped.
+ * @param samples: array to receive the samples
+ * @param maxSamples: size of the samples array
+ * @returns: number of samples, 0 if no more data is available, or
+ * DEV1820_ERROR. If the array was filled more samples may be pending.
+ */
+int Dev1820::readBatch(dev1820_sample *samples, int maxSamples) {
+	int count = 0, result;
+	while (count < maxSamples) {
+		result = readPending(&samples[count].channel, &samples[count].value);
+		if (result == DEV1820_OK) {
+			samples[count].rxTime = this->_rxTime;
+			samples[count].rxRealTime = this->_rxRealTime;
+			count++;
+		} else if (result == DEV1820_NODATA) {
+			break;
+		} else if (result == DEV1820_ERROR) {
+			// the error is reported again by the next call
+			if (count > 0) break;
+			return DEV1820_ERROR;
+		}
+	}
+	return count;
+}
+
+/**
+ * open the serial device
+ * @returns 0 if successful, -1 on failure or if the replay is complete
+ */
+int Dev1820::openDevice() {
+	if (this->_ttyFd >= 0) return 0;
+	if (this->_replayComplete) return -1;
+	return _tty_open();
+}
+
+void Dev1820::closeDevice() {
+	_tty_close();
+}
+
+bool Dev1820::isOpen() {
+	return (this->_ttyFd >= 0);
+}
+
+bool Dev1820::isReplay() {
+	return this->_replay;
+}
+
+/**
+ * @returns true if the end of a replay which doesn't loop has been reached
+ */
+bool Dev1820::replayComplete() {
+	return this->_replayComplete;
+}
+
+int Dev1820::fd() {
+	return this->_ttyFd;
+}
+
+const char* Dev1820::device() {
+	return this->_ttyDevice.c_str();
+}
+
+/**
+ * set the termios VMIN and VTIME values, used on next open
+ * VMIN > 1 (with VTIME 0) defers input notification until VMIN bytes
+ * have been received, which reduces wakeups at high data rates
+ * @param vmin: minimum number of bytes [0..255]
+ * @param vtime: inter-character timeout in 1/10s [0..255]
+ * @returns 0 if successful, -1 for invalid values
+ */
+int Dev1820::setReadTiming(int vmin, int vtime) {
+	if ((vmin < 0) || (vmin > 255) || (vtime < 0) || (vtime > 255))
+		return -1;
+	this->_ttyVmin = vmin;
+	this->_ttyVtime = vtime;
+	return 0;
+}
+
+/**
+ * select the decoder for the received data, used on next open
+ * @param name: "text" (default) or "binary"
+ * @returns 0 if successful, -1 for an unknown decoder
+ */
+int Dev1820::setDecoder(const char *name) {
+	Decoder1820 *decoder = decoder_create(name);
+	if (decoder == NULL) return -1;
+	delete this->_decoder;
+	this->_decoder = decoder;
+	return 0;
+}
+
+const char* Dev1820::decoderName() {
+	return this->_decoder->name();
+}
+
+/**
+ * get receive statistics since the object was created
+ */
+void Dev1820::getStats(dev1820_stats *stats) {
+	*stats = this->_stats;
+}
+
+/**
+ * capture all received lines including non temperature data
+ * @param capture: open capture file or NULL to stop capturing
+ */
+void Dev1820::setCapture(CaptureWriter *capture) {
+	this->_capture = capture;
+}
+
+/**
+ * replay a capture file instead of reading from the serial device
+ * the device name is used as the name of the capture file, at the
+ * end of the file the device reports an error. With loop it can be
+ * re-opened to start the replay again, otherwise it stays closed (see
+ * replayComplete()). Must be called before the device is opened.
+ * @param speed: 1.0 = real time, 2.0 = twice as fast,
+ * 0 = as fast as possible
+ * @param loop: true to allow the replay to be restarted
+ */
+void Dev1820::setReplay(double speed, bool loop) {
+	this->_replay = true;
+	this->_replaySpeed = (speed > 0) ? speed : 0;
+	this->_replayLoop = loop;
+}
+
 int Dev1820::_tty_open() {
-	this->_ttyFd = open(this->_ttyDevice.c_str(), O_RDONLY | O_NOCTTY | O_SYNC);
+	if (this->_replay) return _replay_open();
+	this->_ttyFd = open(this->_ttyDevice.c_str(), O_RDONLY | O_NOCTTY | O_SYNC | O_NONBLOCK);
 	if (_ttyFd < 0) {
 		printf("%s: Error opening %s: %s\n", __func__, this->_ttyDevice.c_str(), strerror(errno));
 		return -1;
@@ -106,6 +294,9 @@ int Dev1820::_tty_open() {
 
 	// flush input queue
 	tcflush(this->_ttyFd, TCIFLUSH);
+	_rxBuf.clear();
+	_rxDrained = false;
+	_frameCount = 0;
 	//set_mincount(_tty_Fd, 0);                /* set to pure timed read */
 
 	//printf("%s: OK\n", __func__);
@@ -115,6 +306,14 @@ int Dev1820::_tty_open() {
 void Dev1820::_tty_close(bool ignoreLock) {
 	if (this->_ttyFd < 0)
 		return;
+	if (this->_replay) {
+		delete this->_replayReader;
+		delete this->_replayRecord;
+		this->_replayReader = NULL;
+		this->_replayRecord = NULL;
+		this->_replayPending = false;
+		ignoreLock = true;
+	}
 	if (!ignoreLock) {
 		if (flock(_ttyFd, LOCK_UN) != 0) {	// remove file lock
 			printf("%s: flock failed [%s]\n", __func__, strerror(errno));
@@ -137,10 +336,6 @@ int Dev1820::_tty_set_attribs(int fd, int speed)
         return -1;
     }
 
-	// set baudrate
-    cfsetospeed(&tty, (speed_t)speed);
-    cfsetispeed(&tty, (speed_t)speed);
-
 	// set port control flags
     tty.c_cflag |= (CLOCAL | CREAD);    /* ignore modem controls */
     tty.c_cflag &= ~CSIZE;
@@ -149,61 +344,45 @@ int Dev1820::_tty_set_attribs(int fd, int speed)
     tty.c_cflag &= ~CSTOPB;     /* only need 1 stop bit */
     tty.c_cflag &= ~CRTSCTS;    /* no hardware flowcontrol */
 
-    // setup for non-canonical mode
-/*	tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
-    tty.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
-    tty.c_oflag &= ~OPOST;
-	tty.c_cc[VMIN] = 1;		// maximum number of bytes (more than we need)
-	tty.c_cc[VTIME] = 0;		// intercharcter timeout in 1/10 sec
-*/
-
-	// setup for canonical (line based) mode
-	tty.c_lflag |= ICANON | ISIG;  /* canonical input */
-	tty.c_lflag &= ~(ECHO | ECHOE | ECHONL | IEXTEN);	// No echo
-
-	tty.c_iflag &= ~IGNCR;  // preserve carriage return /
+    // setup for non-canonical (raw) mode, data is framed by _rx_frame()
+	tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IUCLC | IMAXBEL);
 	tty.c_iflag &= ~INPCK;	// diable parity checking
-	tty.c_iflag &= ~(INLCR | ICRNL | IUCLC | IMAXBEL); // no translation
-	tty.c_iflag &= ~(IXON | IXOFF | IXANY);	// no SW flowcontrol /
-
-    tty.c_oflag &= ~OPOST;	// diable impementation define processing
-
-    tty.c_cc[VEOL] = 0;		// additional EOL character
-    tty.c_cc[VEOL2] = 0;	// additional EOL character
-    tty.c_cc[VEOF] = 0x04;	// End of File character
-
+	tty.c_iflag &= ~(IXON | IXOFF | IXANY);	// no SW flowcontrol
+	tty.c_lflag &= ~(ECHO | ECHOE | ECHONL | ICANON | ISIG | IEXTEN);
+	tty.c_oflag &= ~OPOST;	// diable impementation define processing
+	tty.c_cc[VMIN] = this->_ttyVmin;	// minimum number of bytes for input notification
+	tty.c_cc[VTIME] = this->_ttyVtime;	// intercharacter timeout in 1/10 sec
 
     if (tcsetattr(fd, TCSANOW, &tty) != 0) {
         printf("%s: Error from tcsetattr: %s\n", __func__, strerror(errno));
         return -1;
     }
+
+	// set baudrate, termios2 allows for rates without a Bxxx constant
+	if (tty_set_baudrate(fd, speed) < 0) {
+		printf("%s: baudrate %d not supported by %s: %s\n", __func__, speed, this->_ttyDevice.c_str(), strerror(errno));
+		return -1;
+	}
+	// the driver may substitute the nearest rate it can generate
+	int actual = tty_get_baudrate(fd);
+	if ((actual <= 0) || (abs(actual - speed) > (speed * TTY_BAUD_TOLERANCE / 100))) {
+		printf("%s: baudrate %d not supported by %s (actual %d)\n", __func__, speed, this->_ttyDevice.c_str(), actual);
+		return -1;
+	}
     return 0;
 }
 
 /**
- * read one channel from the device
- * @param value: pointer to read value
- * @param channel: pointer to the channel number
- * @returns: zero on success, -1 on failure, -2 for non temp data
- * Note: the device will send startup data which causes a return
- * value of -2.
+ * wait for data from the device and read it into the receive buffer
+ * @returns: zero on success, -1 on failure
  */
-int Dev1820::_tty_read(int *channel, float *value) {
-	int rxlen = 0;
-	int rdlen, result;
-	char buf[65];
+int Dev1820::_tty_read() {
 	int timeout = TTY_TIMEOUT;
 
 	fd_set rfds;
 	struct timeval tv;
 	int select_result;
 
-	FD_ZERO(&rfds);
-	FD_SET(this->_ttyFd, &rfds);
-
-	tv.tv_sec = 16;
-	tv.tv_usec = 0;
-
 	// break the total timout into 1s chunks
 	// and respond to exitSignal
 	do {
@@ -229,33 +408,191 @@ int Dev1820::_tty_read(int *channel, float *value) {
 		return -1;
 	}
 
-	// read will return after a LF terminated line was received
-	rdlen = read(this->_ttyFd, buf, sizeof(buf) - 1);
+	if (_rx_fill() == DEV1820_ERROR) return -1;
+	return 0;
+}
+
+/**
+ * read all bytes available from the device into the receive buffer
+ * @returns: DEV1820_OK if data was read, DEV1820_NODATA or DEV1820_ERROR
+ */
+int Dev1820::_rx_fill() {
+	unsigned int space = _rxBuf.space();
+	int rdlen;
+
+	if (this->_replay) return _replay_fill();
+	rdlen = _rxBuf.fill(this->_ttyFd);
 	if (rdlen > 0) {
-		// mark end of string
-		if (buf[rdlen-1] == 0x0A) { // this should be true at all times 
-			buf[rdlen-1] = 0;
-		} else {
-			buf[rdlen] = 0;
-		}
-		//printf("%s: %d bytes: %s\n", __func__, rdlen, buf);
-		//printf("%s\n", buf);
-		// temp data always starts with T
-		if (buf[0] == 'T') {
-			result = sscanf(buf, "T%d %f", channel, value);
-			if (result != 2) {
-				fprintf(stderr, "%s: sscanf error %d <%s>\n", __func__, result, buf);
-				return -1;
-			}
-		} else {
-			return -2;
-		}
-	} else if (rdlen < 0) {
+		clock_gettime(CLOCK_MONOTONIC, &this->_rxTime);
+		clock_gettime(CLOCK_REALTIME, &this->_rxRealTime);
+		this->_stats.bytes += rdlen;
+		// a short read means the input queue is empty
+		_rxDrained = ((unsigned int)rdlen < space);
+		return DEV1820_OK;
+	}
+	if (rdlen < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return DEV1820_NODATA;
 		fprintf(stderr, "%s: Error from read: %d: %s\n", __func__, rdlen, strerror(errno));
+		return DEV1820_ERROR;
+	}
+	// rdlen == 0: a full buffer is handled by _rx_frame()
+	if (space == 0) return DEV1820_OK;
+	fprintf(stderr, "%s: End of file from read\n", __func__);
+	return DEV1820_ERROR;
+}
+
+/**
+ * get the next sample from the receive buffer
+ * a frame may hold several samples which are returned one per call,
+ * a partial frame remains in the buffer until the rest is received
+ * @param value: pointer to read value
+ * @param channel: pointer to the channel number
+ * @returns: DEV1820_OK, DEV1820_NOTEMP, DEV1820_INVALID or DEV1820_NODATA
+ * Note: the device will send startup data which causes a return
+ * value of DEV1820_NOTEMP.
+ */
+int Dev1820::_rx_frame(int *channel, float *value) {
+	unsigned int len;
+	int result;
+
+	if (_frameIndex < _frameCount) {
+		*channel = _frame[_frameIndex].channel;
+		*value = _frame[_frameIndex].value;
+		_frameIndex++;
+		return DEV1820_OK;
+	}
+	result = this->_decoder->decode(&_rxBuf, _frame, &_frameCount, &len);
+	if (result == DEV1820_NODATA) {
+		// discard data if the buffer is full without a complete frame
+		if (_rxBuf.space() == 0) {
+			fprintf(stderr, "%s: receive buffer overflow on %s\n", __func__, this->_ttyDevice.c_str());
+			if (this->_capture != NULL) _rx_capture(_rxBuf.used());
+			_rxBuf.clear();
+			this->_stats.invalid++;
+			return DEV1820_INVALID;
+		}
+		return DEV1820_NODATA;
+	}
+	if (this->_capture != NULL) _rx_capture(len);
+	_rxBuf.consume(len);
+	this->_stats.lines++;
+	if (result == DEV1820_INVALID) this->_stats.invalid++;
+	if (result != DEV1820_OK) {
+		_frameCount = 0;
+		return result;
+	}
+	this->_stats.samples += _frameCount;
+	*channel = _frame[0].channel;
+	*value = _frame[0].value;
+	_frameIndex = 1;
+	return DEV1820_OK;
+}
+
+/**
+ * write received data to the capture file
+ * @param len: number of bytes at the start of the receive buffer
+ */
+void Dev1820::_rx_capture(unsigned int len) {
+	uint8_t data[CAPTURE_DATA_MAX];
+	len = _rxBuf.copy(data, (len > CAPTURE_DATA_MAX) ? CAPTURE_DATA_MAX : len);
+	if (this->_capture->write(&this->_rxTime, data, len) < 0) {
+		this->_capture = NULL;		// stop capturing after a write error
+	}
+}
+
+/**
+ * open capture file for replay
+ * a timerfd takes the place of the serial device file descriptor
+ * @returns 0 if successful, -1 on failure
+ */
+int Dev1820::_replay_open() {
+	this->_replayReader = new CaptureReader();
+	this->_replayRecord = new capture_record;
+	if (this->_replayReader->open(this->_ttyDevice.c_str()) < 0) {
+		delete this->_replayReader;
+		delete this->_replayRecord;
+		this->_replayReader = NULL;
+		this->_replayRecord = NULL;
 		return -1;
-	} else {  /* rdlen == 0 */
-		fprintf(stderr, "%s: Timeout from read\n", __func__);
+	}
+	this->_ttyFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (this->_ttyFd < 0) {
+		printf("%s: Error creating timer: %s\n", __func__, strerror(errno));
+		delete this->_replayReader;
+		delete this->_replayRecord;
+		this->_replayReader = NULL;
+		this->_replayRecord = NULL;
 		return -1;
 	}
+	this->_replayPending = (this->_replayReader->next(this->_replayRecord) == 0);
+	this->_replayOffset = 0;
+	clock_gettime(CLOCK_MONOTONIC, &this->_replayStart);
+	_rxBuf.clear();
+	_rxDrained = false;
+	_frameCount = 0;
+	_replay_arm();
 	return 0;
 }
+
+/**
+ * copy all capture records which are due into the receive buffer
+ * @returns: DEV1820_OK if data was copied, DEV1820_NODATA or DEV1820_ERROR
+ * at the end of the capture file
+ */
+int Dev1820::_replay_fill() {
+	uint64_t expirations;
+	struct timespec now;
+	int64_t elapsed;		// replay time [us]
+	unsigned int len;
+	int count = 0;
+
+	if (read(this->_ttyFd, &expirations, sizeof(expirations)) < 0) {
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) return DEV1820_ERROR;
+	}
+	if (!this->_replayPending) {
+		printf("%s: replay of %s complete\n", __func__, this->_ttyDevice.c_str());
+		if (!this->_replayLoop) this->_replayComplete = true;
+		return DEV1820_ERROR;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = ((int64_t)(now.tv_sec - this->_replayStart.tv_sec) * 1000000LL) + ((now.tv_nsec - this->_replayStart.tv_nsec) / 1000);
+	while (this->_replayPending) {
+		if ((this->_replaySpeed > 0) && (this->_replayRecord->time > (elapsed * this->_replaySpeed)))
+			break;
+		// a record which doesn't fit is copied in parts
+		len = _rxBuf.write(&this->_replayRecord->data[this->_replayOffset], this->_replayRecord->len - this->_replayOffset);
+		this->_stats.bytes += len;
+		if (len > 0) count++;
+		this->_replayOffset += len;
+		if (this->_replayOffset < this->_replayRecord->len)
+			break;		// continue once the buffer has been parsed
+		this->_replayOffset = 0;
+		this->_replayPending = (this->_replayReader->next(this->_replayRecord) == 0);
+	}
+	this->_rxTime = now;
+	clock_gettime(CLOCK_REALTIME, &this->_rxRealTime);
+	_rxDrained = true;		// return to the caller's poll loop after each batch
+	_replay_arm();
+	return (count > 0) ? DEV1820_OK : DEV1820_NODATA;
+}
+
+/**
+ * arm the replay timer for the next due record
+ */
+void Dev1820::_replay_arm() {
+	struct itimerspec its;
+	int64_t due;
+	int flags = 0;
+
+	memset(&its, 0, sizeof(its));
+	if ((this->_replaySpeed > 0) && this->_replayPending) {
+		due = (int64_t)((double)this->_replayRecord->time * 1000.0 / this->_replaySpeed);	// ns
+		due += this->_replayStart.tv_nsec;
+		its.it_value.tv_sec = this->_replayStart.tv_sec + (due / 1000000000LL);
+		its.it_value.tv_nsec = due % 1000000000LL;
+		flags = TFD_TIMER_ABSTIME;
+	} else {
+		its.it_value.tv_nsec = 1;		// immediately
+	}
+	timerfd_settime(this->_ttyFd, flags, &its, NULL);
+}
@@ -14,36 +14,108 @@ DS18B20 reader built by Ross Wheeler.
  *********************/
 #include <stdint.h>
 #include <termios.h>
+#include <time.h>
 #include <string>
 
+#include "ringbuf.h"
+#include "capture.h"
+
 /*********************
  *      DEFINES
  *********************/
+// return values of the read functions
+#define DEV1820_OK 0			// temperature value received
+#define DEV1820_ERROR -1		// read failure, device should be closed
+#define DEV1820_NOTEMP -2		// non temperature data (e.g. startup banner)
+#define DEV1820_NODATA -3		// no more data available (would block)
+#define DEV1820_INVALID -4		// malformed temperature data
+
+#define DEV1820_RXBUF_SIZE 4096	// receive ring buffer size (power of 2)
+#define DEV1820_LINE_MAX 64		// maximum length of one line
+#define DEV1820_FRAME_SAMPLES 64	// maximum number of samples in one frame
 
 /**********************
  *      TYPEDEFS
  **********************/
 
+struct dev1820_stats {
+	unsigned long long bytes;		// bytes received
+	unsigned long long lines;		// lines or frames received
+	unsigned long long samples;		// valid temperature values
+	unsigned long long invalid;		// malformed lines and discarded data
+};
+
+struct dev1820_sample {
+	int channel;
+	float value;
+	struct timespec rxTime;		// time the sample was received (CLOCK_MONOTONIC)
+	struct timespec rxRealTime;	// time the sample was received (CLOCK_REALTIME)
+};
+
 /**********************
  *      CLASS
  **********************/
 
+class Decoder1820;
+
 class Dev1820 {
 public:
 	Dev1820();		// empty constructor throws error
 	Dev1820(const char* ttyDeviceStr, int baud);
 	~Dev1820();
 	int readSingle(int *channel, float *value);
+	int readPending(int *channel, float *value);
+	int readBatch(dev1820_sample *samples, int maxSamples);
+	int openDevice();
+	void closeDevice();
+	bool isOpen();
+	bool isReplay();
+	bool replayComplete();
+	int fd();
+	const char* device();
+	int setReadTiming(int vmin, int vtime);
+	void setCapture(CaptureWriter *capture);
+	void setReplay(double speed, bool loop = false);
+	int setDecoder(const char *name);
+	const char* decoderName();
+	void getStats(dev1820_stats *stats);
 
 private:
 	int _tty_open();
 	void _tty_close(bool ignoreLock = false);
 	int _tty_set_attribs(int fd, int speed);
-	int _tty_read(int *channel, float *value);
+	int _tty_read();
+	int _rx_fill();
+	int _rx_frame(int *channel, float *value);
+	void _rx_capture(unsigned int len);
+	int _replay_open();
+	int _replay_fill();
+	void _replay_arm();
 
 	std::string _ttyDevice;
-	int _ttyBaud;
+	int _ttyBaud;			// bits per second
 	int _ttyFd;
+	int _ttyVmin;			// termios VMIN
+	int _ttyVtime;			// termios VTIME [1/10s]
+	RingBuffer _rxBuf;		// received bytes not yet parsed
+	Decoder1820 *_decoder;	// frames received data into samples
+	dev1820_sample _frame[DEV1820_FRAME_SAMPLES];	// samples of the last frame
+	int _frameCount;		// number of samples in _frame
+	int _frameIndex;		// next sample in _frame to return
+	bool _rxDrained;		// input queue was emptied by last _rx_fill()
+	struct timespec _rxTime;	// monotonic time of last _rx_fill()
+	struct timespec _rxRealTime;	// wall clock time of last _rx_fill()
+	CaptureWriter *_capture;	// capture received data if not NULL
+	bool _replay;			// _ttyDevice is a capture file to replay
+	double _replaySpeed;	// replay speed factor, 0 = as fast as possible
+	bool _replayLoop;		// the replay can be re-opened at the end of the file
+	bool _replayComplete;	// the end of the file was reached, the device can't be re-opened
+	struct timespec _replayStart;
+	CaptureReader *_replayReader;
+	capture_record *_replayRecord;	// next record to replay
+	bool _replayPending;	// _replayRecord is valid
+	unsigned int _replayOffset;	// bytes of _replayRecord already replayed
+	dev1820_stats _stats;
 };
 
 #endif /* _DEV1820_H_ */
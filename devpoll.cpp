@@ -0,0 +1,284 @@
+/**
+ * @file devpoll.cpp
+ *
+ * https://github.com/helioz2000/1820bridge
+ *
+ * Author: Erwin Bejsta
+ * August 2020
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include "devpoll.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+/*********************
+ *      DEFINES
+ *********************/
+#define DEVPOLL_WAKEUP_ID 0xFFFFFFFF	// epoll data for the wakeup eventfd
+#define DEVPOLL_INOTIFY_ID 0xFFFFFFFE	// epoll data for the inotify fd
+#define DEVPOLL_WATCH_MASK (IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO)
+
+/*********************
+ * MEMBER FUNCTIONS
+ *********************/
+
+DevPoll::DevPoll() {
+	struct epoll_event ev;
+
+	_deviceCount = 0;
+	_epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (_epollFd < 0) {
+		throw runtime_error("Class DevPoll - epoll_create1 failed");
+	}
+	_wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_wakeupFd < 0) {
+		close(_epollFd);
+		throw runtime_error("Class DevPoll - eventfd failed");
+	}
+	ev.events = EPOLLIN;
+	ev.data.u32 = DEVPOLL_WAKEUP_ID;
+	if (epoll_ctl(_epollFd, EPOLL_CTL_ADD, _wakeupFd, &ev) != 0) {
+		close(_wakeupFd);
+		close(_epollFd);
+		throw runtime_error("Class DevPoll - epoll_ctl failed");
+	}
+	// without inotify devices are re-opened by polling only
+	_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (_inotifyFd < 0) {
+		fprintf(stderr, "%s: inotify_init1 failed: %s\n", __func__, strerror(errno));
+	} else {
+		ev.events = EPOLLIN;
+		ev.data.u32 = DEVPOLL_INOTIFY_ID;
+		epoll_ctl(_epollFd, EPOLL_CTL_ADD, _inotifyFd, &ev);
+	}
+}
+
+DevPoll::~DevPoll() {
+	if (_inotifyFd >= 0) close(_inotifyFd);
+	close(_wakeupFd);
+	close(_epollFd);
+}
+
+int DevPoll::addDevice(Dev1820 *dev) {
+	string path;
+	size_t pos;
+
+	if ((dev == NULL) || (_deviceCount >= DEVPOLL_MAX_DEVICES))
+		return -1;
+	devpoll_entry *entry = &_devices[_deviceCount];
+	entry->dev = dev;
+	entry->lastRxTime = 0;
+	entry->nextOpenTime = 0;	// open on next wait()
+	entry->openInterval = DEVPOLL_REOPEN_MIN;
+	// split device path into directory and node name
+	path = dev->device();
+	pos = path.rfind('/');
+	if (pos == string::npos) {
+		entry->dir = ".";
+		entry->name = path;
+	} else {
+		entry->dir = (pos == 0) ? "/" : path.substr(0, pos);
+		entry->name = path.substr(pos + 1);
+	}
+	_add_watch(_deviceCount);
+	return _deviceCount++;
+}
+
+Dev1820* DevPoll::device(int index) {
+	if ((index < 0) || (index >= _deviceCount)) return NULL;
+	return _devices[index].dev;
+}
+
+int DevPoll::deviceCount(void) {
+	return _deviceCount;
+}
+
+int DevPoll::wait(int *ready, int maxReady, int timeoutMs) {
+	struct epoll_event events[DEVPOLL_MAX_DEVICES + 2];
+	int eventCount, readyCount = 0;
+	uint32_t index;
+	uint64_t counter;
+	int64_t now = _now();
+
+	_open_devices(now);
+	_check_timeouts(now);
+
+	eventCount = epoll_wait(_epollFd, events, DEVPOLL_MAX_DEVICES + 2, _wait_timeout(now, timeoutMs));
+	if (eventCount < 0) {
+		if (errno == EINTR) return 0;
+		fprintf(stderr, "%s: epoll_wait failed: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+
+	now = _now();
+	for (int i = 0; i < eventCount; i++) {
+		index = events[i].data.u32;
+		if (index == DEVPOLL_WAKEUP_ID) {
+			// reset eventfd counter
+			if (read(_wakeupFd, &counter, sizeof(counter)) < 0) {}
+			continue;
+		}
+		if (index == DEVPOLL_INOTIFY_ID) {
+			_read_inotify();
+			continue;
+		}
+		if (index >= (uint32_t)_deviceCount) continue;
+		if (events[i].events & EPOLLIN) {
+			// a read error following a hangup will close the device
+			_devices[index].lastRxTime = now;
+			if (readyCount < maxReady)
+				ready[readyCount++] = index;
+		} else if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+			fprintf(stderr, "%s: hangup on %s\n", __func__, _devices[index].dev->device());
+			closeDevice(index);
+		}
+	}
+	return readyCount;
+}
+
+void DevPoll::closeDevice(int index) {
+	if ((index < 0) || (index >= _deviceCount)) return;
+	Dev1820 *dev = _devices[index].dev;
+	if (dev->isOpen()) {
+		epoll_ctl(_epollFd, EPOLL_CTL_DEL, dev->fd(), NULL);
+		dev->closeDevice();
+	}
+	_devices[index].nextOpenTime = _now() + _devices[index].openInterval;
+}
+
+void DevPoll::wakeup(void) {
+	uint64_t counter = 1;
+	if (write(_wakeupFd, &counter, sizeof(counter)) < 0) {}
+}
+
+/*********************
+ * PRIVATE FUNCTIONS
+ *********************/
+
+/**
+ * open all devices which are closed and due for an open attempt
+ * a replay which has reached the end of its capture stays closed
+ * the interval between failed attempts doubles up to DEVPOLL_REOPEN_MAX
+ */
+void DevPoll::_open_devices(int64_t now) {
+	struct epoll_event ev;
+	for (int index = 0; index < _deviceCount; index++) {
+		devpoll_entry *entry = &_devices[index];
+		Dev1820 *dev = entry->dev;
+		if (dev->isOpen() || dev->replayComplete() || (now < entry->nextOpenTime)) continue;
+		// directory may have been removed and re-created (e.g. /dev/serial/by-id)
+		if (entry->watch < 0) _add_watch(index);
+		if (dev->openDevice() < 0) {
+			entry->nextOpenTime = now + entry->openInterval;
+			entry->openInterval *= 2;
+			if (entry->openInterval > DEVPOLL_REOPEN_MAX) entry->openInterval = DEVPOLL_REOPEN_MAX;
+			continue;
+		}
+		ev.events = EPOLLIN;
+		ev.data.u32 = index;
+		if (epoll_ctl(_epollFd, EPOLL_CTL_ADD, dev->fd(), &ev) != 0) {
+			fprintf(stderr, "%s: epoll_ctl failed for %s: %s\n", __func__, dev->device(), strerror(errno));
+			dev->closeDevice();
+			entry->nextOpenTime = now + DEVPOLL_REOPEN_MAX;
+			continue;
+		}
+		entry->lastRxTime = now;
+		entry->openInterval = DEVPOLL_REOPEN_MIN;
+	}
+}
+
+/**
+ * close devices which have not delivered any data for DEVPOLL_RX_TIMEOUT
+ * a replay is exempt, its data arrives when the next capture record is due
+ */
+void DevPoll::_check_timeouts(int64_t now) {
+	for (int index = 0; index < _deviceCount; index++) {
+		if (!_devices[index].dev->isOpen() || _devices[index].dev->isReplay()) continue;
+		if ((now - _devices[index].lastRxTime) < (DEVPOLL_RX_TIMEOUT * 1000)) continue;
+		fprintf(stderr, "%s: No data within timeout on %s\n", __func__, _devices[index].dev->device());
+		closeDevice(index);
+		_devices[index].nextOpenTime = now;		// re-open immediately
+	}
+}
+
+/**
+ * watch the directory of a device for the device node being added or removed
+ * devices in the same directory share one watch descriptor
+ */
+void DevPoll::_add_watch(int index) {
+	if (_inotifyFd < 0) return;
+	_devices[index].watch = inotify_add_watch(_inotifyFd, _devices[index].dir.c_str(), DEVPOLL_WATCH_MASK);
+}
+
+/**
+ * process inotify events for the device directories
+ */
+void DevPoll::_read_inotify(void) {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t len;
+	int64_t now = _now();
+
+	while ((len = read(_inotifyFd, buf, sizeof(buf))) > 0) {
+		for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *)ptr;
+			for (int index = 0; index < _deviceCount; index++) {
+				devpoll_entry *entry = &_devices[index];
+				if (entry->watch != event->wd) continue;
+				// directory was removed, fall back to polling
+				if (event->mask & IN_IGNORED) {
+					entry->watch = -1;
+					continue;
+				}
+				if ((event->len == 0) || (entry->name.compare(event->name) != 0)) continue;
+				if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+					if (entry->dev->isOpen()) {
+						fprintf(stderr, "%s: %s removed\n", __func__, entry->dev->device());
+						closeDevice(index);
+					}
+				} else if (!entry->dev->isOpen()) {
+					// device node (re-)appeared or its permissions changed
+					entry->nextOpenTime = now;
+					entry->openInterval = DEVPOLL_REOPEN_MIN;
+				}
+			}
+		}
+	}
+}
+
+/**
+ * limit the epoll timeout to the next pending open attempt
+ */
+int DevPoll::_wait_timeout(int64_t now, int timeoutMs) {
+	int64_t delay;
+	for (int index = 0; index < _deviceCount; index++) {
+		if (_devices[index].dev->isOpen() || _devices[index].dev->replayComplete()) continue;
+		delay = _devices[index].nextOpenTime - now;
+		if (delay < 0) delay = 0;
+		if ((timeoutMs < 0) || (delay < timeoutMs)) timeoutMs = (int)delay;
+	}
+	return timeoutMs;
+}
+
+int64_t DevPoll::_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
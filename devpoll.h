@@ -0,0 +1,115 @@
+/**
+ * @file devpoll.h
+-----------------------------------------------------------------------------
+ The DevPoll class multiplexes any number of Dev1820 interface devices
+ in a single reading thread via epoll.
+ Devices which are not open (or have been closed due to an error) are
+ re-opened with an increasing back-off interval, except for a replay
+ which has completed. The directory of each device (e.g. /dev for a
+ udev symlink) is watched via inotify, so a device is closed as soon as
+ its node is removed and re-opened as soon as it re-appears. An eventfd allows another thread or a signal handler
+ to wake the waiting thread immediately, e.g. on exit.
+-----------------------------------------------------------------------------
+*/
+
+#ifndef _DEVPOLL_H_
+#define _DEVPOLL_H_
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+
+#include <string>
+
+#include "dev1820.h"
+
+/*********************
+ *      DEFINES
+ *********************/
+#define DEVPOLL_MAX_DEVICES 32		// maximum number of interface devices
+#define DEVPOLL_RX_TIMEOUT 20		// seconds without data before a device is re-opened (not a replay)
+#define DEVPOLL_REOPEN_MIN 100		// ms, first interval between attempts to open a device
+#define DEVPOLL_REOPEN_MAX 10000	// ms, maximum interval between attempts to open a device
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+struct devpoll_entry {
+	Dev1820 *dev = NULL;
+	int64_t lastRxTime = 0;		// time of last received data (monotonic ms)
+	int64_t nextOpenTime = 0;	// time of next open attempt (monotonic ms)
+	int openInterval = DEVPOLL_REOPEN_MIN;	// current back-off interval [ms]
+	int watch = -1;				// inotify watch descriptor for directory
+	std::string dir;			// directory of the device node
+	std::string name;			// file name of the device node
+};
+
+/**********************
+ *      CLASS
+ **********************/
+
+class DevPoll {
+public:
+	DevPoll();
+	~DevPoll();
+
+	/**
+	 * Add a device to the poll set
+	 * The device is opened by the next call to wait()
+	 * @param dev: the device, ownership remains with the caller
+	 * @returns the device index or -1 on failure
+	 */
+	int addDevice(Dev1820 *dev);
+
+	/**
+	 * Get device by index
+	 * @returns the device or NULL for an invalid index
+	 */
+	Dev1820* device(int index);
+
+	/**
+	 * @returns the number of devices in the poll set
+	 */
+	int deviceCount(void);
+
+	/**
+	 * Wait for input on any device
+	 * @param ready: array to receive the indexes of devices with pending input
+	 * @param maxReady: size of the ready array
+	 * @param timeoutMs: maximum time to wait in ms
+	 * @returns number of devices with pending input, -1 on failure
+	 * Note: returns with 0 after wakeup() was called, after a device
+	 * node was added or removed, or when a device is due to be re-opened
+	 */
+	int wait(int *ready, int maxReady, int timeoutMs);
+
+	/**
+	 * Close a device after an error, it will be re-opened later
+	 * @param index: the device index
+	 */
+	void closeDevice(int index);
+
+	/**
+	 * Wake up the thread waiting in wait()
+	 * Note: this function is async-signal-safe
+	 */
+	void wakeup(void);
+
+private:
+	void _open_devices(int64_t now);
+	void _check_timeouts(int64_t now);
+	void _add_watch(int index);
+	void _read_inotify(void);
+	int _wait_timeout(int64_t now, int timeoutMs);
+	int64_t _now(void);
+
+	devpoll_entry _devices[DEVPOLL_MAX_DEVICES];
+	int _deviceCount;
+	int _epollFd;
+	int _wakeupFd;
+	int _inotifyFd;
+};
+
+#endif /* _DEVPOLL_H_ */
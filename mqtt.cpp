@@ -23,6 +23,7 @@
 #include <iostream>
 
 #include "mqtt.h"
+#include "1820tag.h"
 
 /*********************
  *      DEFINES
@@ -33,6 +34,7 @@
 #define MQTT_BROKER_DEFAULT_PORT 1883
 #define MQTT_BROKER_DEFAULT_KEEPALIVE 60
 #define MQTT_RETAIN_DEFAULT false
+#define NSEC_PER_SEC 1000000000LL
 
 using namespace std;
 
@@ -65,6 +67,11 @@ static void on_connect(struct mosquitto *mosq, void *obj, int result) {
     ((MQTT*)obj)->connect_callback(mosq, result);
 }
 
+// Callback function for mosquitto connect async (protocol version 5)
+static void on_connect_v5(struct mosquitto *mosq, void *obj, int result, int flags, const mosquitto_property *props) {
+    ((MQTT*)obj)->connect_v5_callback(mosq, result, props);
+}
+
 // Callback function for mosquitto disconnect async
 static void on_disconnect(struct mosquitto *mosq, void *obj, int rc) {
     // callback function of the relevant instance
@@ -112,15 +119,33 @@ static void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_cou
 }
 
  void MQTT::_construct (const char* clientID) {
-     _connected = false;
+     pthread_mutexattr_t attr;
      _console_log_enable = false;
      _qos = 0;
      _retain = MQTT_RETAIN_DEFAULT;
      connectionStatusCallback = NULL;
      topicUpdateCallback = NULL;
-     _mqttBroker.assign( MQTT_BROKER_DEFAULT );
-     _mqttPort = MQTT_BROKER_DEFAULT_PORT;
+     windowCallback = NULL;
+     _clientID.assign(clientID);
+     _connCount = 0;
+     _active = -1;
+     _mode = MQTT_BROKERS_FAILOVER;
+     _started = false;
      _mqttKeepalive = MQTT_BROKER_DEFAULT_KEEPALIVE;
+     _protocolVersion = MQTT_PROTOCOL_VERSION_DEFAULT;
+     // the connection status callback may subscribe while the mutex is held
+     pthread_mutexattr_init(&attr);
+     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+     pthread_mutex_init(&_connMutex, &attr);
+     pthread_mutexattr_destroy(&attr);
+     pthread_mutex_init(&_inflightMutex, NULL);
+     pthread_mutex_init(&_messageMutex, NULL);
+     _inflight = NULL;
+     _inflightMask = 0;
+     _inflightMax = 0;
+     _windowWasFull = false;
+     memset(&_ackStats, 0, sizeof(_ackStats));
+     setInflightMax(MQTT_INFLIGHT_DEFAULT);
 
      // initialise library
      mosquitto_lib_init();
@@ -129,57 +154,62 @@ static void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_cou
      printf("mosquitto library V%d.%d.%d (%d)\n", major, minor, revision, result);
      syslog(LOG_INFO, "mosquitto library V%d.%d.%d (%d)", major, minor, revision, result);
 
-     // create new mqtt
-     _mosq = mosquitto_new(clientID, false, this);  // "this" provides a link from calllback to class instance
-     if (_mosq == NULL) {
-         syslog(LOG_ERR,"Class MQTT - mosquitto_new returned NULL");
-         throw runtime_error("Class MQTT - mosquitto_new returned NULL");
-     }
-
-     // start mqtt processing loop in own thread
-     result = mosquitto_loop_start(_mosq);
-     if (result != MOSQ_ERR_SUCCESS) {
-         syslog(LOG_ERR, "Class MQTT - mosquitto_loop_start failed");
-         throw runtime_error("Class MQTT - mosquitto_loop_start failed");
-     }
-
-     // set callback functions
-     mosquitto_connect_callback_set(_mosq, on_connect);
-     mosquitto_disconnect_callback_set(_mosq, on_disconnect);
-     mosquitto_publish_callback_set(_mosq, on_publish);
-     mosquitto_message_callback_set(_mosq, on_message);
-     mosquitto_log_callback_set(_mosq, on_log);
-     mosquitto_subscribe_callback_set(_mosq, on_subscribe);
+     // the first broker, setBroker() changes it
+     _conns[0] = _newConnection(MQTT_BROKER_DEFAULT, MQTT_BROKER_DEFAULT_PORT);
+     _connCount = 1;
  }
 
  MQTT::~MQTT() {
-     //printf("%s - Connected: %d\n", __func__, connected);
-     if (_connected) mosquitto_disconnect(_mosq) ;
-     //mosquitto_loop_stop(_mosq, false);
-     mosquitto_loop_stop(_mosq, true); // Note: must be true or this will block
-     if (_mosq != NULL) {
-         mosquitto_destroy(_mosq);
-         _mosq = NULL;
+     for (int i = 0; i < _connCount; i++) {
+         _deleteConnection(_conns[i]);
      }
      mosquitto_lib_cleanup();
+     delete [] _inflight;
+     pthread_mutex_destroy(&_inflightMutex);
+     pthread_mutex_destroy(&_connMutex);
+     pthread_mutex_destroy(&_messageMutex);
  }
 
 #pragma mark Connecting
 
 void MQTT::connect(void) {
     char strbuf[255];
-    // connect to mqtt server
-    int result = mosquitto_connect_async(_mosq, _mqttBroker.c_str(), _mqttPort, _mqttKeepalive);
-    if (result != MOSQ_ERR_SUCCESS) {
-        sprintf(strbuf, "%s - mosquitto_connect failed: %s [%d]\n", __func__, strerror(result), result);
-        syslog(LOG_ERR, "mosquitto_connect failed: %s [%d]", strerror(result), result);
+    mqtt_connection *conn;
+    int result, attempted = 0, failed = 0;
+    _started = true;
+    // connect to all mqtt servers, the standby connections are established as well
+    for (int i = 0; i < _connCount; i++) {
+        conn = _conns[i];
+        if (conn->connected) continue;
+        attempted++;
+        result = mosquitto_connect_async(conn->mosq, conn->host.c_str(), conn->port, _mqttKeepalive);
+        if (result != MOSQ_ERR_SUCCESS) {
+            syslog(LOG_ERR, "mosquitto_connect failed: %s [%d] [%s]", strerror(result), result, conn->host.c_str());
+            failed++;
+        }
+    }
+    // a broker which can't be reached is retried by its mosquitto thread,
+    // fail only if no broker could be reached
+    if ((attempted > 0) && (failed == attempted)) {
+        sprintf(strbuf, "%s - mosquitto_connect failed for all brokers\n", __func__);
         throw runtime_error(strbuf);
     }
     //printf ("%s\n", __func__);
 }
 
 void MQTT::disconnect(void) {
-    if (_connected) mosquitto_disconnect(_mosq) ;
+    for (int i = 0; i < _connCount; i++) {
+        if (_conns[i]->connected) mosquitto_disconnect(_conns[i]->mosq);
+    }
+}
+
+void MQTT::stop(void) {
+    disconnect();
+    for (int i = 0; i < _connCount; i++) {
+        mosquitto_loop_stop(_conns[i]->mosq, true); // Note: must be true or this will block
+        _conns[i]->connected = false;
+    }
+    _active = -1;
 }
 
 #pragma mark Operation
@@ -192,58 +222,93 @@ void MQTT::registerTopicUpdateCallback(void (*callback) (const struct mosquitto_
     topicUpdateCallback = callback;
 }
 
-int MQTT::publish(const char* topic, const char* format, float value, bool pubRetain) {
-    int messageid = 0;
-    if (!_connected) {
+int MQTT::publish(const char* topic, const char* value, bool pubRetain, uint32_t expiry, int qos) {
+    if (!isConnected()) {
         fprintf(stderr, "%s: Not Connected!\n", __func__);
         return -1;
-    } else {
-        //printf ("%s: %s\n", __func__, topic);
     }
-    sprintf(_pub_buf, format, value);
-    //printf ("%s: %s %s\n", __func__, topic, _pub_buf);
-    int result = mosquitto_publish(_mosq, &messageid, topic, strlen(_pub_buf), (const char *) _pub_buf, _qos, pubRetain);
-    if (result != MOSQ_ERR_SUCCESS) {
-        fprintf(stderr, "%s: %s [%s]\n", __func__, mosquitto_strerror(result), topic);
+    //printf ("%s: %s %s\n", __func__, topic, value);
+    return _publishAll(topic, value, strlen(value), 0, pubRetain, expiry, qos, _protocolVersion == 5);
+}
+
+int MQTT::publish(const char* topic, const char* value, int64_t timestamp, bool pubRetain, uint32_t expiry, int qos) {
+    int len;
+    if (!isConnected()) {
+        fprintf(stderr, "%s: Not Connected!\n", __func__);
+        return -1;
     }
-    return messageid;
+    // the timestamp is a user property
+    if (_protocolVersion == 5)
+        return _publishAll(topic, value, strlen(value), timestamp, pubRetain, expiry, qos, true);
+    len = snprintf(_pub_buf, sizeof(_pub_buf), "{\"value\":%s,\"ts\":%lld}", value, (long long)timestamp);
+    if (len >= (int)sizeof(_pub_buf)) {
+        fprintf(stderr, "%s: payload too long [%s]\n", __func__, topic);
+        return -1;
+    }
+    return _publishAll(topic, _pub_buf, len, 0, pubRetain, 0, qos, false);
+}
+
+int MQTT::publishPayload(const char* topic, const char* payload, int len, bool pubRetain, int qos) {
+    if (!isConnected()) {
+        fprintf(stderr, "%s: Not Connected!\n", __func__);
+        return -1;
+    }
+    return _publishAll(topic, payload, len, 0, pubRetain, 0, qos, false);
 }
 
 int MQTT::clear_retained_message(const char* topic) {
-    int messageid = 0;
-    if (!_connected) {
+    int messageid = 0, result;
+    if (!isConnected()) {
         fprintf(stderr, "%s: Not Connected!\n", __func__);
         return -1;
-    } else {
-        //printf ("%s: %s\n", __func__, topic);
     }
-	// publishing an empty message with retain on will clear the message from 
-	// mosquitto's persistance store
-    int result = mosquitto_publish(_mosq, &messageid, topic, 0, "", _qos, true);
-    if (result != MOSQ_ERR_SUCCESS) {
-        fprintf(stderr, "%s: %s [%s]\n", __func__, mosquitto_strerror(result), topic);
+	// publishing an empty message with retain on will clear the message from
+	// mosquitto's persistance store, a standby broker may have it as well
+    for (int i = 0; i < _connCount; i++) {
+        if (!_conns[i]->connected) continue;
+        result = mosquitto_publish(_conns[i]->mosq, &messageid, topic, 0, "", _qos, true);
+        if (result != MOSQ_ERR_SUCCESS) {
+            fprintf(stderr, "%s: %s [%s]\n", __func__, mosquitto_strerror(result), topic);
+        }
     }
     return messageid;
 }
 
 int MQTT::subscribe(const char *topic) {
-    int messageid = 0;
-    int result = mosquitto_subscribe(_mosq, &messageid, topic, _qos);
-    if (result != MOSQ_ERR_SUCCESS) {
-        fprintf(stderr, "%s: %s [%s]\n", __func__, mosquitto_strerror(result), topic);
-    } else {
-        //printf ("%s: %s\n", __func__, topic);
+    int messageid = 0, result;
+    mqtt_connection *conn;
+    pthread_mutex_lock(&_connMutex);
+    // already subscribed, _connectionChanged() subscribes again on connect
+    if (!_subscriptions.insert(topic).second) {
+        pthread_mutex_unlock(&_connMutex);
+        return 0;
+    }
+    // moved to the next broker on failover
+    conn = _activeConnection();
+    if (conn != NULL) {
+        result = mosquitto_subscribe(conn->mosq, &messageid, topic, _qos);
+        if (result != MOSQ_ERR_SUCCESS) {
+            fprintf(stderr, "%s: %s [%s]\n", __func__, mosquitto_strerror(result), topic);
+        }
     }
+    pthread_mutex_unlock(&_connMutex);
     return messageid;
 }
 
 int MQTT::unsubscribe(const char *topic) {
-    int messageid = 0;
-    int result = mosquitto_unsubscribe(_mosq, &messageid, topic);
-    if (result != MOSQ_ERR_SUCCESS) {
-        syslog(LOG_ERR, "%s [%s]", mosquitto_strerror(result), topic);
-        fprintf(stderr, "%s: %s [%s]\n", __func__, mosquitto_strerror(result), topic);
+    int messageid = 0, result;
+    mqtt_connection *conn;
+    pthread_mutex_lock(&_connMutex);
+    _subscriptions.erase(topic);
+    conn = _activeConnection();
+    if (conn != NULL) {
+        result = mosquitto_unsubscribe(conn->mosq, &messageid, topic);
+        if (result != MOSQ_ERR_SUCCESS) {
+            syslog(LOG_ERR, "%s [%s]", mosquitto_strerror(result), topic);
+            fprintf(stderr, "%s: %s [%s]\n", __func__, mosquitto_strerror(result), topic);
+        }
     }
+    pthread_mutex_unlock(&_connMutex);
     return messageid;
 }
 
@@ -253,21 +318,131 @@ void MQTT::setConsoleLog(bool enable) {
     _console_log_enable = enable;
 }
 
-int MQTT::setBroker(const char *newBroker) {
-    _mqttBroker = newBroker;
+int MQTT::setBroker(const char *newBroker, unsigned int newPort) {
+    _conns[0]->host = newBroker;
+    if (newPort > 0) _conns[0]->port = newPort;
+    return 0;
+}
+
+int MQTT::addBroker(const char *host, unsigned int newPort) {
+    if (_started || (_connCount >= MQTT_BROKERS_MAX)) return -1;
+    _conns[_connCount] = _newConnection(host, (newPort > 0) ? newPort : MQTT_BROKER_DEFAULT_PORT);
+    _connCount++;
+    return 0;
+}
+
+int MQTT::setBrokerMode(int mode) {
+    if ((mode != MQTT_BROKERS_FAILOVER) && (mode != MQTT_BROKERS_FANOUT)) return -1;
+    _mode = mode;
     return 0;
 }
 
+int MQTT::brokerMode(void) {
+    return _mode;
+}
+
+int MQTT::brokerCount(void) {
+    return _connCount;
+}
+
+int MQTT::connectedCount(void) {
+    int count = 0;
+    for (int i = 0; i < _connCount; i++) {
+        if (_conns[i]->connected) count++;
+    }
+    return count;
+}
+
+int MQTT::setKeepalive(int seconds) {
+    // mosquitto doesn't accept less than 5s
+    if ((seconds < 5) || _started) return -1;
+    _mqttKeepalive = seconds;
+    return 0;
+}
+
+int MQTT::setProtocolVersion(int version) {
+    if ((version != 4) && (version != 5)) return -1;
+    _protocolVersion = version;
+    for (int i = 0; i < _connCount; i++) {
+        if (_applyProtocolVersion(_conns[i]) < 0) return -1;
+    }
+    return 0;
+}
+
+int MQTT::protocolVersion(void) {
+    return _protocolVersion;
+}
+
+int MQTT::topicAliasMax(void) {
+    mqtt_connection *conn = _activeConnection();
+    return (conn == NULL) ? 0 : conn->aliasMax;
+}
+
+int MQTT::setInflightMax(int size) {
+    unsigned int tableSize = 1;
+    if ((size <= 0) || isConnected()) return -1;
+    // keep the table at most half full, with all brokers at their limit
+    while (tableSize < (unsigned int)size * MQTT_BROKERS_MAX * 2) tableSize *= 2;
+    pthread_mutex_lock(&_inflightMutex);
+    delete [] _inflight;
+    _inflight = new mqtt_inflight[tableSize];
+    _inflightMask = tableSize - 1;
+    for (unsigned int i = 0; i < tableSize; i++) _inflight[i].mid = 0;
+    _inflightMax = size;
+    _ackStats.inflight = 0;
+    for (int i = 0; i < _connCount; i++) _conns[i]->inflight = 0;
+    pthread_mutex_unlock(&_inflightMutex);
+    return 0;
+}
+
+bool MQTT::isWindowFull(void) {
+    bool full = false;
+    int64_t now = _now();
+    pthread_mutex_lock(&_inflightMutex);
+    for (int i = 0; i < _connCount; i++) {
+        if (!_conns[i]->connected) continue;
+        if (_windowFull(_conns[i], now)) full = true;
+        // the standby brokers are not published to
+        if (_mode == MQTT_BROKERS_FAILOVER) break;
+    }
+    if (full) _windowWasFull = true;
+    pthread_mutex_unlock(&_inflightMutex);
+    return full;
+}
+
+void MQTT::registerWindowCallback(void (*callback) (void)) {
+    windowCallback = callback;
+}
+
+void MQTT::getAckStats(mqtt_ack_stats *stats, bool reset) {
+    pthread_mutex_lock(&_inflightMutex);
+    *stats = _ackStats;
+    if (reset) {
+        _ackStats.published = 0;
+        _ackStats.acked = 0;
+        _ackStats.lost = 0;
+        _ackStats.rejected = 0;
+        _ackStats.latencyMin = 0;
+        _ackStats.latencyMax = 0;
+        _ackStats.latencySum = 0;
+    }
+    pthread_mutex_unlock(&_inflightMutex);
+}
+
 const char* MQTT::broker(void) {
-    return _mqttBroker.c_str();
+    mqtt_connection *conn = _activeConnection();
+    if (conn == NULL) conn = _conns[0];
+    return conn->host.c_str();
 }
 
 unsigned int MQTT::port(void) {
-    return _mqttPort;
+    mqtt_connection *conn = _activeConnection();
+    if (conn == NULL) conn = _conns[0];
+    return conn->port;
 }
 
 bool MQTT::isConnected(void) {
-    return _connected;
+    return _active.load() >= 0;
 }
 
 int MQTT::setRetain(bool newRetain) {
@@ -290,8 +465,14 @@ void MQTT::message_callback(struct mosquitto *m, const struct mosquitto_message
 		fprintf(stderr, "%s (null)\n", message->topic);
 	}
 	*/
+	mqtt_connection *conn = _connection(m);
+	// a standby broker may still have the subscriptions of an earlier session
+	if ((conn == NULL) || (conn->index != _active.load())) return;
 	if (topicUpdateCallback != NULL) {
+		// the old and the new active broker may deliver at the same time
+		pthread_mutex_lock(&_messageMutex);
 		(*topicUpdateCallback) (message);
+		pthread_mutex_unlock(&_messageMutex);
 		//fprintf(stderr, "%s - topicUpdateCallback done %s\n", __func__, message->topic);
 	}
 //	else {
@@ -311,33 +492,459 @@ void MQTT::subscribe_callback(struct mosquitto *m, int mid, int qos_count, const
 }
 
 void MQTT::publish_callback(struct mosquitto *m, int mid) {
+    mqtt_connection *conn = _connection(m);
+    mqtt_inflight *slot;
+    int64_t latency;
+    int key;
+    bool notify = false;
     //fprintf(stderr, "%s: %d\n", __func__, mid );
+    if (conn == NULL) return;
+    key = mid | (conn->index << 16);
+    pthread_mutex_lock(&_inflightMutex);
+    // QoS 0 messages are not tracked
+    slot = _inflightSlot(key);
+    if (slot->mid == key) {
+        latency = _now() - slot->sendTime;
+        if ((_ackStats.latencyMin == 0) || (latency < _ackStats.latencyMin)) _ackStats.latencyMin = latency;
+        if (latency > _ackStats.latencyMax) _ackStats.latencyMax = latency;
+        _ackStats.latencySum += latency;
+        _ackStats.acked++;
+        _inflightRemove(slot);
+        notify = _windowWasFull;
+        _windowWasFull = false;
+    }
+    pthread_mutex_unlock(&_inflightMutex);
+    if (notify && (windowCallback != NULL)) {
+        (*windowCallback) ();
+    }
 }
 
 void MQTT::connect_callback(struct mosquitto *m, int result) {
+     mqtt_connection *conn = _connection(m);
      //printf("%s: %s\n", __func__ , mosquitto_connack_string(result) );
+     if (conn == NULL) return;
+     pthread_mutex_lock(&_connMutex);
      if (result == MOSQ_ERR_SUCCESS) {
-         _connected = true;
+         conn->connected = true;
          if (_console_log_enable) {
-             printf("%s: connection success\n", __func__);
+             printf("%s: connection success [%s]\n", __func__, conn->host.c_str());
          }
      } else {
-         syslog(LOG_ERR, "%s", mosquitto_connack_string(result));
-         fprintf(stderr, "%s: %s\n", __func__ , mosquitto_connack_string(result) );
+         syslog(LOG_ERR, "%s [%s]", mosquitto_connack_string(result), conn->host.c_str());
+         fprintf(stderr, "%s: %s [%s]\n", __func__ , mosquitto_connack_string(result), conn->host.c_str());
      }
-     if (connectionStatusCallback != NULL) {
-         (*connectionStatusCallback) (_connected);
+     _connectionChanged(conn, result != MOSQ_ERR_SUCCESS);
+     pthread_mutex_unlock(&_connMutex);
+}
+
+void MQTT::connect_v5_callback(struct mosquitto *m, int result, const mosquitto_property *props) {
+     mqtt_connection *conn = _connection(m);
+     uint16_t aliasMax = 0;
+     if (conn == NULL) return;
+     // aliases are only valid for one connection
+     if (result == MOSQ_ERR_SUCCESS)
+         mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &aliasMax, false);
+     _resetAliases(conn, (aliasMax > MQTT_TOPIC_ALIAS_MAX) ? MQTT_TOPIC_ALIAS_MAX : aliasMax);
+     if (_console_log_enable) {
+         printf("%s: topic alias maximum %d [%s]\n", __func__, aliasMax, conn->host.c_str());
      }
+     connect_callback(m, result);
 }
 
 void MQTT::disconnect_callback(struct mosquitto *m, int rc) {
+     mqtt_connection *conn = _connection(m);
      //fprintf(stderr, "%s: %s\n", __func__, mosquitto_strerror(rc) );
-     _connected = false;
-     if (connectionStatusCallback != NULL) {
-         (*connectionStatusCallback) (_connected);
-     }
+     if (conn == NULL) return;
+     pthread_mutex_lock(&_connMutex);
+     conn->connected = false;
+     _connectionChanged(conn, true);
+     pthread_mutex_unlock(&_connMutex);
  }
 
  /*********************
   * PRIVATE FUNCTIONS
   *********************/
+
+/**
+ * create the mosquitto handle of a broker and start its thread
+ */
+mqtt_connection* MQTT::_newConnection(const char* host, unsigned int newPort) {
+    mqtt_connection *conn = new mqtt_connection;
+    int result;
+
+    conn->index = _connCount;
+    conn->host.assign(host);
+    conn->port = newPort;
+    conn->connected = false;
+    conn->inflight = 0;
+    conn->aliasIndex = NULL;
+    conn->aliasIndexMask = 0;
+    conn->aliasTopic = NULL;
+    conn->aliasSent = NULL;
+    conn->aliasMax = 0;
+    conn->aliasCount = 0;
+    pthread_mutex_init(&conn->aliasMutex, NULL);
+
+    // create new mqtt
+    conn->mosq = mosquitto_new(_clientID.c_str(), false, this);  // "this" provides a link from calllback to class instance
+    if (conn->mosq == NULL) {
+        pthread_mutex_destroy(&conn->aliasMutex);
+        delete conn;
+        syslog(LOG_ERR,"Class MQTT - mosquitto_new returned NULL");
+        throw runtime_error("Class MQTT - mosquitto_new returned NULL");
+    }
+
+    // set callback functions
+    mosquitto_connect_callback_set(conn->mosq, on_connect);
+    mosquitto_disconnect_callback_set(conn->mosq, on_disconnect);
+    mosquitto_publish_callback_set(conn->mosq, on_publish);
+    mosquitto_message_callback_set(conn->mosq, on_message);
+    mosquitto_log_callback_set(conn->mosq, on_log);
+    mosquitto_subscribe_callback_set(conn->mosq, on_subscribe);
+    _applyProtocolVersion(conn);
+
+    // start mqtt processing loop in own thread
+    result = mosquitto_loop_start(conn->mosq);
+    if (result != MOSQ_ERR_SUCCESS) {
+        mosquitto_destroy(conn->mosq);
+        pthread_mutex_destroy(&conn->aliasMutex);
+        delete conn;
+        syslog(LOG_ERR, "Class MQTT - mosquitto_loop_start failed");
+        throw runtime_error("Class MQTT - mosquitto_loop_start failed");
+    }
+    return conn;
+}
+
+/**
+ * disconnect a broker and free its resources
+ */
+void MQTT::_deleteConnection(mqtt_connection *conn) {
+    if (conn->connected) mosquitto_disconnect(conn->mosq);
+    mosquitto_loop_stop(conn->mosq, true); // Note: must be true or this will block
+    mosquitto_destroy(conn->mosq);
+    delete [] conn->aliasIndex;
+    delete [] conn->aliasTopic;
+    delete [] conn->aliasSent;
+    pthread_mutex_destroy(&conn->aliasMutex);
+    delete conn;
+}
+
+/**
+ * @returns the connection of a mosquitto handle, NULL if unknown
+ */
+mqtt_connection* MQTT::_connection(struct mosquitto *mosq) {
+    for (int i = 0; i < _connCount; i++) {
+        if (_conns[i]->mosq == mosq) return _conns[i];
+    }
+    return NULL;
+}
+
+/**
+ * @returns the first connected broker, NULL if none is connected
+ */
+mqtt_connection* MQTT::_activeConnection(void) {
+    int active = _active.load();
+    return (active < 0) ? NULL : _conns[active];
+}
+
+/**
+ * set the protocol version of a connection
+ * @returns 0 on success, -1 on failure
+ */
+int MQTT::_applyProtocolVersion(mqtt_connection *conn) {
+    int result;
+    result = mosquitto_int_option(conn->mosq, MOSQ_OPT_PROTOCOL_VERSION, (_protocolVersion == 5) ? MQTT_PROTOCOL_V5 : MQTT_PROTOCOL_V311);
+    if (result != MOSQ_ERR_SUCCESS) {
+        fprintf(stderr, "%s: %s\n", __func__, mosquitto_strerror(result));
+        return -1;
+    }
+    // the v5 callback receives the CONNACK properties (topic alias maximum)
+    if (_protocolVersion == 5) {
+        mosquitto_connect_callback_set(conn->mosq, NULL);
+        mosquitto_connect_v5_callback_set(conn->mosq, on_connect_v5);
+    } else {
+        mosquitto_connect_v5_callback_set(conn->mosq, NULL);
+        mosquitto_connect_callback_set(conn->mosq, on_connect);
+    }
+    return 0;
+}
+
+/**
+ * select the active broker after a connection change, called with _connMutex held
+ * @param failed: a connection attempt failed or a broker disconnected
+ */
+void MQTT::_connectionChanged(mqtt_connection *conn, bool failed) {
+    int previous = _active.load(), active = -1;
+
+    // the primary broker is preferred, publishing returns to it when it is back
+    for (int i = 0; i < _connCount; i++) {
+        if (_conns[i]->connected) {
+            active = i;
+            break;
+        }
+    }
+    _active = active;
+    if (active != previous) {
+        // only the active broker is subscribed, a message is received once
+        if ((previous >= 0) && _conns[previous]->connected) {
+            for (set<string>::iterator it = _subscriptions.begin(); it != _subscriptions.end(); ++it)
+                mosquitto_unsubscribe(_conns[previous]->mosq, NULL, it->c_str());
+        }
+        if (active >= 0) {
+            for (set<string>::iterator it = _subscriptions.begin(); it != _subscriptions.end(); ++it)
+                mosquitto_subscribe(_conns[active]->mosq, NULL, it->c_str(), _qos);
+        }
+    }
+    if ((_mode == MQTT_BROKERS_FAILOVER) && (previous >= 0) && (active >= 0) && (previous != active)) {
+        syslog(LOG_WARNING, "MQTT switched from broker [%s] to [%s]", _conns[previous]->host.c_str(), _conns[active]->host.c_str());
+        if (_console_log_enable) {
+            printf("%s: switched to broker [%s]\n", __func__, _conns[active]->host.c_str());
+        }
+    }
+    // report the first connection, the last disconnect and failures
+    // while no broker is connected
+    if (((previous < 0) != (active < 0)) || ((active < 0) && failed)) {
+        if (connectionStatusCallback != NULL) {
+            (*connectionStatusCallback) (active >= 0);
+        }
+    }
+}
+
+/**
+ * publish to the active broker or, with MQTT_BROKERS_FANOUT, to all connected brokers
+ * @param timestamp: sent as user property "ts" (v5), 0 = none
+ * @param v5: publish with protocol version 5 properties
+ * @returns message ID of the first broker, -1 on error, MQTT_ERR_WINDOW_FULL
+ */
+int MQTT::_publishAll(const char* topic, const char* payload, int len, int64_t timestamp, bool pubRetain, uint32_t expiry, int qos, bool v5) {
+    mqtt_connection *conn;
+    int messageid = -1, mid, result;
+    int64_t now;
+
+    if ((_mode == MQTT_BROKERS_FANOUT) && (qos > 0)) {
+        // all brokers or none, the slowest broker holds back the others
+        now = _now();
+        pthread_mutex_lock(&_inflightMutex);
+        for (int i = 0; i < _connCount; i++) {
+            if (_conns[i]->connected && _windowFull(_conns[i], now)) {
+                _ackStats.rejected++;
+                _windowWasFull = true;
+                pthread_mutex_unlock(&_inflightMutex);
+                return MQTT_ERR_WINDOW_FULL;
+            }
+        }
+        pthread_mutex_unlock(&_inflightMutex);
+    }
+    for (int i = 0; i < _connCount; i++) {
+        conn = _conns[i];
+        if (!conn->connected) continue;
+        mid = 0;
+        if (v5)
+            result = _publishV5(conn, &mid, topic, payload, len, timestamp, pubRetain, expiry, qos);
+        else
+            result = _send(conn, &mid, topic, len, payload, qos, pubRetain, NULL);
+        if (result == MOSQ_ERR_SUCCESS) {
+            if (messageid < 0) messageid = mid;
+        } else if (result == MQTT_ERR_WINDOW_FULL) {
+            if (messageid < 0) messageid = MQTT_ERR_WINDOW_FULL;
+        } else {
+            fprintf(stderr, "%s: %s [%s] [%s]\n", __func__, mosquitto_strerror(result), topic, conn->host.c_str());
+        }
+        // the standby brokers don't get the message
+        if (_mode == MQTT_BROKERS_FAILOVER) break;
+    }
+    return messageid;
+}
+
+/**
+ * publish to one broker with protocol version 5 properties
+ * @param mid: receives the message ID
+ * @param timestamp: sent as user property "ts", 0 = none
+ * @returns mosquitto result, MQTT_ERR_WINDOW_FULL if the window is full
+ */
+int MQTT::_publishV5(mqtt_connection *conn, int *mid, const char* topic, const char* payload, int len, int64_t timestamp, bool pubRetain, uint32_t expiry, int qos) {
+    mosquitto_property *props = NULL;
+    char tsBuf[24];
+    uint16_t alias;
+    bool known = false;
+    int result;
+
+    // held until the alias is marked sent, the mosquitto thread resets the aliases on connect
+    pthread_mutex_lock(&conn->aliasMutex);
+    // libmosquitto may resend a QoS 1/2 message after a reconnect, when its alias is no longer valid
+    alias = (qos > 0) ? 0 : _topicAlias(conn, topic, &known);
+    if (alias > 0)
+        mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS, alias);
+    if (expiry > 0)
+        mosquitto_property_add_int32(&props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, expiry);
+    if (timestamp != 0) {
+        snprintf(tsBuf, sizeof(tsBuf), "%lld", (long long)timestamp);
+        mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, "ts", tsBuf);
+    }
+    // a known alias replaces the topic
+    result = _send(conn, mid, known ? NULL : topic, len, payload, qos, pubRetain, props);
+    mosquitto_property_free_all(&props);
+    if ((result == MOSQ_ERR_SUCCESS) && (alias > 0)) conn->aliasSent[alias] = true;
+    pthread_mutex_unlock(&conn->aliasMutex);
+    return result;
+}
+
+/**
+ * find or assign the topic alias of a topic
+ * @param known: set to true if the broker knows the alias
+ * @returns the alias, 0 = none
+ */
+uint16_t MQTT::_topicAlias(mqtt_connection *conn, const char* topic, bool *known) {
+    uint32_t hash;
+    unsigned int pos;
+
+    if (conn->aliasMax == 0) return 0;
+    hash = topic_hash(topic);
+    pos = hash & conn->aliasIndexMask;
+    while (conn->aliasIndex[pos].alias > 0) {
+        if ((conn->aliasIndex[pos].hash == hash) && (conn->aliasTopic[conn->aliasIndex[pos].alias] == topic)) {
+            *known = conn->aliasSent[conn->aliasIndex[pos].alias];
+            return conn->aliasIndex[pos].alias;
+        }
+        pos = (pos + 1) & conn->aliasIndexMask;
+    }
+    // all aliases are taken, publish with the topic
+    if (conn->aliasCount >= conn->aliasMax) return 0;
+    conn->aliasCount++;
+    conn->aliasIndex[pos].hash = hash;
+    conn->aliasIndex[pos].alias = conn->aliasCount;
+    conn->aliasTopic[conn->aliasCount] = topic;
+    conn->aliasSent[conn->aliasCount] = false;
+    return conn->aliasCount;
+}
+
+/**
+ * forget all topic aliases of a connection, called on connect
+ */
+void MQTT::_resetAliases(mqtt_connection *conn, int aliasMax) {
+    unsigned int size = 1;
+
+    pthread_mutex_lock(&conn->aliasMutex);
+    delete [] conn->aliasIndex;
+    delete [] conn->aliasTopic;
+    delete [] conn->aliasSent;
+    conn->aliasIndex = NULL;
+    conn->aliasTopic = NULL;
+    conn->aliasSent = NULL;
+    conn->aliasCount = 0;
+    conn->aliasMax = aliasMax;
+    if (conn->aliasMax > 0) {
+        // keep the index at most half full
+        while (size < (unsigned int)conn->aliasMax * 2) size *= 2;
+        conn->aliasIndex = new mqtt_alias_slot[size];
+        conn->aliasIndexMask = size - 1;
+        for (unsigned int i = 0; i < size; i++) conn->aliasIndex[i].alias = 0;
+        conn->aliasTopic = new std::string[conn->aliasMax + 1];
+        conn->aliasSent = new bool[conn->aliasMax + 1];
+    }
+    pthread_mutex_unlock(&conn->aliasMutex);
+}
+
+/**
+ * publish to one broker and track QoS 1/2 messages in the in-flight window
+ * @param mid: receives the message ID
+ * @returns mosquitto result, MQTT_ERR_WINDOW_FULL if the window is full
+ */
+int MQTT::_send(mqtt_connection *conn, int *mid, const char* topic, int len, const void* payload, int qos, bool pubRetain, const mosquitto_property *props) {
+    mqtt_inflight *slot;
+    int64_t now;
+    int result, key;
+
+    if (qos <= 0)
+        return mosquitto_publish_v5(conn->mosq, mid, topic, len, payload, 0, pubRetain, props);
+    now = _now();
+    // the lock is held until the message is tracked, the acknowledgement
+    // can't be handled before
+    pthread_mutex_lock(&_inflightMutex);
+    if (_windowFull(conn, now)) {
+        _ackStats.rejected++;
+        _windowWasFull = true;
+        pthread_mutex_unlock(&_inflightMutex);
+        return MQTT_ERR_WINDOW_FULL;
+    }
+    result = mosquitto_publish_v5(conn->mosq, mid, topic, len, payload, (qos > 2) ? 2 : qos, pubRetain, props);
+    if (result == MOSQ_ERR_SUCCESS) {
+        // message IDs are 16 bit, unique per connection
+        key = *mid | (conn->index << 16);
+        slot = _inflightSlot(key);
+        slot->mid = key;
+        slot->sendTime = now;
+        conn->inflight++;
+        _ackStats.inflight++;
+        _ackStats.published++;
+    }
+    pthread_mutex_unlock(&_inflightMutex);
+    return result;
+}
+
+/**
+ * check the in-flight window of a connection, called with _inflightMutex held
+ * @returns true if the window is full after expired messages are given up
+ */
+bool MQTT::_windowFull(mqtt_connection *conn, int64_t now) {
+    if (conn->inflight >= _inflightMax) _inflightExpire(now);
+    return (conn->inflight >= _inflightMax);
+}
+
+/**
+ * find the in-flight slot of a message ID
+ * @returns the slot holding the message or the empty slot to insert it
+ */
+mqtt_inflight* MQTT::_inflightSlot(int mid) {
+    unsigned int pos = (unsigned int)mid & _inflightMask;
+    while ((_inflight[pos].mid != 0) && (_inflight[pos].mid != mid))
+        pos = (pos + 1) & _inflightMask;
+    return &_inflight[pos];
+}
+
+/**
+ * remove a message from the in-flight table
+ * the following entries of the probe sequence are moved up to fill the gap
+ */
+void MQTT::_inflightRemove(mqtt_inflight *slot) {
+    unsigned int gap = slot - _inflight, pos = gap, home;
+    int key = slot->mid;
+    while (true) {
+        pos = (pos + 1) & _inflightMask;
+        if (_inflight[pos].mid == 0) break;
+        home = (unsigned int)_inflight[pos].mid & _inflightMask;
+        // move the entry if its home slot is not between the gap and its slot
+        if (((pos - home) & _inflightMask) >= ((pos - gap) & _inflightMask)) {
+            _inflight[gap] = _inflight[pos];
+            gap = pos;
+        }
+    }
+    _inflight[gap].mid = 0;
+    _conns[key >> 16]->inflight--;
+    _ackStats.inflight--;
+}
+
+/**
+ * give up messages which have not been acknowledged within MQTT_INFLIGHT_TIMEOUT
+ */
+void MQTT::_inflightExpire(int64_t now) {
+    unsigned int pos = 0;
+    while (pos <= _inflightMask) {
+        if ((_inflight[pos].mid != 0) && (now - _inflight[pos].sendTime > MQTT_INFLIGHT_TIMEOUT * NSEC_PER_SEC)) {
+            // an entry may be moved into this slot, check it again
+            _inflightRemove(&_inflight[pos]);
+            _ackStats.lost++;
+            continue;
+        }
+        pos++;
+    }
+}
+
+/**
+ * @returns current time [ns] CLOCK_MONOTONIC
+ */
+int64_t MQTT::_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec;
+}
@@ -4,6 +4,28 @@
  -----------------------------------------------------------------------------
   The MQTT class encapsulates the mosquitto connection used for publishing
   and receiving data via the MQTT protocol from a broker.
+  With protocol version 5 the publish() functions use topic aliases: the
+  first message of a topic carries the topic and an alias, later messages
+  only the 2 byte alias. Aliases are assigned first come first served up
+  to the maximum granted by the broker and are reset on every connect.
+  QoS 1/2 messages always carry the topic and no alias, libmosquitto may
+  resend them on a new connection where the alias isn't known.
+  A message expiry interval and the timestamp (as user property "ts") are
+  sent as message properties.
+  QoS 1 and 2 messages are tracked by their message ID until the broker
+  acknowledges them (publish callback). The number of unacknowledged
+  messages is limited by the in-flight window, a publish is rejected while
+  the window is full so libmosquitto's queue can't grow without limit.
+  The time from publish to acknowledgement is measured.
+  Several brokers can be configured, each has its own mosquitto handle
+  and connection thread. All brokers are connected at the same time.
+  MQTT_BROKERS_FAILOVER publishes to the first connected broker in the
+  order they were added, the others are standby connections which take
+  over as soon as the primary drops (no reconnect delay).
+  MQTT_BROKERS_FANOUT publishes every message to all connected brokers.
+  Topic aliases and the in-flight window are kept per connection.
+  Subscriptions are only made on the active broker and follow it, so a
+  message is received and handled once.
 
  -----------------------------------------------------------------------------
  */
@@ -12,11 +34,67 @@
 #define MQTT_H
 
 //#include <time.h>
+#include <pthread.h>
+
+#include <stdint.h>
 
 #include <mosquitto.h>
 
+#include <atomic>
+#include <set>
 #include <string>
 
+#define MQTT_BROKERS_MAX 4					// max number of brokers
+#define MQTT_BROKERS_FAILOVER 0				// publish to the first connected broker
+#define MQTT_BROKERS_FANOUT 1				// publish to all connected brokers
+#define MQTT_PROTOCOL_VERSION_DEFAULT 4		// MQTT 3.1.1
+#define MQTT_TOPIC_ALIAS_MAX 1024			// max topic aliases used, even if the broker grants more
+#define MQTT_INFLIGHT_DEFAULT 20			// max unacknowledged QoS 1/2 messages
+#define MQTT_INFLIGHT_TIMEOUT 30			// [s] an unacknowledged message is given up
+#define MQTT_ERR_WINDOW_FULL -2				// publish rejected, the in-flight window is full
+
+struct mqtt_alias_slot {
+	uint32_t hash;		// topic hash
+	uint16_t alias;		// 0 = empty slot
+};
+
+// unacknowledged QoS 1/2 message
+struct mqtt_inflight {
+	int mid;			// message ID | connection index << 16, 0 = empty slot
+	int64_t sendTime;	// [ns] CLOCK_MONOTONIC
+};
+
+// acknowledgement statistics of QoS 1/2 messages
+struct mqtt_ack_stats {
+	uint64_t published;		// messages published, counted per broker
+	uint64_t acked;			// messages acknowledged
+	uint64_t lost;			// not acknowledged within MQTT_INFLIGHT_TIMEOUT
+	uint64_t rejected;		// not published, the window was full
+	int inflight;			// messages waiting for the acknowledgement
+	int64_t latencyMin;		// [ns] acknowledgement latency, 0 = no message acknowledged
+	int64_t latencyMax;
+	int64_t latencySum;		// latencySum / acked = average
+};
+
+// connection to one broker
+struct mqtt_connection {
+	struct mosquitto *mosq;
+	int index;						// position in the broker list
+	std::string host;
+	unsigned int port;
+	std::atomic<bool> connected;
+	int inflight;					// unacknowledged QoS 1/2 messages
+
+	// topic aliases (protocol version 5)
+	mqtt_alias_slot *aliasIndex;	// open addressing index of assigned aliases
+	unsigned int aliasIndexMask;
+	std::string *aliasTopic;		// topic of each alias, [0] is unused
+	bool *aliasSent;				// the broker knows the alias
+	int aliasMax;					// granted by the broker
+	int aliasCount;					// assigned aliases
+	pthread_mutex_t aliasMutex;		// reset by the mosquitto thread on connect
+};
+
 class MQTT {
 public:
     // Constructor
@@ -32,15 +110,21 @@ public:
     ~MQTT();
 
     /**
-     * Connect to the MQTT broker
+     * Connect to all MQTT brokers which are not connected
      */
     void connect(void);
 
     /**
-     * Disconnect from the MQTT broker
+     * Disconnect from all MQTT brokers
      */
     void disconnect(void);
 
+    /**
+     * Disconnect from all MQTT brokers and stop the mosquitto threads
+     * no callback is called once this returns
+     */
+    void stop(void);
+
     /**
      * enable / disable console logging
      */
@@ -48,11 +132,14 @@ public:
 
     /**
      * register callback for connection status change
+     * the status is true while at least one broker is connected, a
+     * connection failure is reported while no broker is connected
      */
     void registerConnectionCallback(void (*callback) (bool));
 
     /**
      * register callback for topic update
+     * only messages of the active broker are passed on, one at a time
      */
     void registerTopicUpdateCallback(void (*callback) (const struct mosquitto_message*));
 
@@ -63,6 +150,14 @@ public:
      */
     void connect_callback(struct mosquitto *mosq, int result);
 
+    /**
+     * callback function for async connect with protocol version 5
+     * @param mosq: pointer to mosquitto structure
+     * @param result: connection result
+     * @param props: CONNACK properties
+     */
+    void connect_v5_callback(struct mosquitto *mosq, int result, const mosquitto_property *props);
+
     /**
      * callback function for disconnect
      * @param mosq: pointer to mosquitto structure
@@ -104,13 +199,44 @@ public:
 
     /**
      * publish topic
+     * Note: only to be used by one thread (topic aliases)
      * @param topic: the topic name to be published
-     * @param format: printf style format string
-     * @param value: the numeric value to publish
+     * @param value: the formatted value to publish
      * @param pubRetain: 
+     * @param expiry: [s] message expiry interval, 0 = none (protocol version 5 only)
+     * @param qos: quality of service [0..2]
      * @return: message ID, can be used for further tracking
+     *          MQTT_ERR_WINDOW_FULL if the in-flight window is full (qos > 0)
      */
-    int publish(const char* topic, const char* format, float value, bool pubRetain);
+    int publish(const char* topic, const char* value, bool pubRetain, uint32_t expiry = 0, int qos = 0);
+
+    /**
+     * publish topic with a timestamp
+     * the payload is {"value":<value>,"ts":<timestamp>}, with protocol
+     * version 5 the payload is the value and the timestamp is sent as
+     * user property "ts"
+     * Note: only to be used by one thread (topic aliases)
+     * @param topic: the topic name to be published
+     * @param value: the formatted value to publish
+     * @param timestamp: nanoseconds since the epoch
+     * @param pubRetain:
+     * @param expiry: [s] message expiry interval, 0 = none (protocol version 5 only)
+     * @param qos: quality of service [0..2]
+     * @return: message ID, can be used for further tracking
+     */
+    int publish(const char* topic, const char* value, int64_t timestamp, bool pubRetain, uint32_t expiry = 0, int qos = 0);
+
+    /**
+     * publish a preformatted payload
+     * does not use the internal buffer, may be called from a callback
+     * @param topic: the topic name to be published
+     * @param payload: the payload
+     * @param len: length of the payload
+     * @param pubRetain:
+     * @param qos: quality of service [0..2]
+     * @return: message ID, can be used for further tracking
+     */
+    int publishPayload(const char* topic, const char* payload, int len, bool pubRetain, int qos = 0);
 
 	/**
 	 * Clear retained message from mosquitto persistance store
@@ -119,9 +245,11 @@ public:
 	int clear_retained_message(const char* topic);
 
     /**
-     * subscribe to a topic
+     * subscribe to a topic on the active broker, the subscriptions move to
+     * the next broker on failover and are made again on every connect
      * @param topic: topic string
-     * @return: message ID, can be used for further tracking
+     * @return: message ID, can be used for further tracking,
+     * 0 if the topic is subscribed already
      */
     int subscribe(const char *topic);
 
@@ -133,14 +261,101 @@ public:
     int unsubscribe(const char *topic);
 
     /**
-     * get MQTT broker
+     * set the (first) MQTT broker
+     * @param newBroker: host name or address
+     * @param newPort: 0 = default port
+     * @return: 0 on success, negative number for error
+     */
+    int setBroker(const char *newBroker, unsigned int newPort = 0);
+
+    /**
+     * add a further MQTT broker, must be added before connecting
+     * @param host: host name or address
+     * @param newPort: 0 = default port
+     * @return: 0 on success, negative number for error
+     */
+    int addBroker(const char *host, unsigned int newPort = 0);
+
+    /**
+     * set how messages are published with several brokers
+     * @param mode: MQTT_BROKERS_FAILOVER (default) or MQTT_BROKERS_FANOUT
      * @return: 0 on success, negative number for error
      */
-    int setBroker(const char *newBroker);
+    int setBrokerMode(int mode);
+
+    /**
+     * get broker mode
+     */
+    int brokerMode(void);
+
+    /**
+     * get number of configured brokers
+     */
+    int brokerCount(void);
+
+    /**
+     * get number of connected brokers
+     */
+    int connectedCount(void);
+
+    /**
+     * set the keepalive interval, a broker which has gone away is detected
+     * within 1.5 times the interval, must be set before connecting
+     * @param seconds: keepalive interval
+     * @return: 0 on success, negative number for error
+     */
+    int setKeepalive(int seconds);
+
+    /**
+     * set MQTT protocol version, must be set before connecting
+     * @param version: 4 = MQTT 3.1.1 (default), 5 = MQTT 5
+     * @return: 0 on success, negative number for error
+     */
+    int setProtocolVersion(int version);
+
+    /**
+     * get MQTT protocol version
+     */
+    int protocolVersion(void);
+
+    /**
+     * get number of topic aliases granted by the active broker
+     * @return: 0 if topic aliases are not used
+     */
+    int topicAliasMax(void);
+
+    /**
+     * set the size of the in-flight window, must be set before connecting
+     * @param size: max unacknowledged QoS 1/2 messages
+     * @return: 0 on success, negative number for error
+     */
+    int setInflightMax(int size);
+
+    /**
+     * check if the in-flight window is full, QoS 1/2 messages would be rejected
+     * with MQTT_BROKERS_FANOUT the window of every connected broker counts
+     * messages which have not been acknowledged within MQTT_INFLIGHT_TIMEOUT
+     * are given up
+     */
+    bool isWindowFull(void);
+
+    /**
+     * register callback for the in-flight window, called from the mosquitto
+     * thread when an acknowledgement frees the window after it was full
+     */
+    void registerWindowCallback(void (*callback) (void));
+
+    /**
+     * get the acknowledgement statistics
+     * @param stats: receives the statistics
+     * @param reset: start a new measurement period (counters and latency)
+     */
+    void getAckStats(mqtt_ack_stats *stats, bool reset);
 
     /**
      * get MQTT broker
-     * @return: mqtt broker
+     * @return: the active (first connected) mqtt broker, the first
+     *          configured broker if none is connected
      */
     const char* broker(void);
 
@@ -152,8 +367,7 @@ public:
 
     /**
      * check connection status
-     * @param buffer: text storage buffer
-     * @returns: true if connection is established
+     * @returns: true if the connection to at least one broker is established
      */
     bool isConnected(void);
 
@@ -173,14 +387,45 @@ public:
 private:
     void (*connectionStatusCallback) (bool);     // callback for connection status change
     void (*topicUpdateCallback) (const struct mosquitto_message*);     // callback for topic update
+    void (*windowCallback) (void);     // callback for in-flight window no longer full
     void _construct (const char* clientID);
-
-    struct mosquitto *_mosq;
-    bool _connected;
-    char _pub_buf[100];
-    std::string _mqttBroker;
-    unsigned int _mqttPort;
+    mqtt_connection* _newConnection(const char* host, unsigned int newPort);
+    void _deleteConnection(mqtt_connection *conn);
+    mqtt_connection* _connection(struct mosquitto *mosq);
+    mqtt_connection* _activeConnection(void);
+    int _applyProtocolVersion(mqtt_connection *conn);
+    void _connectionChanged(mqtt_connection *conn, bool failed);
+    int _publishAll(const char* topic, const char* payload, int len, int64_t timestamp, bool pubRetain, uint32_t expiry, int qos, bool v5);
+    int _publishV5(mqtt_connection *conn, int *mid, const char* topic, const char* payload, int len, int64_t timestamp, bool pubRetain, uint32_t expiry, int qos);
+    int _send(mqtt_connection *conn, int *mid, const char* topic, int len, const void* payload, int qos, bool pubRetain, const mosquitto_property *props);
+    bool _windowFull(mqtt_connection *conn, int64_t now);
+    mqtt_inflight* _inflightSlot(int mid);
+    void _inflightRemove(mqtt_inflight *slot);
+    void _inflightExpire(int64_t now);
+    static int64_t _now(void);
+    uint16_t _topicAlias(mqtt_connection *conn, const char* topic, bool *known);
+    void _resetAliases(mqtt_connection *conn, int aliasMax);
+
+    std::string _clientID;
+    mqtt_connection *_conns[MQTT_BROKERS_MAX];	// broker list
+    int _connCount;
+    std::atomic<int> _active;		// index of the active connection, -1 = none connected
+    int _mode;						// MQTT_BROKERS_FAILOVER or MQTT_BROKERS_FANOUT
+    bool _started;					// connect() was called, no more brokers can be added
+    pthread_mutex_t _connMutex;		// connection changes of the mosquitto threads (recursive)
+    std::set<std::string> _subscriptions;	// subscribed on the active broker
+    pthread_mutex_t _messageMutex;	// topic update callbacks don't run concurrently
+    char _pub_buf[128];
     int _mqttKeepalive;
+    int _protocolVersion;
+
+    // in-flight window of QoS 1/2 messages, shared with the mosquitto threads
+    pthread_mutex_t _inflightMutex;
+    mqtt_inflight *_inflight;		// open addressing table keyed by message ID and connection
+    unsigned int _inflightMask;
+    int _inflightMax;				// window size per connection
+    bool _windowWasFull;			// a publish was rejected since the last acknowledgement
+    mqtt_ack_stats _ackStats;
 
     bool _console_log_enable;    // for mosqitto logging
 
@@ -0,0 +1,382 @@
+/**
+ * @file pubqueue.cpp
+ *
+ * https://github.com/helioz2000/1820bridge
+ *
+ * Author: Erwin Bejsta
+ * August 2020
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include "pubqueue.h"
+#include "1820tag.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+/*********************
+ * MEMBER FUNCTIONS
+ *********************/
+
+PubQueue::PubQueue() {
+	_policy = PUBQUEUE_OLDEST;
+	_count = 0;
+	_dropped = 0;
+	_mem = NULL;
+	_memSize = 0;
+	_memHead = 0;
+	_memTail = 0;
+	_memUsed = 0;
+	_journalFd = -1;
+	_journal = NULL;
+	_journalData = NULL;
+	_journalMapSize = 0;
+	_journalCount = 0;
+	_latest = NULL;
+	_latestMask = 0;
+	_latestUsed = 0;
+	_latestCursor = 0;
+	_latestBytes = 0;
+}
+
+PubQueue::~PubQueue() {
+	if (_journal != NULL) munmap(_journal, _journalMapSize);
+	if (_journalFd >= 0) close(_journalFd);
+	delete [] _mem;
+	delete [] _latest;
+}
+
+int PubQueue::create(int policy, int memorySize, const char *journalPath, int journalSize) {
+	if ((_mem != NULL) || (_latest != NULL) || (memorySize <= 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	_policy = policy;
+	// records are 8 byte aligned
+	_memSize = memorySize & ~7;
+	if (_policy == PUBQUEUE_LATEST) {
+		_latest = new pubqueue_slot[PUBQUEUE_LATEST_INITIAL_SIZE];
+		_latestMask = PUBQUEUE_LATEST_INITIAL_SIZE - 1;
+		for (unsigned int i = 0; i <= _latestMask; i++) _latest[i].pending = false;
+		return 0;
+	}
+	_mem = new char[_memSize];
+	if ((journalPath != NULL) && (journalPath[0] != 0)) {
+		if (_journalOpen(journalPath, journalSize) < 0) return -1;
+	}
+	return 0;
+}
+
+bool PubQueue::push(const char *topic, const char *payload, int len, int64_t time, bool raw, int qos) {
+	int topicLen = strlen(topic);
+	bool result;
+
+	if (topicLen > UINT16_MAX) return false;
+	if (_policy == PUBQUEUE_LATEST) {
+		result = _latestPush(topic, topicLen, payload, len, time, raw, qos);
+	} else if ((_journal != NULL) && (_journal->head != _journal->tail)) {
+		// keep the order while the journal is in use
+		result = _journalPush(topic, topicLen, payload, len, time, raw, qos);
+	} else {
+		result = _memPush(topic, topicLen, payload, len, time, raw, qos);
+		if (!result && (_journal != NULL))
+			result = _journalPush(topic, topicLen, payload, len, time, raw, qos);
+	}
+	if (!result) {
+		_dropped++;
+		return false;
+	}
+	return true;
+}
+
+bool PubQueue::pop(pubqueue_entry *entry) {
+	if (_count == 0) return false;
+	if (_policy == PUBQUEUE_LATEST) return _latestPop(entry);
+	// the memory buffer holds the oldest messages
+	if (_memPop(entry)) return true;
+	return _journalPop(entry);
+}
+
+int PubQueue::count(void) {
+	return _count;
+}
+
+uint64_t PubQueue::dropped(void) {
+	return _dropped;
+}
+
+int PubQueue::journalCount(void) {
+	return _journalCount;
+}
+
+/*********************
+ * PRIVATE FUNCTIONS
+ *********************/
+
+uint32_t PubQueue::_recordSize(int topicLen, int payloadLen) {
+	return (sizeof(pubqueue_record) + topicLen + payloadLen + 7) & ~7;
+}
+
+void PubQueue::_writeRecord(char *dst, const char *topic, int topicLen, const char *payload, int len, int64_t time, bool raw, int qos, uint32_t size) {
+	pubqueue_record *record = (pubqueue_record *)dst;
+	record->size = size;
+	record->payloadLen = len;
+	record->topicLen = topicLen;
+	record->raw = raw;
+	record->qos = qos;
+	record->reserved = 0;
+	record->time = time;
+	memcpy(dst + sizeof(pubqueue_record), topic, topicLen);
+	memcpy(dst + sizeof(pubqueue_record) + topicLen, payload, len);
+}
+
+void PubQueue::_readRecord(const char *src, pubqueue_entry *entry) {
+	const pubqueue_record *record = (const pubqueue_record *)src;
+	entry->topic.assign(src + sizeof(pubqueue_record), record->topicLen);
+	entry->payload.assign(src + sizeof(pubqueue_record) + record->topicLen, record->payloadLen);
+	entry->time = record->time;
+	entry->raw = (record->raw != 0);
+	entry->qos = record->qos;
+}
+
+bool PubQueue::_memPush(const char *topic, int topicLen, const char *payload, int len, int64_t time, bool raw, int qos) {
+	uint32_t size = _recordSize(topicLen, len);
+	uint64_t end = _memSize - _memTail;		// bytes up to the end of the buffer
+	uint64_t wrap = 0;
+
+	// a record is never split, continue at the start if it doesn't fit
+	if (size > end) wrap = end;
+	if (_memUsed + wrap + size > _memSize) return false;
+	if (wrap > 0) {
+		// the record header doesn't fit either, pop skips the gap
+		if (end >= sizeof(pubqueue_record)) ((pubqueue_record *)&_mem[_memTail])->size = 0;
+		_memTail = 0;
+		_memUsed += wrap;
+	}
+	_writeRecord(&_mem[_memTail], topic, topicLen, payload, len, time, raw, qos, size);
+	_memTail += size;
+	if (_memTail >= _memSize) _memTail = 0;
+	_memUsed += size;
+	_count++;
+	return true;
+}
+
+bool PubQueue::_memPop(pubqueue_entry *entry) {
+	uint64_t end;
+	pubqueue_record *record;
+
+	if (_memUsed == 0) return false;
+	end = _memSize - _memHead;
+	if ((end < sizeof(pubqueue_record)) || (((pubqueue_record *)&_mem[_memHead])->size == 0)) {
+		// skip the gap at the end of the buffer
+		_memUsed -= end;
+		_memHead = 0;
+	}
+	record = (pubqueue_record *)&_mem[_memHead];
+	_readRecord(&_mem[_memHead], entry);
+	_memHead += record->size;
+	if (_memHead >= _memSize) _memHead = 0;
+	_memUsed -= record->size;
+	if (_memUsed == 0) {
+		_memHead = 0;
+		_memTail = 0;
+	}
+	_count--;
+	return true;
+}
+
+bool PubQueue::_journalPush(const char *topic, int topicLen, const char *payload, int len, int64_t time, bool raw, int qos) {
+	uint32_t size = _recordSize(topicLen, len);
+
+	// append-only, full until it has been emptied
+	if (_journal->tail + size > _journal->size) return false;
+	_writeRecord(&_journalData[_journal->tail], topic, topicLen, payload, len, time, raw, qos, size);
+	// the record is complete before it becomes visible
+	_journal->tail += size;
+	_journalCount++;
+	_count++;
+	return true;
+}
+
+bool PubQueue::_journalPop(pubqueue_entry *entry) {
+	pubqueue_record *record;
+
+	if ((_journal == NULL) || (_journal->head == _journal->tail)) return false;
+	record = (pubqueue_record *)&_journalData[_journal->head];
+	_readRecord(&_journalData[_journal->head], entry);
+	_journal->head += record->size;
+	if (_journal->head >= _journal->tail) {
+		// empty, start again at the beginning
+		_journal->head = 0;
+		_journal->tail = 0;
+	}
+	_journalCount--;
+	_count--;
+	return true;
+}
+
+/**
+ * open or create the journal file and map it
+ * @returns 0 if successful, -1 on failure
+ */
+int PubQueue::_journalOpen(const char *path, int size) {
+	struct stat st;
+	bool valid;
+	int err;
+
+	if (size <= (int)sizeof(pubqueue_journal)) {
+		errno = EINVAL;
+		return -1;
+	}
+	_journalFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (_journalFd < 0) return -1;
+	_journalMapSize = size & ~7;
+	if ((fstat(_journalFd, &st) < 0) || ((st.st_size != (off_t)_journalMapSize) && (ftruncate(_journalFd, _journalMapSize) < 0))) {
+		err = errno;
+		close(_journalFd);
+		_journalFd = -1;
+		errno = err;
+		return -1;
+	}
+	_journal = (pubqueue_journal *)mmap(NULL, _journalMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, _journalFd, 0);
+	if (_journal == MAP_FAILED) {
+		err = errno;
+		_journal = NULL;
+		close(_journalFd);
+		_journalFd = -1;
+		errno = err;
+		return -1;
+	}
+	_journalData = (char *)_journal + sizeof(pubqueue_journal);
+	// keep the messages of a previous run if the journal is intact
+	valid = (st.st_size == (off_t)_journalMapSize) && (_journal->magic == PUBQUEUE_JOURNAL_MAGIC)
+		&& (_journal->headerSize == sizeof(pubqueue_journal))
+		&& (_journal->size == _journalMapSize - sizeof(pubqueue_journal))
+		&& (_journal->head <= _journal->tail) && (_journal->tail <= _journal->size);
+	if (!valid) {
+		_journal->magic = PUBQUEUE_JOURNAL_MAGIC;
+		_journal->headerSize = sizeof(pubqueue_journal);
+		_journal->size = _journalMapSize - sizeof(pubqueue_journal);
+		_journal->head = 0;
+		_journal->tail = 0;
+	}
+	_journalScan();
+	return 0;
+}
+
+/**
+ * count the records left in the journal, a damaged record ends the journal
+ */
+void PubQueue::_journalScan(void) {
+	uint64_t pos = _journal->head;
+	pubqueue_record *record;
+
+	_journalCount = 0;
+	while (pos < _journal->tail) {
+		record = (pubqueue_record *)&_journalData[pos];
+		if ((_journal->tail - pos < sizeof(pubqueue_record)) || (record->size == 0)
+			|| (record->size != _recordSize(record->topicLen, record->payloadLen))
+			|| (record->size > _journal->tail - pos))
+			break;
+		pos += record->size;
+		_journalCount++;
+	}
+	_journal->tail = pos;
+	if (_journal->head == _journal->tail) {
+		_journal->head = 0;
+		_journal->tail = 0;
+	}
+	_count += _journalCount;
+}
+
+bool PubQueue::_latestPush(const char *topic, int topicLen, const char *payload, int len, int64_t time, bool raw, int qos) {
+	string_view topicView(topic, topicLen);
+	uint32_t hash = topic_hash(topicView);
+	unsigned int pos = hash & _latestMask;
+	pubqueue_slot *slot;
+	uint64_t bytes;
+
+	while (!_latest[pos].entry.topic.empty()) {
+		if ((_latest[pos].hash == hash) && (_latest[pos].entry.topic == topicView)) break;
+		pos = (pos + 1) & _latestMask;
+	}
+	slot = &_latest[pos];
+	bytes = _latestBytes + len;
+	if (slot->entry.topic.empty())
+		bytes += topicLen;
+	else
+		bytes -= slot->entry.payload.length();
+	if (bytes > _memSize) return false;
+	_latestBytes = bytes;
+	if (slot->entry.topic.empty()) {
+		slot->hash = hash;
+		slot->entry.topic.assign(topic, topicLen);
+		_latestUsed++;
+	}
+	slot->entry.payload.assign(payload, len);
+	slot->entry.time = time;
+	slot->entry.raw = raw;
+	slot->entry.qos = qos;
+	if (!slot->pending) {
+		slot->pending = true;
+		_count++;
+	}
+	// keep the table at most half full
+	if ((unsigned int)_latestUsed * 2 > _latestMask) _latestGrow();
+	return true;
+}
+
+bool PubQueue::_latestPop(pubqueue_entry *entry) {
+	pubqueue_slot *slot;
+
+	for (unsigned int i = 0; i <= _latestMask; i++) {
+		slot = &_latest[_latestCursor];
+		_latestCursor = (_latestCursor + 1) & _latestMask;
+		if (!slot->pending) continue;
+		*entry = slot->entry;
+		slot->pending = false;
+		if (--_count == 0) {
+			// all published, forget the topics
+			for (unsigned int j = 0; j <= _latestMask; j++) {
+				_latest[j].entry.topic.clear();
+				_latest[j].entry.payload.clear();
+			}
+			_latestUsed = 0;
+			_latestBytes = 0;
+			_latestCursor = 0;
+		}
+		return true;
+	}
+	return false;
+}
+
+/**
+ * double the size of the latest table and rehash the topics
+ */
+void PubQueue::_latestGrow(void) {
+	pubqueue_slot *old = _latest;
+	unsigned int oldMask = _latestMask, pos;
+
+	_latestMask = (_latestMask * 2) + 1;
+	_latest = new pubqueue_slot[_latestMask + 1];
+	for (unsigned int i = 0; i <= _latestMask; i++) _latest[i].pending = false;
+	for (unsigned int i = 0; i <= oldMask; i++) {
+		if (old[i].entry.topic.empty()) continue;
+		pos = old[i].hash & _latestMask;
+		while (!_latest[pos].entry.topic.empty()) pos = (pos + 1) & _latestMask;
+		_latest[pos].hash = old[i].hash;
+		_latest[pos].pending = old[i].pending;
+		_latest[pos].entry = std::move(old[i].entry);
+	}
+	_latestCursor = 0;
+	delete [] old;
+}
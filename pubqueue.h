@@ -0,0 +1,169 @@
+/**
+ * @file pubqueue.h
+-----------------------------------------------------------------------------
+ The PubQueue class keeps messages which can't be published while the
+ MQTT broker is not connected, until they can be published after a
+ reconnect. Each entry keeps the time of its sample and the QoS it is
+ published with.
+ Two policies are supported:
+ PUBQUEUE_OLDEST keeps every message in the order it was queued. Messages
+ are kept in a memory ring buffer first, when it is full they spill to an
+ append-only journal file (mmap'd) which survives a restart of the
+ bridge. Once the journal is used, new messages are appended to it until
+ it is empty again, so the order is kept. When both are full new messages
+ are dropped.
+ PUBQUEUE_LATEST keeps only the most recent message of each topic in
+ memory, the journal is not used.
+ The queue is not thread safe, it is used by the publishing thread only.
+-----------------------------------------------------------------------------
+*/
+
+#ifndef _PUBQUEUE_H_
+#define _PUBQUEUE_H_
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+
+#include <string>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define PUBQUEUE_OLDEST 0				// all messages, oldest first
+#define PUBQUEUE_LATEST 1				// latest message of each topic only
+#define PUBQUEUE_LATEST_INITIAL_SIZE 64	// initial number of topics (power of 2)
+#define PUBQUEUE_JOURNAL_MAGIC 0x31385051	// "QP81"
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+// a queued message
+struct pubqueue_entry {
+	std::string topic;
+	std::string payload;
+	int64_t time;				// [ns] CLOCK_REALTIME of the sample
+	bool raw;					// publish the payload as is, otherwise it's a value published with its time
+	int qos;					// QoS of the message
+};
+
+// header of a message in the memory buffer and in the journal
+struct pubqueue_record {
+	uint32_t size;				// record size including header, multiple of 8, 0 = wrap marker
+	uint32_t payloadLen;
+	uint16_t topicLen;
+	uint16_t raw;
+	uint16_t qos;
+	uint16_t reserved;
+	int64_t time;
+};
+
+// header of the journal file
+struct pubqueue_journal {
+	uint32_t magic;
+	uint32_t headerSize;		// sizeof(pubqueue_journal)
+	uint64_t size;				// size of the data area
+	uint64_t head;				// offset of the oldest record
+	uint64_t tail;				// offset after the newest record
+};
+
+// latest message of a topic
+struct pubqueue_slot {
+	uint32_t hash;				// topic hash
+	bool pending;				// not published yet
+	pubqueue_entry entry;		// entry.topic is empty for an unused slot
+};
+
+/**********************
+ *      CLASS
+ **********************/
+
+class PubQueue {
+public:
+	PubQueue();
+	~PubQueue();
+
+	/**
+	 * Create the queue
+	 * @param policy: PUBQUEUE_OLDEST or PUBQUEUE_LATEST
+	 * @param memorySize: [bytes] size of the memory buffer
+	 * @param journalPath: journal file (PUBQUEUE_OLDEST only), NULL or "" = none
+	 * @param journalSize: [bytes] max size of the journal
+	 * @returns 0 if successful, -1 on failure (errno is set)
+	 * Note: messages left in an existing journal of the same size are kept
+	 */
+	int create(int policy, int memorySize, const char *journalPath, int journalSize);
+
+	/**
+	 * Queue a message
+	 * @param topic: the topic
+	 * @param payload: the payload (value) with len bytes
+	 * @param time: [ns] CLOCK_REALTIME of the sample
+	 * @param raw: the payload is published as is
+	 * @param qos: QoS to publish the message with
+	 * @returns false if the queue is full and the message was dropped
+	 */
+	bool push(const char *topic, const char *payload, int len, int64_t time, bool raw, int qos);
+
+	/**
+	 * Take the oldest message from the queue
+	 * @param entry: receives the message
+	 * @returns false if the queue is empty
+	 */
+	bool pop(pubqueue_entry *entry);
+
+	/**
+	 * @returns number of queued messages
+	 */
+	int count(void);
+
+	/**
+	 * @returns number of messages dropped because the queue was full
+	 */
+	uint64_t dropped(void);
+
+	/**
+	 * @returns number of queued messages in the journal
+	 */
+	int journalCount(void);
+
+private:
+	uint32_t _recordSize(int topicLen, int payloadLen);
+	void _writeRecord(char *dst, const char *topic, int topicLen, const char *payload, int len, int64_t time, bool raw, int qos, uint32_t size);
+	void _readRecord(const char *src, pubqueue_entry *entry);
+	bool _memPush(const char *topic, int topicLen, const char *payload, int len, int64_t time, bool raw, int qos);
+	bool _memPop(pubqueue_entry *entry);
+	bool _journalPush(const char *topic, int topicLen, const char *payload, int len, int64_t time, bool raw, int qos);
+	bool _journalPop(pubqueue_entry *entry);
+	int _journalOpen(const char *path, int size);
+	void _journalScan(void);
+	bool _latestPush(const char *topic, int topicLen, const char *payload, int len, int64_t time, bool raw, int qos);
+	bool _latestPop(pubqueue_entry *entry);
+	void _latestGrow(void);
+
+	int _policy;
+	int _count;					// queued messages
+	uint64_t _dropped;
+	// memory ring buffer
+	char *_mem;
+	uint64_t _memSize;
+	uint64_t _memHead;			// offset of the oldest record
+	uint64_t _memTail;			// offset of the next record
+	uint64_t _memUsed;			// bytes used including wrap gaps
+	// journal
+	int _journalFd;
+	pubqueue_journal *_journal;	// mmap'd journal file, NULL = none
+	char *_journalData;			// data area of the journal
+	size_t _journalMapSize;
+	int _journalCount;			// messages in the journal
+	// latest message of each topic
+	pubqueue_slot *_latest;
+	uint32_t _latestMask;		// table size - 1
+	int _latestUsed;			// used slots
+	uint32_t _latestCursor;		// next slot to publish
+	uint64_t _latestBytes;		// topic and payload bytes of used slots
+};
+
+#endif /* _PUBQUEUE_H_ */
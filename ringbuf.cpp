@@ -0,0 +1,134 @@
+/**
+ * @file ringbuf.cpp
+ *
+ * https://github.com/helioz2000/1820bridge
+ *
+ * Author: Erwin Bejsta
+ * August 2020
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include "ringbuf.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+/*********************
+ * MEMBER FUNCTIONS
+ *********************/
+
+RingBuffer::RingBuffer() {
+	throw runtime_error("Class RingBuffer - forbidden constructor");
+}
+
+RingBuffer::RingBuffer(unsigned int size) {
+	if ((size == 0) || ((size & (size - 1)) != 0)) {
+		throw invalid_argument("Class RingBuffer - size must be a power of 2");
+	}
+	_buf = new uint8_t[size];
+	_size = size;
+	_mask = size - 1;
+	_head = 0;
+	_tail = 0;
+}
+
+RingBuffer::~RingBuffer() {
+	delete [] _buf;
+}
+
+int RingBuffer::fill(int fd) {
+	struct iovec iov[2];
+	int iovcnt = 0;
+	unsigned int free = space();
+	unsigned int pos = _head & _mask;
+	unsigned int firstLen;
+	ssize_t rdlen;
+
+	if (free == 0) return 0;
+	// free space may wrap around the end of the buffer
+	firstLen = _size - pos;
+	if (firstLen > free) firstLen = free;
+	iov[iovcnt].iov_base = &_buf[pos];
+	iov[iovcnt].iov_len = firstLen;
+	iovcnt++;
+	if (free > firstLen) {
+		iov[iovcnt].iov_base = &_buf[0];
+		iov[iovcnt].iov_len = free - firstLen;
+		iovcnt++;
+	}
+	rdlen = readv(fd, iov, iovcnt);
+	if (rdlen > 0) _head += rdlen;
+	return (int)rdlen;
+}
+
+unsigned int RingBuffer::write(const void *data, unsigned int len) {
+	const uint8_t *src = (const uint8_t *)data;
+	unsigned int pos, firstLen;
+	if (len > space()) len = space();
+	pos = _head & _mask;
+	firstLen = _size - pos;
+	if (firstLen > len) firstLen = len;
+	memcpy(&_buf[pos], src, firstLen);
+	memcpy(&_buf[0], src + firstLen, len - firstLen);
+	_head += len;
+	return len;
+}
+
+int RingBuffer::find(uint8_t byte) {
+	unsigned int len = used();
+	unsigned int pos = _tail & _mask;
+	unsigned int firstLen = _size - pos;
+	const uint8_t *found;
+
+	if (firstLen > len) firstLen = len;
+	found = (const uint8_t *)memchr(&_buf[pos], byte, firstLen);
+	if (found != NULL) return (int)(found - &_buf[pos]);
+	if (len > firstLen) {
+		found = (const uint8_t *)memchr(&_buf[0], byte, len - firstLen);
+		if (found != NULL) return (int)(firstLen + (found - &_buf[0]));
+	}
+	return -1;
+}
+
+uint8_t RingBuffer::peek(unsigned int offset) {
+	return _buf[(_tail + offset) & _mask];
+}
+
+unsigned int RingBuffer::copy(void *dst, unsigned int len) {
+	uint8_t *d = (uint8_t *)dst;
+	unsigned int pos, firstLen;
+	if (len > used()) len = used();
+	pos = _tail & _mask;
+	firstLen = _size - pos;
+	if (firstLen > len) firstLen = len;
+	memcpy(d, &_buf[pos], firstLen);
+	memcpy(d + firstLen, &_buf[0], len - firstLen);
+	return len;
+}
+
+void RingBuffer::consume(unsigned int len) {
+	if (len > used()) len = used();
+	_tail += len;
+}
+
+void RingBuffer::clear(void) {
+	_tail = _head;
+}
+
+unsigned int RingBuffer::used(void) {
+	return _head - _tail;
+}
+
+unsigned int RingBuffer::space(void) {
+	return _size - used();
+}
@@ -0,0 +1,96 @@
+/**
+ * @file ringbuf.h
+-----------------------------------------------------------------------------
+ The RingBuffer class provides a fixed size byte ring buffer which is
+ filled directly from a file descriptor. All bytes available on the
+ file descriptor are read with a single readv() call, even when the
+ free space wraps around the end of the buffer.
+-----------------------------------------------------------------------------
+*/
+
+#ifndef _RINGBUF_H_
+#define _RINGBUF_H_
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+
+/**********************
+ *      CLASS
+ **********************/
+
+class RingBuffer {
+public:
+	RingBuffer();		// empty constructor throws error
+
+	/**
+	 * Constructor
+	 * @param size: buffer size in bytes, must be a power of 2
+	 */
+	RingBuffer(unsigned int size);
+	~RingBuffer();
+
+	/**
+	 * Read all available bytes from a file descriptor
+	 * @param fd: the file descriptor to read from
+	 * @returns number of bytes read, 0 on EOF or if the buffer is full,
+	 * -1 on failure (errno is set, EAGAIN if no data was available)
+	 */
+	int fill(int fd);
+
+	/**
+	 * Append bytes to the buffer
+	 * @returns number of bytes stored
+	 */
+	unsigned int write(const void *data, unsigned int len);
+
+	/**
+	 * Find the first occurrence of a byte
+	 * @returns offset from the start of stored data, or -1 if not found
+	 */
+	int find(uint8_t byte);
+
+	/**
+	 * Get a byte without removing it
+	 * @param offset: offset from the start of stored data
+	 */
+	uint8_t peek(unsigned int offset);
+
+	/**
+	 * Copy bytes without removing them
+	 * @param dst: destination buffer
+	 * @param len: number of bytes to copy
+	 * @returns number of bytes copied
+	 */
+	unsigned int copy(void *dst, unsigned int len);
+
+	/**
+	 * Remove bytes from the start of stored data
+	 */
+	void consume(unsigned int len);
+
+	/**
+	 * Remove all stored data
+	 */
+	void clear(void);
+
+	/**
+	 * @returns the number of bytes stored
+	 */
+	unsigned int used(void);
+
+	/**
+	 * @returns the number of free bytes
+	 */
+	unsigned int space(void);
+
+private:
+	uint8_t *_buf;
+	unsigned int _size;
+	unsigned int _mask;
+	unsigned int _head;		// write position (free running)
+	unsigned int _tail;		// read position (free running)
+};
+
+#endif /* _RINGBUF_H_ */
@@ -0,0 +1,228 @@
+/**
+ * @file scheduler.cpp
+ *
+ * https://github.com/helioz2000/1820bridge
+ *
+ * Author: Erwin Bejsta
+ * August 2020
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include "scheduler.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+/*********************
+ *      DEFINES
+ *********************/
+#define NSEC_PER_SEC 1000000000LL
+
+/*********************
+ * MEMBER FUNCTIONS
+ *********************/
+
+Scheduler::Scheduler() {
+	_timerCount = 0;
+	_timerSize = SCHEDULER_INITIAL_SIZE;
+	_timers = new scheduler_timer[_timerSize];
+	_heap = new int[_timerSize];
+	_heapCount = 0;
+	_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (_timerFd < 0) {
+		delete [] _timers;
+		delete [] _heap;
+		throw runtime_error("Class Scheduler - timerfd_create failed");
+	}
+	_wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_wakeupFd < 0) {
+		close(_timerFd);
+		delete [] _timers;
+		delete [] _heap;
+		throw runtime_error("Class Scheduler - eventfd failed");
+	}
+}
+
+Scheduler::~Scheduler() {
+	close(_wakeupFd);
+	close(_timerFd);
+	delete [] _timers;
+	delete [] _heap;
+}
+
+int Scheduler::addTimer(void (*callback) (int, int64_t), int arg) {
+	scheduler_timer *timers;
+	int *heap;
+	if (_timerCount >= _timerSize) {
+		// double the size, the heap holds at most all timers
+		timers = new scheduler_timer[_timerSize * 2];
+		heap = new int[_timerSize * 2];
+		memcpy(timers, _timers, _timerCount * sizeof(scheduler_timer));
+		memcpy(heap, _heap, _heapCount * sizeof(int));
+		delete [] _timers;
+		delete [] _heap;
+		_timers = timers;
+		_heap = heap;
+		_timerSize *= 2;
+	}
+	_timers[_timerCount].deadline = 0;
+	_timers[_timerCount].interval = 0;
+	_timers[_timerCount].callback = callback;
+	_timers[_timerCount].arg = arg;
+	_timers[_timerCount].heapPos = -1;
+	return _timerCount++;
+}
+
+void Scheduler::start(int id, int64_t deadline, int64_t interval) {
+	if ((id < 0) || (id >= _timerCount)) return;
+	_remove(id);
+	_timers[id].deadline = deadline;
+	_timers[id].interval = (interval > 0) ? interval : 0;
+	_place(_heapCount++, id);
+	_siftUp(_timers[id].heapPos);
+	_arm();
+}
+
+void Scheduler::stop(int id) {
+	if ((id < 0) || (id >= _timerCount)) return;
+	_remove(id);
+	_arm();
+}
+
+bool Scheduler::isActive(int id) {
+	if ((id < 0) || (id >= _timerCount)) return false;
+	return (_timers[id].heapPos >= 0);
+}
+
+int Scheduler::wait(void) {
+	struct pollfd fds[2];
+	uint64_t counter;
+	int64_t now;
+	int id, count = 0;
+	scheduler_timer *timer;
+
+	fds[0].fd = _timerFd;
+	fds[0].events = POLLIN;
+	fds[1].fd = _wakeupFd;
+	fds[1].events = POLLIN;
+	// no timeout, the timerfd fires at the earliest deadline
+	if (poll(fds, 2, -1) < 0) {
+		if (errno == EINTR) return 0;
+		fprintf(stderr, "%s: poll failed: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	if (fds[1].revents & POLLIN) {
+		// reset eventfd counter
+		if (read(_wakeupFd, &counter, sizeof(counter)) < 0) {}
+	}
+	if (!(fds[0].revents & POLLIN)) return 0;
+	if (read(_timerFd, &counter, sizeof(counter)) < 0) {}
+
+	now = Scheduler::now();
+	while ((_heapCount > 0) && (_timers[_heap[0]].deadline <= now)) {
+		id = _heap[0];
+		timer = &_timers[id];
+		if (timer->interval > 0) {
+			// keep the phase of a periodic timer, skip missed periods
+			timer->deadline += timer->interval;
+			if (timer->deadline <= now)
+				timer->deadline += ((now - timer->deadline) / timer->interval + 1) * timer->interval;
+			_siftDown(0);
+		} else {
+			_remove(id);
+		}
+		// the callback may start or stop any timer
+		(*timer->callback) (timer->arg, now);
+		count++;
+	}
+	_arm();
+	return count;
+}
+
+void Scheduler::wakeup(void) {
+	uint64_t counter = 1;
+	if (write(_wakeupFd, &counter, sizeof(counter)) < 0) {}
+}
+
+int64_t Scheduler::now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec;
+}
+
+/*********************
+ * PRIVATE FUNCTIONS
+ *********************/
+
+/**
+ * arm the timerfd with the earliest deadline, disarm if no timer is active
+ */
+void Scheduler::_arm(void) {
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	if (_heapCount > 0) {
+		spec.it_value.tv_sec = _timers[_heap[0]].deadline / NSEC_PER_SEC;
+		spec.it_value.tv_nsec = _timers[_heap[0]].deadline % NSEC_PER_SEC;
+		// a zero it_value would disarm the timer
+		if ((spec.it_value.tv_sec == 0) && (spec.it_value.tv_nsec == 0))
+			spec.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(_timerFd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+		fprintf(stderr, "%s: timerfd_settime failed: %s\n", __func__, strerror(errno));
+	}
+}
+
+/**
+ * remove a timer from the heap if it is active
+ */
+void Scheduler::_remove(int id) {
+	int pos = _timers[id].heapPos;
+	if (pos < 0) return;
+	_timers[id].heapPos = -1;
+	if (--_heapCount == pos) return;
+	// fill the gap with the last entry
+	_place(pos, _heap[_heapCount]);
+	_siftDown(pos);
+	_siftUp(_timers[_heap[pos]].heapPos);
+}
+
+void Scheduler::_place(int pos, int id) {
+	_heap[pos] = id;
+	_timers[id].heapPos = pos;
+}
+
+void Scheduler::_siftUp(int pos) {
+	int id = _heap[pos], parent;
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (_timers[_heap[parent]].deadline <= _timers[id].deadline) break;
+		_place(pos, _heap[parent]);
+		pos = parent;
+	}
+	_place(pos, id);
+}
+
+void Scheduler::_siftDown(int pos) {
+	int id = _heap[pos], child;
+	while ((child = (pos * 2) + 1) < _heapCount) {
+		if ((child + 1 < _heapCount) && (_timers[_heap[child + 1]].deadline < _timers[_heap[child]].deadline))
+			child++;
+		if (_timers[id].deadline <= _timers[_heap[child]].deadline) break;
+		_place(pos, _heap[child]);
+		pos = child;
+	}
+	_place(pos, id);
+}
@@ -0,0 +1,112 @@
+/**
+ * @file scheduler.h
+-----------------------------------------------------------------------------
+ The Scheduler class runs callbacks at deadlines on CLOCK_MONOTONIC.
+ All pending deadlines are kept in a binary min-heap, a timerfd is armed
+ with the earliest deadline, so the waiting thread only wakes up when a
+ timer is due. Timers can be one-shot or periodic, periodic timers are
+ rescheduled from their previous deadline and don't drift.
+ A timer is identified by the index returned by addTimer(), it can be
+ (re-)started with a new deadline or stopped at any time, each in
+ O(log n). An eventfd allows another thread or a signal handler to wake
+ the waiting thread immediately.
+ Timers must only be added, started and stopped by the waiting thread
+ (e.g. from a timer callback).
+-----------------------------------------------------------------------------
+*/
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define SCHEDULER_INITIAL_SIZE 16	// initial number of timers
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+struct scheduler_timer {
+	int64_t deadline;			// [ns] CLOCK_MONOTONIC
+	int64_t interval;			// [ns], 0 = one-shot
+	void (*callback) (int, int64_t);	// called with arg and the current time
+	int arg;
+	int heapPos;				// position in heap, -1 = not active
+};
+
+/**********************
+ *      CLASS
+ **********************/
+
+class Scheduler {
+public:
+	Scheduler();
+	~Scheduler();
+
+	/**
+	 * Add a timer, the timer is not active until it is started
+	 * @param callback: called with arg and the current time [ns] when the timer is due
+	 * @param arg: passed to the callback
+	 * @returns the timer id
+	 */
+	int addTimer(void (*callback) (int, int64_t), int arg);
+
+	/**
+	 * Start or restart a timer
+	 * @param id: the timer id
+	 * @param deadline: [ns] CLOCK_MONOTONIC
+	 * @param interval: [ns] period of the timer, 0 = one-shot
+	 */
+	void start(int id, int64_t deadline, int64_t interval);
+
+	/**
+	 * Stop a timer
+	 */
+	void stop(int id);
+
+	/**
+	 * @returns true if the timer is started
+	 */
+	bool isActive(int id);
+
+	/**
+	 * Wait for the next due timer and run the callbacks of all due timers
+	 * @returns number of callbacks run, -1 on failure
+	 * Note: returns with 0 after wakeup() was called or on a signal
+	 */
+	int wait(void);
+
+	/**
+	 * Wake up the thread waiting in wait()
+	 * Note: this function is async-signal-safe
+	 */
+	void wakeup(void);
+
+	/**
+	 * @returns current time [ns] CLOCK_MONOTONIC
+	 */
+	static int64_t now(void);
+
+private:
+	void _arm(void);
+	void _remove(int id);
+	void _place(int pos, int id);
+	void _siftUp(int pos);
+	void _siftDown(int pos);
+
+	scheduler_timer *_timers;
+	int _timerCount;
+	int _timerSize;				// size of _timers and _heap
+	int *_heap;					// timer ids, earliest deadline first
+	int _heapCount;
+	int _timerFd;
+	int _wakeupFd;
+};
+
+#endif /* _SCHEDULER_H_ */
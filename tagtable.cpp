@@ -0,0 +1,307 @@
+/**
+ * @file tagtable.cpp
+ *
+ * https://github.com/helioz2000/1820bridge
+ *
+ * Author: Erwin Bejsta
+ * August 2020
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include "tagtable.h"
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+/*********************
+ *      DEFINES
+ *********************/
+#define NSEC_PER_SEC 1000000000LL
+
+/*********************
+ * MEMBER FUNCTIONS
+ *********************/
+
+TagTable::TagTable() {
+	_count = 0;
+	_capacity = 0;
+	_index = NULL;
+	_indexMask = 0;
+	_next = NULL;
+	_seq = NULL;
+	_value = NULL;
+	_updateTime = NULL;
+	_updateMonoTime = NULL;
+	_expiryTime = NULL;
+	_notify = NULL;
+	_historySize = 0;
+	_historyCount = NULL;
+	_historyTime = NULL;
+	_historyValue = NULL;
+	_topicIndex = NULL;
+	_topicIndexMask = 0;
+	_topicCount = 0;
+	_config = NULL;
+}
+
+TagTable::~TagTable() {
+	delete [] _index;
+	delete [] _next;
+	delete [] _seq;
+	delete [] _value;
+	delete [] _updateTime;
+	delete [] _updateMonoTime;
+	delete [] _expiryTime;
+	delete [] _notify;
+	delete [] _historyCount;
+	delete [] _historyTime;
+	delete [] _historyValue;
+	delete [] _topicIndex;
+	delete [] _config;
+}
+
+int TagTable::create(int count, int historySize) {
+	unsigned int indexSize = 2;
+	if ((_capacity > 0) || (count < 1)) return -1;
+	if (historySize > 0) {
+		// a power of 2 allows to wrap the ring buffers with a mask
+		_historySize = 1;
+		while (_historySize < historySize) _historySize <<= 1;
+		_historyCount = new std::atomic<uint32_t>[count];
+		_historyTime = new std::atomic<int64_t>[count * _historySize];
+		_historyValue = new std::atomic<double>[count * _historySize];
+		for (int i = 0; i < count; i++) {
+			_historyCount[i].store(0, memory_order_relaxed);
+		}
+	}
+	// keep the index at most half full
+	while (indexSize < ((unsigned int)count * 2)) indexSize <<= 1;
+	_index = new tagtable_slot[indexSize];
+	_indexMask = indexSize - 1;
+	for (unsigned int i = 0; i < indexSize; i++) {
+		_index[i].channel = 0;
+		_index[i].first = -1;
+	}
+	_topicIndex = new tag_topic_slot[TAGTABLE_TOPIC_INDEX_SIZE];
+	_topicIndexMask = TAGTABLE_TOPIC_INDEX_SIZE - 1;
+	for (unsigned int i = 0; i <= _topicIndexMask; i++) {
+		_topicIndex[i].index = -1;
+	}
+	_next = new int32_t[count];
+	_seq = new std::atomic<uint32_t>[count];
+	_value = new std::atomic<double>[count];
+	_updateTime = new std::atomic<int64_t>[count];
+	_updateMonoTime = new std::atomic<int64_t>[count];
+	_expiryTime = new int64_t[count];
+	_notify = new bool[count];
+	_config = new Tag[count];
+	for (int i = 0; i < count; i++) {
+		_next[i] = -1;
+		_seq[i].store(0, memory_order_relaxed);
+		_value[i].store(0.0, memory_order_relaxed);
+		_updateTime[i].store(0, memory_order_relaxed);
+		_updateMonoTime[i].store(0, memory_order_relaxed);
+		_expiryTime[i] = 0;
+		_notify[i] = false;
+	}
+	_capacity = count;
+	_count = 0;
+	return 0;
+}
+
+/**
+ * find the index slot of a channel
+ * @returns the slot holding the channel or the empty slot to insert it
+ */
+tagtable_slot* TagTable::_slot(int channel) {
+	unsigned int pos = ((uint32_t)channel * 2654435761U) & _indexMask;
+	while ((_index[pos].first >= 0) && (_index[pos].channel != channel))
+		pos = (pos + 1) & _indexMask;
+	return &_index[pos];
+}
+
+int TagTable::addTag(int channel) {
+	tagtable_slot *slot;
+	int index, last;
+	if (_count >= _capacity) return -1;
+	index = _count++;
+	slot = _slot(channel);
+	if (slot->first < 0) {
+		slot->channel = channel;
+		slot->first = index;
+	} else {
+		// keep tags of a channel in configuration order
+		last = slot->first;
+		while (_next[last] >= 0) last = _next[last];
+		_next[last] = index;
+	}
+	_config[index].setChannel(channel);
+	return index;
+}
+
+int TagTable::count(void) {
+	return _count;
+}
+
+Tag* TagTable::config(int index) {
+	if ((index < 0) || (index >= _count)) return NULL;
+	return &_config[index];
+}
+
+int TagTable::find(int channel) {
+	if (_count == 0) return -1;
+	return _slot(channel)->first;
+}
+
+/**
+ * find the index slot of a topic
+ * @returns the slot holding the topic or the empty slot to insert it
+ */
+tag_topic_slot* TagTable::_topicSlot(std::string_view topic, uint32_t hash) {
+	unsigned int pos = hash & _topicIndexMask;
+	while (_topicIndex[pos].index >= 0) {
+		// compare strings only if the full hash matches
+		if ((_topicIndex[pos].hash == hash) && (topic == _config[_topicIndex[pos].index].getTopic()))
+			break;
+		pos = (pos + 1) & _topicIndexMask;
+	}
+	return &_topicIndex[pos];
+}
+
+/**
+ * double the size of the topic index
+ */
+void TagTable::_growTopicIndex(void) {
+	tag_topic_slot *old = _topicIndex;
+	unsigned int oldSize = _topicIndexMask + 1, pos;
+	_topicIndex = new tag_topic_slot[oldSize * 2];
+	_topicIndexMask = (oldSize * 2) - 1;
+	for (unsigned int i = 0; i <= _topicIndexMask; i++) {
+		_topicIndex[i].index = -1;
+	}
+	// the indexed topics are unique, only the hash is needed to move them
+	for (unsigned int i = 0; i < oldSize; i++) {
+		if (old[i].index < 0) continue;
+		pos = old[i].hash & _topicIndexMask;
+		while (_topicIndex[pos].index >= 0) pos = (pos + 1) & _topicIndexMask;
+		_topicIndex[pos] = old[i];
+	}
+	delete [] old;
+}
+
+int TagTable::setTopic(int index, const char* topic) {
+	tag_topic_slot *slot;
+	uint32_t hash;
+	if ((index < 0) || (index >= _count) || (topic == NULL)) return -1;
+	_config[index].setTopic(topic);
+	if (topic[0] == 0) return 0;
+	// keep the index at most half full
+	if (((unsigned int)_topicCount + 1) * 2 > _topicIndexMask + 1) _growTopicIndex();
+	hash = topic_hash(topic);
+	slot = _topicSlot(topic, hash);
+	// keep the first tag of a topic
+	if (slot->index >= 0) return 0;
+	slot->hash = hash;
+	slot->index = index;
+	_topicCount++;
+	return 0;
+}
+
+int TagTable::findTopic(const char* topic) {
+	return findTopic(std::string_view(topic));
+}
+
+int TagTable::findTopic(std::string_view topic) {
+	if (_topicCount == 0) return -1;
+	return _topicSlot(topic, topic_hash(topic))->index;
+}
+
+int TagTable::next(int index) {
+	return _next[index];
+}
+
+void TagTable::setValue(int index, double value, const struct timespec *monoTime, const struct timespec *realTime) {
+	uint32_t seq = _seq[index].load(memory_order_relaxed);
+	// odd sequence tells readers an update is in progress, it also keeps
+	// out another thread updating the same tag (device and mqtt input)
+	do {
+		while (seq & 1) seq = _seq[index].load(memory_order_relaxed);
+	} while (!_seq[index].compare_exchange_weak(seq, seq + 1, memory_order_acquire, memory_order_relaxed));
+	atomic_thread_fence(memory_order_release);
+	_value[index].store(value, memory_order_relaxed);
+	_updateMonoTime[index].store((monoTime->tv_sec * NSEC_PER_SEC) + monoTime->tv_nsec, memory_order_relaxed);
+	_updateTime[index].store((realTime->tv_sec * NSEC_PER_SEC) + realTime->tv_nsec, memory_order_relaxed);
+	if (_historySize > 0) {
+		uint32_t n = _historyCount[index].load(memory_order_relaxed);
+		int pos = (index * _historySize) + (n & (_historySize - 1));
+		_historyTime[pos].store((realTime->tv_sec * NSEC_PER_SEC) + realTime->tv_nsec, memory_order_relaxed);
+		_historyValue[pos].store(value, memory_order_relaxed);
+		_historyCount[index].store(n + 1, memory_order_relaxed);
+	}
+	_seq[index].store(seq + 2, memory_order_release);
+	if (_notify[index]) _config[index].notifyUpdate();
+}
+
+void TagTable::setNotify(int index, bool enable) {
+	if ((index < 0) || (index >= _count)) return;
+	_notify[index] = enable;
+}
+
+void TagTable::getValue(int index, tag_value *snapshot) {
+	uint32_t seq;
+	do {
+		seq = _seq[index].load(memory_order_acquire);
+		snapshot->value = _value[index].load(memory_order_relaxed);
+		snapshot->updateTime = _updateTime[index].load(memory_order_relaxed);
+		snapshot->updateMonoTime = _updateMonoTime[index].load(memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+		// retry if an update was in progress or has happened meanwhile
+	} while ((seq & 1) || (seq != _seq[index].load(memory_order_relaxed)));
+}
+
+int TagTable::historySize(void) {
+	return _historySize;
+}
+
+int TagTable::getHistory(int index, tag_sample *samples, int count) {
+	uint32_t seq, n;
+	int base, num;
+	if ((_historySize == 0) || (index < 0) || (index >= _count)) return 0;
+	if (count > _historySize) count = _historySize;
+	base = index * _historySize;
+	do {
+		seq = _seq[index].load(memory_order_acquire);
+		n = _historyCount[index].load(memory_order_relaxed);
+		num = (n < (uint32_t)count) ? n : count;
+		// oldest requested sample first
+		for (int i = 0; i < num; i++) {
+			int pos = base + ((n - num + i) & (_historySize - 1));
+			samples[i].time = _historyTime[pos].load(memory_order_relaxed);
+			samples[i].value = _historyValue[pos].load(memory_order_relaxed);
+		}
+		atomic_thread_fence(memory_order_acquire);
+		// retry if an update was in progress or has happened meanwhile
+	} while ((seq & 1) || (seq != _seq[index].load(memory_order_relaxed)));
+	return num;
+}
+
+void TagTable::setExpiryTime(int index, int seconds) {
+	if ((index < 0) || (index >= _count)) return;
+	_expiryTime[index] = (seconds > 0) ? (seconds * NSEC_PER_SEC) : 0;
+}
+
+int TagTable::getExpiryTime(int index) {
+	if ((index < 0) || (index >= _count)) return 0;
+	return _expiryTime[index] / NSEC_PER_SEC;
+}
+
+bool TagTable::isExpired(int index, int64_t now) {
+	// expiry time 0 = no expiry
+	if (_expiryTime[index] == 0) return false;
+	return ((_updateMonoTime[index].load(memory_order_relaxed) + _expiryTime[index]) < now);
+}
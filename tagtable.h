@@ -0,0 +1,217 @@
+/**
+ * @file tagtable.h
+-----------------------------------------------------------------------------
+ The TagTable class holds all configured 1820 tags, indexed by the order
+ in which they were added. A small open addressing hash maps a channel
+ number to its tags, any number of tags may share a channel (e.g. with
+ different scaling or topics). Memory use is proportional to the number
+ of tags, not to the highest channel number.
+ Per sample state (value, update times and expiry) is kept in dense
+ arrays, one array per field, so a scan over thousands of tags only
+ touches the fields it needs. The configuration of each tag (topic,
+ format, scaling, noread handling ...) is kept in a separate array of
+ Tag objects which is only accessed when a tag is published.
+ The value and update times of a tag are protected by a sequence
+ lock: the read thread updates values without blocking, readers take a
+ consistent snapshot and retry if they raced with an update. Values
+ received via MQTT are set by the mosquitto thread, two threads updating
+ the same tag at once are serialised by the sequence lock (the second
+ spins for the duration of one update).
+ Tags are found by their full topic through a second open addressing
+ hash, which grows with the number of topics. It is built while the
+ tags are configured and only read afterwards.
+ Optionally every tag keeps its most recent samples in a ring buffer,
+ all ring buffers share one arena which is allocated with the table.
+ The history is protected by the same sequence lock as the value.
+ A tag can be set to notify every value update through the callback of
+ its configuration Tag, the callback is called by the updating thread.
+-----------------------------------------------------------------------------
+*/
+
+#ifndef _TAGTABLE_H_
+#define _TAGTABLE_H_
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+
+#include "1820tag.h"
+
+/*********************
+ *      DEFINES
+ *********************/
+#define TAGTABLE_TOPIC_INDEX_SIZE 64	// initial size of the topic index (power of 2)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+// a value and the time it was received
+struct tag_sample {
+	int64_t time;		// [ns] CLOCK_REALTIME
+	double value;
+};
+
+struct tagtable_slot {
+	int32_t channel;
+	int32_t first;		// first tag of the channel, -1 = empty slot
+};
+
+struct tag_topic_slot {
+	uint32_t hash;		// topic hash
+	int32_t index;		// index of the tag, -1 = empty slot
+};
+
+/**********************
+ *      CLASS
+ **********************/
+
+class TagTable {
+public:
+	TagTable();
+	~TagTable();
+
+	/**
+	 * Allocate the table
+	 * @param count: maximum number of tags
+	 * @param historySize: samples kept per tag (rounded up to a power of 2), 0 = no history
+	 * @returns 0 if successful, -1 if the table already exists
+	 */
+	int create(int count, int historySize = 0);
+
+	/**
+	 * Add a tag for a channel
+	 * @returns index of the new tag, -1 if the table is full
+	 */
+	int addTag(int channel);
+
+	/**
+	 * @returns the number of tags
+	 */
+	int count(void);
+
+	/**
+	 * Get the configuration of a tag
+	 * @returns the tag or NULL if index is out of range
+	 */
+	Tag* config(int index);
+
+	/**
+	 * Find the tags of a channel
+	 * @returns index of the first tag of the channel, -1 if there is none
+	 */
+	int find(int channel);
+
+	/**
+	 * Set the topic of a tag and add it to the topic index
+	 * The topic of a tag must not be changed once it is set
+	 * @returns 0 if successful, -1 if index is out of range
+	 */
+	int setTopic(int index, const char* topic);
+
+	/**
+	 * Find a tag by its topic
+	 * @returns index of the first tag with the topic, -1 if there is none
+	 */
+	int findTopic(const char* topic);
+	int findTopic(std::string_view topic);
+
+	/**
+	 * Get the next tag of the same channel
+	 * @param index: index returned by find() or next()
+	 * @returns index of the next tag, -1 if there is none
+	 */
+	int next(int index);
+
+	/**
+	 * Set the value with the time it was received
+	 * May be called by several threads
+	 * @param index: the tag index
+	 * @param value: the new value
+	 * @param monoTime: receive time (CLOCK_MONOTONIC)
+	 * @param realTime: receive time (CLOCK_REALTIME)
+	 */
+	void setValue(int index, double value, const struct timespec *monoTime, const struct timespec *realTime);
+
+	/**
+	 * Call the callback of the tag configuration on every value update
+	 * @param index: the tag index
+	 * @param enable: true to notify updates
+	 */
+	void setNotify(int index, bool enable);
+
+	/**
+	 * Get value and update times without locking
+	 * @param index: the tag index
+	 * @param snapshot: receives a consistent copy
+	 */
+	void getValue(int index, tag_value *snapshot);
+
+	/**
+	 * @returns the number of samples kept per tag, 0 = no history
+	 */
+	int historySize(void);
+
+	/**
+	 * Get the most recent samples of a tag without locking
+	 * @param index: the tag index
+	 * @param samples: receives the samples, oldest first
+	 * @param count: maximum number of samples
+	 * @returns the number of samples copied
+	 */
+	int getHistory(int index, tag_sample *samples, int count);
+
+	/**
+	 * Set expiry time
+	 * @param seconds: max seconds between updates, 0 = no expiry
+	 */
+	void setExpiryTime(int index, int seconds);
+
+	/**
+	 * Get expiry time
+	 * @returns max seconds between updates, 0 = no expiry
+	 */
+	int getExpiryTime(int index);
+
+	/**
+	 * Get value expired
+	 * @param now: current time [ns] (CLOCK_MONOTONIC)
+	 */
+	bool isExpired(int index, int64_t now);
+
+private:
+	tagtable_slot* _slot(int channel);
+	tag_topic_slot* _topicSlot(std::string_view topic, uint32_t hash);
+	void _growTopicIndex(void);
+
+	int _count;
+	int _capacity;
+	// channel index
+	tagtable_slot *_index;
+	unsigned int _indexMask;				// index size - 1 (power of 2)
+	int32_t *_next;							// next tag of the same channel, -1 = none
+	// hot per sample state
+	std::atomic<uint32_t> *_seq;			// sequence lock, odd while an update is in progress
+	std::atomic<double> *_value;
+	std::atomic<int64_t> *_updateTime;		// [ns] CLOCK_REALTIME
+	std::atomic<int64_t> *_updateMonoTime;	// [ns] CLOCK_MONOTONIC, 0 = never updated
+	int64_t *_expiryTime;					// [ns], 0 = no expiry
+	bool *_notify;							// call Tag callback on update
+	// sample history, _historySize samples per tag
+	int _historySize;						// power of 2
+	std::atomic<uint32_t> *_historyCount;	// samples written
+	std::atomic<int64_t> *_historyTime;		// [ns] CLOCK_REALTIME
+	std::atomic<double> *_historyValue;
+	// topic index
+	tag_topic_slot *_topicIndex;
+	unsigned int _topicIndexMask;			// index size - 1 (power of 2)
+	int _topicCount;						// indexed topics
+	// cold configuration
+	Tag *_config;
+};
+
+#endif /* _TAGTABLE_H_ */
@@ -0,0 +1,209 @@
+/**
+ * @file topictrie.cpp
+ *
+ * https://github.com/helioz2000/1820bridge
+ *
+ * Author: Erwin Bejsta
+ * August 2020
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include "topictrie.h"
+#include "1820tag.h"
+
+#include <string.h>
+
+using namespace std;
+
+/*********************
+ * MEMBER FUNCTIONS
+ *********************/
+
+TopicTrie::TopicTrie() {
+	_edges = new topictrie_edge[TOPICTRIE_INITIAL_SIZE];
+	_edgeMask = TOPICTRIE_INITIAL_SIZE - 1;
+	for (uint32_t i = 0; i <= _edgeMask; i++) _edges[i].parent = -1;
+	_edgeCount = 0;
+	_filterCount = 0;
+	_newNode();		// TOPICTRIE_ROOT
+}
+
+TopicTrie::~TopicTrie() {
+	delete [] _edges;
+}
+
+int TopicTrie::add(const char *filter, int value) {
+	const char *level, *end;
+	int node = TOPICTRIE_ROOT, child, len;
+	int32_t *list;
+	bool hash = false;
+
+	if ((filter == NULL) || (filter[0] == 0)) return -1;
+	// wildcards must be a level of their own, "#" only the last
+	for (level = filter; level != NULL; level = (end != NULL) ? end + 1 : NULL) {
+		end = strchr(level, '/');
+		len = (end != NULL) ? end - level : strlen(level);
+		for (int i = 0; i < len; i++) {
+			if (((level[i] == '+') || (level[i] == '#')) && (len != 1)) return -1;
+		}
+		if ((level[0] == '#') && (end != NULL)) return -1;
+	}
+
+	for (level = filter; level != NULL; level = (end != NULL) ? end + 1 : NULL) {
+		end = strchr(level, '/');
+		len = (end != NULL) ? end - level : strlen(level);
+		if ((len == 1) && (level[0] == '#')) {
+			hash = true;
+			break;
+		}
+		if ((len == 1) && (level[0] == '+')) {
+			if (_nodes[node].plus < 0) {
+				child = _newNode();
+				_nodes[node].plus = child;
+			}
+			node = _nodes[node].plus;
+			continue;
+		}
+		child = _find(node, level, len);
+		if (child < 0) child = _addChild(node, level, len);
+		node = child;
+	}
+
+	list = hash ? &_nodes[node].hashValues : &_nodes[node].values;
+	_valueData.push_back(value);
+	_valueNext.push_back(*list);
+	if (*list < 0) _filterCount++;
+	child = *list;
+	*list = _valueData.size() - 1;
+	return (child < 0) ? 1 : 0;
+}
+
+int TopicTrie::match(const char *topic, int *values, int max) const {
+	if ((topic == NULL) || (topic[0] == 0) || (max <= 0)) return 0;
+	return _match(TOPICTRIE_ROOT, topic, values, max, 0);
+}
+
+int TopicTrie::count(void) {
+	return _filterCount;
+}
+
+/*********************
+ * PRIVATE FUNCTIONS
+ *********************/
+
+/**
+ * match the remaining levels of a topic below a node
+ * @param level: the next level, NULL if all levels are matched
+ * @param count: values found so far
+ * @returns values found
+ */
+int TopicTrie::_match(int node, const char *level, int *values, int max, int count) const {
+	const char *end;
+	const char *next = NULL;
+	int child, len;
+	// "$SYS/..." etc. are not matched by a wildcard in the first level
+	bool wild = (node != TOPICTRIE_ROOT) || (level[0] != '$');
+
+	// "#" matches the rest, also if nothing is left
+	if (wild) count = _values(_nodes[node].hashValues, values, max, count);
+	if (level == NULL) return _values(_nodes[node].values, values, max, count);
+	end = strchr(level, '/');
+	if (end != NULL) {
+		len = end - level;
+		next = end + 1;
+	} else {
+		len = strlen(level);
+	}
+	child = _find(node, level, len);
+	if (child >= 0) count = _match(child, next, values, max, count);
+	if (wild && (_nodes[node].plus >= 0)) count = _match(_nodes[node].plus, next, values, max, count);
+	return count;
+}
+
+/**
+ * copy the value list of a filter
+ * @returns values found
+ */
+int TopicTrie::_values(int first, int *values, int max, int count) const {
+	while ((first >= 0) && (count < max)) {
+		values[count++] = _valueData[first];
+		first = _valueNext[first];
+	}
+	return count;
+}
+
+/**
+ * find the child of a node
+ * @returns the child node, -1 if there is none
+ */
+int TopicTrie::_find(int node, const char *level, int len) const {
+	uint32_t hash = _hash(node, level, len);
+	uint32_t pos = hash & _edgeMask;
+	const topictrie_edge *edge;
+
+	while (_edges[pos].parent >= 0) {
+		edge = &_edges[pos];
+		if ((edge->hash == hash) && (edge->parent == node) && (edge->nameLen == (uint32_t)len)
+			&& (memcmp(&_names[edge->name], level, len) == 0))
+			return edge->child;
+		pos = (pos + 1) & _edgeMask;
+	}
+	return -1;
+}
+
+/**
+ * add a named child to a node
+ * @returns the new child node
+ */
+int TopicTrie::_addChild(int node, const char *level, int len) {
+	uint32_t hash = _hash(node, level, len), pos;
+	int child = _newNode();
+
+	// keep the table at most half full
+	if ((uint32_t)(_edgeCount + 1) * 2 > _edgeMask) _grow();
+	pos = hash & _edgeMask;
+	while (_edges[pos].parent >= 0) pos = (pos + 1) & _edgeMask;
+	_edges[pos].hash = hash;
+	_edges[pos].parent = node;
+	_edges[pos].child = child;
+	_edges[pos].name = _names.length();
+	_edges[pos].nameLen = len;
+	_names.append(level, len);
+	_edgeCount++;
+	return child;
+}
+
+int TopicTrie::_newNode(void) {
+	topictrie_node node;
+	node.plus = -1;
+	node.values = -1;
+	node.hashValues = -1;
+	_nodes.push_back(node);
+	return _nodes.size() - 1;
+}
+
+/**
+ * double the size of the child table and rehash the edges
+ */
+void TopicTrie::_grow(void) {
+	topictrie_edge *old = _edges;
+	uint32_t oldMask = _edgeMask, pos;
+
+	_edgeMask = (_edgeMask * 2) + 1;
+	_edges = new topictrie_edge[_edgeMask + 1];
+	for (uint32_t i = 0; i <= _edgeMask; i++) _edges[i].parent = -1;
+	for (uint32_t i = 0; i <= oldMask; i++) {
+		if (old[i].parent < 0) continue;
+		pos = old[i].hash & _edgeMask;
+		while (_edges[pos].parent >= 0) pos = (pos + 1) & _edgeMask;
+		_edges[pos] = old[i];
+	}
+	delete [] old;
+}
+
+uint32_t TopicTrie::_hash(int node, const char *level, int len) {
+	return topic_hash(string_view(level, len)) ^ ((uint32_t)node * 0x9E3779B1u);
+}
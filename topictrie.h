@@ -0,0 +1,105 @@
+/**
+ * @file topictrie.h
+-----------------------------------------------------------------------------
+ The TopicTrie class finds the subscriptions (topic filters) matching the
+ topic of a received message. Each topic level of a filter is a node of
+ the trie, the children of all nodes are kept in one open addressing hash
+ table keyed by the parent node and the level name. Matching a topic
+ takes one hash lookup per level (plus one branch per "+" node on the
+ way), independent of the number of filters.
+ Filters follow the MQTT rules: "+" matches exactly one level, "#" as the
+ last level matches any number of levels including none ("a/#" matches
+ "a"). Wildcards in the first level don't match topics starting with "$".
+ The trie is built while the configuration is read, afterwards it is
+ only read and match() may be called by several threads without locking.
+-----------------------------------------------------------------------------
+*/
+
+#ifndef _TOPICTRIE_H_
+#define _TOPICTRIE_H_
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define TOPICTRIE_INITIAL_SIZE 64		// initial size of the child table (power of 2)
+#define TOPICTRIE_ROOT 0				// node of the empty topic
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+struct topictrie_node {
+	int32_t plus;				// child for "+", -1 = none
+	int32_t values;				// first value of filters ending here, -1 = none
+	int32_t hashValues;			// first value of filters ending with "#" here, -1 = none
+};
+
+// a named child of a node
+struct topictrie_edge {
+	uint32_t hash;				// hash of parent and level name
+	int32_t parent;				// -1 = empty slot
+	int32_t child;
+	uint32_t name;				// offset of the level name in the name pool
+	uint32_t nameLen;
+};
+
+/**********************
+ *      CLASS
+ **********************/
+
+class TopicTrie {
+public:
+	TopicTrie();
+	~TopicTrie();
+
+	/**
+	 * Add a topic filter
+	 * @param filter: the topic filter, may contain "+" and "#" levels
+	 * @param value: returned by match() for topics matching the filter
+	 * @returns 1 if the filter is new, 0 if it was added before (the value
+	 *          is added as well), -1 if the filter is invalid
+	 */
+	int add(const char *filter, int value);
+
+	/**
+	 * Find the filters matching a topic
+	 * @param topic: topic of a received message
+	 * @param values: receives the values of all matching filters
+	 * @param max: size of values
+	 * @returns number of values, at most max
+	 */
+	int match(const char *topic, int *values, int max) const;
+
+	/**
+	 * @returns number of different filters
+	 */
+	int count(void);
+
+private:
+	int _match(int node, const char *level, int *values, int max, int count) const;
+	int _values(int first, int *values, int max, int count) const;
+	int _find(int node, const char *level, int len) const;
+	int _addChild(int node, const char *level, int len);
+	int _newNode(void);
+	void _grow(void);
+	static uint32_t _hash(int node, const char *level, int len);
+
+	std::vector<topictrie_node> _nodes;
+	topictrie_edge *_edges;		// children of all nodes
+	uint32_t _edgeMask;			// table size - 1
+	int _edgeCount;
+	std::string _names;			// level names of the edges
+	std::vector<int32_t> _valueData;	// values of the filters
+	std::vector<int32_t> _valueNext;	// next value of the same filter, -1 = end
+	int _filterCount;
+};
+
+#endif /* _TOPICTRIE_H_ */
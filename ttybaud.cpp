@@ -0,0 +1,41 @@
+/**
+ * @file ttybaud.cpp
+ *
+ * https://github.com/helioz2000/1820bridge
+ *
+ * Author: Erwin Bejsta
+ * August 2020
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include "ttybaud.h"
+
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+/*********************
+ * GLOBAL FUNCTIONS
+ *********************/
+
+int tty_set_baudrate(int fd, int baud) {
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) < 0)
+		return -1;
+	tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	tio.c_ispeed = baud;
+	tio.c_ospeed = baud;
+	return ioctl(fd, TCSETS2, &tio);
+}
+
+int tty_get_baudrate(int fd) {
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) < 0)
+		return -1;
+	return tio.c_ospeed;
+}
@@ -0,0 +1,34 @@
+/**
+ * @file ttybaud.h
+-----------------------------------------------------------------------------
+ Set arbitrary serial baudrates via the Linux termios2 interface (BOTHER).
+ These functions live in their own translation unit because the kernel
+ termios2 definitions (asm/termbits.h) conflict with termios.h
+-----------------------------------------------------------------------------
+*/
+
+#ifndef _TTYBAUD_H_
+#define _TTYBAUD_H_
+
+#define TTY_BAUD_MIN 50				// lowest supported baudrate
+#define TTY_BAUD_MAX 4000000		// highest supported baudrate
+#define TTY_BAUD_TOLERANCE 2		// max deviation of actual baudrate [%]
+
+/**
+ * Set input and output baudrate
+ * @param fd: file descriptor of an open serial device
+ * @param baud: baudrate in bits per second
+ * @returns 0 on success, -1 on failure (errno is set)
+ */
+int tty_set_baudrate(int fd, int baud);
+
+/**
+ * Get the output baudrate
+ * Note: some drivers round the requested rate to the nearest
+ * rate the hardware can generate
+ * @param fd: file descriptor of an open serial device
+ * @returns baudrate in bits per second, -1 on failure (errno is set)
+ */
+int tty_get_baudrate(int fd);
+
+#endif /* _TTYBAUD_H_ */
@@ -0,0 +1,178 @@
+/**
+ * @file valueformat.cpp
+ *
+ * https://github.com/helioz2000/1820bridge
+ *
+ * Author: Erwin Bejsta
+ * August 2020
+ */
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include "valueformat.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+
+#include <charconv>
+
+using namespace std;
+
+/*********************
+ * GLOBAL FUNCTIONS
+ *********************/
+
+/**
+ * append literal text of a format, %% is replaced with %
+ * @returns false if the text contains a conversion
+ */
+static bool append_literal(string &dst, const char *src, const char *end)
+{
+	while (src < end) {
+		if (*src == '%') {
+			if ((src + 1 >= end) || (src[1] != '%')) return false;
+			src++;
+		}
+		dst += *src++;
+	}
+	return true;
+}
+
+/*********************
+ * MEMBER FUNCTIONS
+ *********************/
+
+ValueFormat::ValueFormat() {
+	_conversion = 0;
+	_upper = false;
+	_width = 0;
+	_precision = -1;
+	_left = false;
+	_zero = false;
+	_sign = 0;
+}
+
+int ValueFormat::compile(const char *format) {
+	const char *p, *spec = NULL;
+	ValueFormat f;
+
+	if ((format == NULL) || (format[0] == 0)) {
+		*this = f;
+		return 0;
+	}
+	// find the conversion, skipping %%
+	for (p = format; *p != 0; p++) {
+		if (*p != '%') continue;
+		if (p[1] == '%') {
+			p++;
+			continue;
+		}
+		spec = p;
+		break;
+	}
+	if (spec == NULL) return -1;
+	if (!append_literal(f._prefix, format, spec)) return -1;
+
+	p = spec + 1;
+	for (;; p++) {
+		if (*p == '-') f._left = true;
+		else if (*p == '0') f._zero = true;
+		else if (*p == '+') f._sign = '+';
+		else if ((*p == ' ') && (f._sign == 0)) f._sign = ' ';
+		else if (*p != '#') break;
+	}
+	while (isdigit(*p)) {
+		f._width = (f._width * 10) + (*p++ - '0');
+		if (f._width > VALUEFORMAT_MAX_WIDTH) return -1;
+	}
+	if (*p == '.') {
+		p++;
+		f._precision = 0;
+		while (isdigit(*p)) {
+			f._precision = (f._precision * 10) + (*p++ - '0');
+			if (f._precision > VALUEFORMAT_MAX_WIDTH) return -1;
+		}
+	}
+	// length modifiers make no difference for a float
+	while ((*p == 'l') || (*p == 'L') || (*p == 'h')) p++;
+	switch (*p) {
+	case 'F': case 'E': case 'G':
+		f._upper = true;
+		f._conversion = tolower(*p);
+		break;
+	case 'f': case 'e': case 'g':
+		f._conversion = *p;
+		break;
+	case 'd': case 'i':
+		f._conversion = 'f';
+		f._precision = 0;
+		break;
+	default:
+		return -1;
+	}
+	// printf default precision
+	if (f._precision < 0) f._precision = 6;
+	if (!append_literal(f._suffix, p + 1, p + 1 + strlen(p + 1))) return -1;
+	*this = f;
+	return 0;
+}
+
+int ValueFormat::format(char *buf, int size, float value) const {
+	char num[VALUEFORMAT_MAX_WIDTH + 48];
+	char *first = num, *last = num + sizeof(num);
+	to_chars_result res;
+	int len, pad, signLen = 0, total;
+
+	// sign first, width padding goes between sign and digits with the 0 flag
+	if (signbit(value) && !isnan(value)) {
+		*first++ = '-';
+		value = -value;
+	} else if (_sign != 0) {
+		*first++ = _sign;
+	}
+	signLen = first - num;
+	switch (_conversion) {
+	case 'f':
+		res = to_chars(first, last, value, chars_format::fixed, _precision);
+		break;
+	case 'e':
+		res = to_chars(first, last, value, chars_format::scientific, _precision);
+		break;
+	case 'g':
+		res = to_chars(first, last, value, chars_format::general, (_precision == 0) ? 1 : _precision);
+		break;
+	default:
+		res = to_chars(first, last, value);
+		break;
+	}
+	if (res.ec != errc()) return -1;
+	len = res.ptr - num;
+	if (_upper) {
+		for (int i = signLen; i < len; i++) num[i] = toupper(num[i]);
+	}
+
+	pad = (_width > len) ? (_width - len) : 0;
+	total = _prefix.length() + pad + len + _suffix.length();
+	if (total >= size) return -1;
+
+	memcpy(buf, _prefix.data(), _prefix.length());
+	buf += _prefix.length();
+	if (_left) {
+		memcpy(buf, num, len);
+		memset(buf + len, ' ', pad);
+	} else if (_zero && isfinite(value)) {
+		memcpy(buf, num, signLen);
+		memset(buf + signLen, '0', pad);
+		memcpy(buf + signLen + pad, num + signLen, len - signLen);
+	} else {
+		memset(buf, ' ', pad);
+		memcpy(buf + pad, num, len);
+	}
+	buf += pad + len;
+	memcpy(buf, _suffix.data(), _suffix.length());
+	buf[_suffix.length()] = 0;
+	return total;
+}
@@ -0,0 +1,65 @@
+/**
+ * @file valueformat.h
+-----------------------------------------------------------------------------
+ The ValueFormat class formats a numeric value for publishing. The printf
+ style format of a tag (e.g. "%.1f", "T=%5.2f C") is parsed once when it
+ is configured, formatting a value then only converts the number (via
+ std::to_chars) and adds width, padding, prefix and suffix. The output is
+ always bounded by the size of the caller's buffer.
+ Supported is a single float conversion: f F e E g G (and d i, which are
+ formatted as f without decimals) with the flags - + 0 space, width and
+ precision. %% is a literal percent sign. An empty format produces the
+ shortest representation which reads back as the same value.
+-----------------------------------------------------------------------------
+*/
+
+#ifndef _VALUEFORMAT_H_
+#define _VALUEFORMAT_H_
+
+/*********************
+ *      INCLUDES
+ *********************/
+#include <string>
+
+/*********************
+ *      DEFINES
+ *********************/
+#define VALUEFORMAT_MAX_WIDTH 32		// maximum field width or precision
+
+/**********************
+ *      CLASS
+ **********************/
+
+class ValueFormat {
+public:
+	ValueFormat();
+
+	/**
+	 * Parse a printf style format
+	 * @param format: the format, NULL or "" = shortest representation
+	 * @returns 0 if successful, -1 if the format is not supported (the previous format is kept)
+	 */
+	int compile(const char *format);
+
+	/**
+	 * Format a value
+	 * @param buf: receives the null terminated result
+	 * @param size: size of buf
+	 * @param value: the value
+	 * @returns length of the result, -1 if it doesn't fit into buf
+	 */
+	int format(char *buf, int size, float value) const;
+
+private:
+	std::string _prefix;
+	std::string _suffix;
+	char _conversion;			// f e g, 0 = shortest
+	bool _upper;				// F E G
+	int _width;					// 0 = none
+	int _precision;				// -1 = default
+	bool _left;					// - flag
+	bool _zero;					// 0 flag
+	char _sign;					// + or space flag, 0 = none
+};
+
+#endif /* _VALUEFORMAT_H_ */